@@ -30,24 +30,81 @@ Original copyright notice :
   arising out of or in connection with the use or performance of
   this software.
 *******************************************************************************/
+#include <avr/pgmspace.h>
+
 #include "AX.h" 
+#include "AX2.h"
 #include "debug.h"
 #include "eeprom.h"
 
-extern RingBuffer_t ToUSB_Buffer;
-
 // registers
-uint8_t regs[REG_TABLE_SIZE] = {MODEL_NUMBER_L, MODEL_NUMBER_H, FIRMWARE_VERSION, AX_ID_DEVICE, USART_TIMEOUT, SEND_TIMEOUT, RECEIVE_TIMEOUT, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+uint8_t regs[REG_TABLE_SIZE] = {MODEL_NUMBER_L, MODEL_NUMBER_H, FIRMWARE_VERSION, AX_ID_DEVICE, USART_TIMEOUT, SEND_TIMEOUT, RECEIVE_TIMEOUT, 0, SKIP_CYCLES, KEYFRAME_INTERVAL, 0, 0, 0, 0, 0, 0};
 
 #define   USART_TIMEOUT_MIN     8   //  x 20us
 #define    SEND_TIMEOUT_MIN     0   //  x 20us
 #define RECEIVE_TIMEOUT_MIN     10  //  x 20us
+#define     SKIP_CYCLES_MIN     1
+#define KEYFRAME_INTERVAL_MIN   1
+
+// Response time and failures of the servos read by sync_read/bulk_read, for the adaptive timeouts
+typedef struct {
+    uint8_t id;         // AX_ID_BROADCAST if the slot is free
+    uint8_t latency:6;  // smoothed delay before the first byte of the reply, x 20us, 0 if unknown, up to AX_LATENCY_MAX
+    uint8_t failures:2; // consecutive failures, up to AX_DEAD_THRESHOLD
+    uint8_t skip;       // number of reads left to skip
+} servo_stats_t;
+
+static servo_stats_t servo_stats[AX_ADAPTIVE_SLOTS];
+static uint8_t next_stats_slot = 0; // where to start looking for a slot to reuse when they are all taken
+
+static uint16_t first_byte_delay; // set by axWaitPacket, in timer ticks, 0xFFFF if nothing was received
+
+// STREAM: sync_read repeated by the USB2AX itself
+static volatile uint8_t stream_nb_servos = 0;   // 0 when not streaming, can be cleared from the USB interrupt (see stream_stop)
+static uint8_t  stream_arena = false;   // the arena is in the ARENA_STREAM layout because of the stream
+static uint8_t  stream_addr;
+static uint8_t  stream_nb_to_read;
+static uint8_t  stream_sequence;
+static uint32_t stream_period;          // in timer ticks
+static uint32_t stream_next;            // time of the next frame
+static uint8_t  stream_keyframe_countdown;                  // delta frames left before the next full frame
+// (the data last sent for each servo in delta mode is in stream_previous_frame, in the arena)
+
+uint8_t ax_protocol = AX_PROTOCOL_1;
+
+volatile uint8_t stream_length = 0;
+volatile uint8_t stream_checksum = 0;
+
+// sync_read engine: the servos are read one after the other from the ISRs, the main loop only steps in between status packets
+volatile uint8_t sync_read_state = SYNC_READ_IDLE;
+uint16_t sync_read_timeout;
+uint16_t sync_read_sent_at;
+uint16_t sync_read_first_byte_at;
+static uint8_t* sync_read_ids;          // in the buffer of the USB parser, which leaves it alone while the sync_read runs
+static uint8_t  sync_read_nb_servos;
+static uint8_t  sync_read_addr;
+static uint8_t  sync_read_nb_to_read;
+static uint8_t  sync_read_slot_size;    // bytes per servo in the reply: the data, and possibly a status byte
+static uint8_t  sync_read_servos_per_packet;
+static uint8_t  sync_read_index;        // servo being read
+static uint8_t  sync_read_packet_end;   // index of the first servo of the next status packet
+static uint8_t  sync_read_checksum;     // of the status packet being sent
+static servo_stats_t* sync_read_stats;  // of the servo being read, NULL without adaptive timeouts
+volatile uint8_t sync_read_chain = SYNC_READ_CHAIN_NONE;
+uint8_t sync_read_request[AX_READ_INSTRUCTION_SIZE];
+static uint8_t  sync_read_next_timeout;       // of the servo sync_read_request is for, x 20us
+static servo_stats_t* sync_read_next_stats;   // of the servo sync_read_request is for
+static volatile uint8_t sync_read_isr_busy = false; // the TIMER1_COMPA ISR is running with interrupts enabled
+static volatile uint8_t sync_read_isr_deferred = false; // the reply of the next servo ended in the meantime
 
-uint8_t min_vals[REG_TABLE_SIZE - START_RW_ADDR] = {USART_TIMEOUT_MIN,  SEND_TIMEOUT_MIN,  RECEIVE_TIMEOUT_MIN,   0,   0,   0,   0,   0,   0,   0,   0,   0};
+static const uint8_t min_vals[ADDR_STATS - START_RW_ADDR] PROGMEM = {USART_TIMEOUT_MIN,  SEND_TIMEOUT_MIN,  RECEIVE_TIMEOUT_MIN,   0,   SKIP_CYCLES_MIN,   KEYFRAME_INTERVAL_MIN,   0,   0,   0,   0,   0,   0,   0,   0};
 
 
 void axInit(){
     eeprom_init();
+    for (uint8_t i = 0; i < AX_ADAPTIVE_SLOTS; i++){
+        servo_stats[i].id = AX_ID_BROADCAST;
+    }
 }
 
 
@@ -55,6 +112,20 @@ void axInit(){
  * Send status packet
  */
 void axStatusPacket(uint8_t err, uint8_t* data, uint8_t nb_bytes){
+	if (ax_protocol == AX_PROTOCOL_2){
+		uint8_t err2 = (err & AX_ERROR_INSTRUCTION) ? AX2_ERROR_INSTRUCTION 
+		             : (err & AX_ERROR_CHECKSUM)    ? AX2_ERROR_CRC
+		             : (err & AX_ERROR_RANGE)       ? AX2_ERROR_RANGE : AX2_ERROR_NONE;
+		ax2StatusPacket(err2, data, nb_bytes);
+		return;
+	}
+	
+	if (AX_REPLY_HEADER_SIZE + nb_bytes + 1 > USB_data_size()){ // a long SCAN or READ of the registers while a STREAM keeps the USB buffer small
+		err = AX_ERROR_RANGE;
+		nb_bytes = 0;
+	}
+	wait_USB_room(AX_REPLY_HEADER_SIZE + nb_bytes + 1);
+	
 	uint16_t checksum = AX_ID_DEVICE + 2 + nb_bytes + err;
 	
 	cdc_send_byte(0xff);
@@ -67,25 +138,37 @@ void axStatusPacket(uint8_t err, uint8_t* data, uint8_t nb_bytes){
 		checksum += data[i];
 	}
 	cdc_send_byte(255-(checksum %256));
+	end_USB_frame();
 }
 
 
-// try to read a Dynamixel packet
-// return true if successful, false otherwise 
-uint16_t axReadPacket(uint8_t length){
-    usart_timer = 0;
-	// wait until the expected number of byte has been read
+// wait until the expected number of bytes has been received, or until the USART times out (timeout x 20us).
+// first: this is the first wait for the reply, the turnaround time is only recorded then
+void axWaitPacket(uint8_t length, uint8_t timeout, uint8_t first){
+    uint16_t start = timer_now();
+    uint16_t usart_timer = start; // time of the last byte received
+    uint8_t count = local_rx_buffer_count;
+    first_byte_delay = 0xFFFF;
 	while( local_rx_buffer_count < length ){ 
-		if(usart_timer > regs[ADDR_USART_TIMEOUT]){
-		    break;
+		if (local_rx_buffer_count != count){ // a byte came in, restart the timeout
+			if (count == 0){
+				first_byte_delay = timer_now() - start;
+			}
+			count = local_rx_buffer_count;
+			usart_timer = timer_now();
+		} else if(timer_elapsed(usart_timer, timeout)){
+		    stat_inc(STAT_SERVO_TIMEOUTS);
+		    return;
 		}
 	}
-	if (local_rx_buffer_count != length){
-		return false;
+	if (first){
+		hist_add(ADDR_HIST_TURNAROUND, timer_now() - start); // setRX() returned once the instruction was out
 	}
-	
-	// TODO check for error in the packet, so that we don't wait if the status packet says that something went wrong... ?
-	
+}
+
+
+// check the checksum of the packet in local_rx_buffer
+static uint8_t axPacketIsValid(uint8_t length){
 	// compute checksum
     uint8_t checksum = 0; // accumulator for checksum
     for(uint8_t i=2; i < length; i++){
@@ -100,83 +183,837 @@ uint16_t axReadPacket(uint8_t length){
 }
 
 
-/** Read register value(s) */
-int axGetRegister(uint8_t id, uint8_t addr, uint8_t nb_bytes){  
-   // 0xFF 0xFF ID LENGTH INSTRUCTION PARAM... CHECKSUM    
-    uint16_t checksum = ~((id + 6 + addr + nb_bytes)%256);
+// try to read a Dynamixel packet
+// return true if successful, false otherwise 
+uint16_t axReadPacket(uint8_t length){
+	axWaitPacket(length, regs[ADDR_USART_TIMEOUT], true);
+	if (local_rx_buffer_count != length){
+		return false;
+	}
+	
+	// TODO check for error in the packet, so that we don't wait if the status packet says that something went wrong... ?
+	
+	return axPacketIsValid(length);
+}
+
 
+// ping a servo, return true if it answered (its error byte is then in local_rx_buffer[4])
+static uint8_t axPing(uint8_t id, uint8_t timeout){
     local_rx_buffer_count = 0;
     setTX();
     serial_write(0xFF);
     serial_write(0xFF);
     serial_write(id);
-    serial_write(4);    // length
-    serial_write(AX_CMD_READ_DATA);
-    serial_write(addr);
-    serial_write(nb_bytes);
-    serial_write(checksum);
+    serial_write(2);    // length
+    serial_write(AX_CMD_PING);
+    serial_write(~(id + 2 + AX_CMD_PING));
+    setRX();
+
+    axWaitPacket(6, timeout, true);
+    return local_rx_buffer_count == 6 && local_rx_buffer[2] == id && axPacketIsValid(6);
+}
+
+
+// build a READ_DATA instruction
+static void axReadInstruction(uint8_t* instruction, uint8_t id, uint8_t addr, uint8_t nb_bytes){
+   // 0xFF 0xFF ID LENGTH INSTRUCTION PARAM... CHECKSUM    
+    instruction[0] = 0xFF;
+    instruction[1] = 0xFF;
+    instruction[2] = id;
+    instruction[3] = 4;    // length
+    instruction[4] = AX_CMD_READ_DATA;
+    instruction[5] = addr;
+    instruction[6] = nb_bytes;
+    instruction[7] = ~((id + 6 + addr + nb_bytes)%256);
+}
+
+// start sending a READ_DATA instruction to a servo, the TX ISRs switch to reception once it is out.
+// Doesn't wait for it, so that it can be used with interrupts masked (the USART buffer must have room for it then).
+static void axStartReadInstruction(uint8_t id, uint8_t addr, uint8_t nb_bytes){
+    uint8_t instruction[AX_READ_INSTRUCTION_SIZE];
+    axReadInstruction(instruction, id, addr, nb_bytes);
+
+    local_rx_buffer_count = 0;
+    setTX();
+    for (uint8_t i = 0; i < AX_READ_INSTRUCTION_SIZE; i++){
+        serial_write(instruction[i]);
+    }
+}
+
+// send a READ_DATA instruction to a servo and get ready to receive its reply
+static void axSendReadInstruction(uint8_t id, uint8_t addr, uint8_t nb_bytes){
+    axStartReadInstruction(id, addr, nb_bytes);
     setRX();
+}
+
 
+/** Read register value(s) */
+int axGetRegister(uint8_t id, uint8_t addr, uint8_t nb_bytes){  
+    axSendReadInstruction(id, addr, nb_bytes);
     return axReadPacket(nb_bytes + 6);
 }
 
 
-// sync_read performs a cycle of Dynamixel reads to collect the data from servos to return over USB
-void sync_read(uint8_t* params, uint8_t nb_params){
-    
-    // divert incoming data to a buffer for local processing  
-	passthrough_mode = AX_DIVERT;
-	
-	uint8_t addr = params[0];    // address to read in control table
-    uint8_t nb_to_read = params[1];    // # of bytes to read from each servo
-    uint8_t nb_servos = nb_params - 2;
+// check the reply streamed by the RX ISR: send its parameters to the host if it is valid, drop them otherwise.
+// On success, the sum of the parameters is added to checksum.
+static uint8_t axStreamReplyEnd(uint8_t id, uint8_t nb_bytes, uint8_t* checksum){
+    if ( local_rx_buffer_count == nb_bytes + 6 && stream_checksum == 0xFF
+        && local_rx_buffer[0] == 0xFF && local_rx_buffer[1] == 0xFF
+        && local_rx_buffer[2] == id && local_rx_buffer[3] == nb_bytes + 2 ){
+        // the parameters sum up to whatever the header and checksum byte leave out of the 0xFF total
+        *checksum += 0xFF - id - (nb_bytes + 2) - local_rx_buffer[4] - local_rx_buffer[AX_REPLY_HEADER_SIZE];
+        commit_USB_data();
+        return true;
+    }
+    discard_USB_data();
+    return false;
+}
+
+// fill the slot of a servo which did not answer properly with 0xFF
+static void axStreamPad(uint8_t nb_bytes, uint8_t* checksum){
+    for(uint8_t i = 0; i < nb_bytes; i++){
+        *checksum += 0xFF;
+        cdc_send_byte(0xFF);
+    }
+}
+
+// status byte of a servo after axStreamReplyEnd(), see OPTION_SERVO_STATUS
+static uint8_t axStreamStatus(uint8_t nb_bytes, uint8_t success){
+    if (success){
+        return local_rx_buffer[4]; // error byte of the reply
+    }
+    return (local_rx_buffer_count < nb_bytes + 6) ? AX_STATUS_TIMEOUT : AX_STATUS_CHECKSUM;
+}
+
+// end the slot of a servo: pad it if the servo did not answer properly, then add its status byte if status_size is 1
+static void axStreamSlotEnd(uint8_t nb_bytes, uint8_t status_size, uint8_t success, uint8_t status, uint8_t* checksum){
+    if ( ! success ){
+        axStreamPad(nb_bytes, checksum);
+    }
+    if (status_size){
+        *checksum += status;
+        cdc_send_byte(status);
+    }
+}
+
+// size of the status byte of each servo in sync_read/bulk_read replies, 0 or 1
+static uint8_t axStatusSize(void){
+    return (regs[ADDR_OPTIONS] & OPTION_SERVO_STATUS) ? 1 : 0;
+}
+
+
+/** Read register value(s), with the parameters of the reply going straight from the RX ISR to the USB buffer.
+ *  Must be called in AX_STREAM mode. On success, the sum of the parameters is added to checksum.
+ *  On failure, the bytes that already made it to the USB buffer are dropped.
+ */
+uint8_t axStreamRegister(uint8_t id, uint8_t addr, uint8_t nb_bytes, uint8_t timeout, uint8_t* checksum){
+    uint8_t length = nb_bytes + 6;
+
+    stream_checksum = 0;
+    stream_length = length;
+    axSendReadInstruction(id, addr, nb_bytes);
+    axWaitPacket(length, timeout, true);
+    stream_length = 0; // the RX ISR drops any late byte from now on
+
+    return axStreamReplyEnd(id, nb_bytes, checksum);
+}
+
+
+// layout of the arena with room for the local buffers (and those of the stream, if one is running)
+uint8_t axLocalLayout(void){
+    return stream_arena ? ARENA_STREAM : ARENA_LOCAL;
+}
+
+// keep the data from the USART for local processing (AX_DIVERT or AX_STREAM), after making room for it in the arena
+void axDivert(uint8_t mode){
+    arena_set_layout(axLocalLayout());
+    passthrough_mode = mode;
+}
+
+// allow data from USART to be sent directly to USB again
+void axPassthrough(void){
+    passthrough_mode = AX_PASSTHROUGH;
+    arena_set_layout(stream_arena ? ARENA_STREAM : ARENA_PASSTHROUGH);
+}
+
+// start a status packet whose parameters will be streamed from the servos, return the initial checksum
+static uint8_t axStartStreamedReply(uint8_t nb_bytes, uint8_t err){
+    // stream the parameters of the servo replies to USB, divert the rest for local processing
+	axDivert(AX_STREAM);
 	
 	cdc_send_byte(0xff);
 	cdc_send_byte(0xff);
 	cdc_send_byte(AX_ID_DEVICE);
-	cdc_send_byte(2+(nb_to_read*nb_servos));
-	cdc_send_byte(0);  //error code
-    
-	// get ax data
-	uint8_t fcount = 5; // count of number of bytes in USB IN endpoint buffer
-	uint8_t checksum = AX_ID_DEVICE + (nb_to_read*nb_servos) + 2;  // start accumulating the checksum
-    uint8_t* servos = params + 2; // pointer to the ids of the servos to read from
-	uint8_t* data = local_rx_buffer + 5; // pointer to the parameters in the packet received from the servo
-	for(uint8_t servo_id = 0; servo_id < nb_servos; servo_id++){
-        if( axGetRegister(servos[servo_id], addr, nb_to_read)){
-            for(uint8_t i = 0; i < nb_to_read; i++){
-                checksum += data[i];
-                cdc_send_byte(data[i]);
-				if(fcount++ >= CDC_TXRX_EPSIZE){ // periodically try to flush data to the host
-					send_USB_data();
-                    fcount = 0;
-                }
-            }
-        } else{
-            for(uint8_t i = 0; i < nb_to_read; i++){
-                checksum += 0xFF;
-                cdc_send_byte(0xFF);
-				if(fcount++ >= CDC_TXRX_EPSIZE){ 
-					send_USB_data();
-                    fcount = 0;
+	cdc_send_byte(2 + nb_bytes);
+	cdc_send_byte(err);  //error code
+	
+	return AX_ID_DEVICE + nb_bytes + 2 + err;
+}
+
+// find the stats of a servo, or make room for them
+static servo_stats_t* axServoStats(uint8_t id){
+    for (uint8_t i = 0; i < AX_ADAPTIVE_SLOTS; i++){
+        if (servo_stats[i].id == id){
+            return &servo_stats[i];
+        }
+    }
+    // all the slots taken: reuse one of a servo which answers, so that the failing ones stay in back-off
+    // even when more servos than AX_ADAPTIVE_SLOTS are read, or the next one in turn if they are all failing
+    uint8_t slot = next_stats_slot;
+    for (uint8_t i = 0; i < AX_ADAPTIVE_SLOTS; i++){
+        servo_stats_t* candidate = &servo_stats[slot];
+        if (candidate->id == AX_ID_BROADCAST || (candidate->failures == 0 && candidate->skip == 0)){
+            break;
+        }
+        slot = (slot + 1) % AX_ADAPTIVE_SLOTS;
+    }
+    servo_stats_t* stats = &servo_stats[slot];
+    next_stats_slot = (slot + 1) % AX_ADAPTIVE_SLOTS;
+    stats->id = id;
+    stats->latency = 0;
+    stats->failures = 0;
+    stats->skip = 0;
+    return stats;
+}
+
+// true if the servo is in back-off and will be skipped by its next read
+static uint8_t axIsSkipped(uint8_t id){
+    if ( ! (regs[ADDR_OPTIONS] & OPTION_ADAPTIVE_TIMEOUTS) ){
+        return false;
+    }
+    for (uint8_t i = 0; i < AX_ADAPTIVE_SLOTS; i++){
+        if (servo_stats[i].id == id){
+            return servo_stats[i].skip != 0;
+        }
+    }
+    return false;
+}
+
+// error code of a sync_read/bulk_read reply, given the IDs to read (every stride bytes)
+static uint8_t axSkippedError(uint8_t* ids, uint8_t nb_ids, uint8_t stride){
+    for (uint8_t i = 0; i < nb_ids; i++){
+        if (axIsSkipped(ids[i * stride])){
+            return AX_ERROR_SKIPPED;
+        }
+    }
+    return AX_ERROR_NONE;
+}
+
+// USART timeout (x 20us) to read a servo with, adapted to its usual response time.
+// Returns 0 if the servo is in back-off and must not be read this time. 
+// *stats is set to the stats to update with axAdaptiveResult(), or to NULL without adaptive timeouts.
+static uint8_t axAdaptiveTimeout(uint8_t id, servo_stats_t** stats){
+    uint8_t timeout = regs[ADDR_USART_TIMEOUT];
+    *stats = NULL;
+    if (regs[ADDR_OPTIONS] & OPTION_ADAPTIVE_TIMEOUTS){
+        *stats = axServoStats(id);
+        if ((*stats)->skip){
+            (*stats)->skip--;
+            return 0;
+        }
+        // wait twice the usual time for the first byte, within the limits of the USART timeout
+        if ((*stats)->latency){
+            timeout = min(timeout, max(USART_TIMEOUT_MIN, 2 * (uint16_t)(*stats)->latency + 1));
+        }
+    }
+    return timeout;
+}
+
+// learn from the result of a read (and from first_byte_delay), return success
+static uint8_t axAdaptiveResult(servo_stats_t* stats, uint8_t success){
+    if ( ! stats ){
+        return success;
+    }
+    
+    if (success){
+        uint8_t latency = min(first_byte_delay / TIMER_TICKS_PER_TIMEOUT_UNIT + 1, AX_LATENCY_MAX);
+        stats->latency = stats->latency ? ((uint16_t)stats->latency * 3 + latency) / 4 : latency;
+        stats->failures = 0;
+        return true;
+    }
+    
+    stats->latency = 0; // maybe it just got slower: give it the full timeout next time
+    if (stats->failures < AX_DEAD_THRESHOLD){
+        stats->failures++;
+    }
+    if (stats->failures >= AX_DEAD_THRESHOLD){
+        stats->skip = regs[ADDR_SKIP_CYCLES];
+    }
+    return false;
+}
+
+// read one servo with a timeout adapted to its usual response time, unless it is in back-off.
+// The parameters of the reply are streamed to USB if checksum is given, or left in local_rx_buffer otherwise (AX_DIVERT mode).
+static uint8_t axReadAdaptive(uint8_t id, uint8_t addr, uint8_t nb_bytes, uint8_t* checksum){
+    servo_stats_t* stats;
+    uint8_t timeout = axAdaptiveTimeout(id, &stats);
+    if (timeout == 0){
+        return false;
+    }
+    
+    uint8_t success;
+    if (checksum){
+        success = axStreamRegister(id, addr, nb_bytes, timeout, checksum);
+    } else {
+        axSendReadInstruction(id, addr, nb_bytes);
+        axWaitPacket(nb_bytes + 6, timeout, true);
+        success = local_rx_buffer_count == nb_bytes + 6 && local_rx_buffer[2] == id && axPacketIsValid(nb_bytes + 6);
+    }
+    return axAdaptiveResult(stats, success);
+}
+
+// read one servo into the streamed reply, pad its slot with 0xFF if it did not answer properly,
+// and add its status byte after it if status_size is 1
+static void axStreamSlot(uint8_t id, uint8_t addr, uint8_t nb_bytes, uint8_t status_size, uint8_t* checksum){
+    // the slot, the checksum and possibly the header of the next packet must fit in the USB buffer
+    wait_USB_room(nb_bytes + status_size + 1 + AX_REPLY_HEADER_SIZE);
+    uint8_t skipped = axIsSkipped(id);
+    uint8_t success = axReadAdaptive(id, addr, nb_bytes, checksum);
+    uint8_t status = skipped ? AX_STATUS_SKIPPED : axStreamStatus(nb_bytes, success);
+    axStreamSlotEnd(nb_bytes, status_size, success, status, checksum);
+	send_USB_data(); // periodically try to flush data to the host
+}
+
+static void axEndStreamedReply(uint8_t checksum){
+    cdc_send_byte(255-((checksum)%256));
+    end_USB_frame();
+	axPassthrough();
+}
+
+
+// start the status packet holding the next servos of the sync_read
+static void sync_read_start_packet(void){
+    uint8_t first = sync_read_index;
+    uint8_t nb_in_packet = min(sync_read_nb_servos - first, sync_read_servos_per_packet);
+    uint8_t err = axSkippedError(sync_read_ids + first, nb_in_packet, 1);
+    if (first + nb_in_packet < sync_read_nb_servos){
+        err |= AX_ERROR_CONTINUED;
+    }
+    sync_read_packet_end = first + nb_in_packet;
+    sync_read_checksum = axStartStreamedReply(sync_read_slot_size * nb_in_packet, err);
+}
+
+// prepare the READ_DATA instruction of the servo after the one being read, so that the RX ISR can send it 
+// as soon as the current reply is complete, leaving no gap on the bus. Only done within a status packet,
+// for a servo which is not in back-off, and if the slots of both servos fit in the USB buffer.
+static void sync_read_prepare(void){
+    uint8_t next = sync_read_index + 1;
+    uint8_t nb_bytes = sync_read_nb_to_read;
+    if ( next == sync_read_packet_end || USB_data_room() < 2 * (uint16_t)sync_read_slot_size + 1 + AX_REPLY_HEADER_SIZE ){
+        return;
+    }
+    uint8_t id = sync_read_ids[next];
+    if (axIsSkipped(id)){
+        return;
+    }
+    sync_read_next_timeout = axAdaptiveTimeout(id, &sync_read_next_stats);
+    axReadInstruction(sync_read_request, id, sync_read_addr, nb_bytes);
+    sync_read_chain = SYNC_READ_CHAIN_READY;
+}
+
+// go on with the servos of the current status packet: send the READ_DATA instruction to the next one, or pad
+// its slot if it is in back-off. Hands over to the main loop (SYNC_READ_PENDING) at the end of the packet, 
+// or if its slot may not fit in the USB buffer (unless check_room is false).
+// Called with interrupts masked, from the main loop or from the TIMER1_COMPA ISR.
+static void sync_read_next(uint8_t check_room){
+    uint8_t nb_bytes = sync_read_nb_to_read;
+    while (sync_read_index != sync_read_packet_end){
+        // the slot, the checksum and possibly the header of the next packet must fit in the USB buffer
+        if (check_room && USB_data_room() < sync_read_slot_size + 1 + AX_REPLY_HEADER_SIZE){
+            break;
+        }
+        check_room = true;
+        
+        uint8_t id = sync_read_ids[sync_read_index];
+        uint8_t timeout = axAdaptiveTimeout(id, &sync_read_stats);
+        if (timeout){
+            // the TX ISR starts the timeout once the instruction is out, the RX ISR restarts it with each byte of the reply
+            sync_read_timeout = (uint16_t)timeout * TIMER_TICKS_PER_TIMEOUT_UNIT;
+            sync_read_state = SYNC_READ_BUSY;
+            stream_checksum = 0;
+            stream_length = nb_bytes + 6;
+            axStartReadInstruction(id, sync_read_addr, nb_bytes);
+            sync_read_prepare();
+            return;
+        }
+        axStreamSlotEnd(nb_bytes, sync_read_slot_size - nb_bytes, false, AX_STATUS_SKIPPED, &sync_read_checksum);
+        sync_read_index++;
+    }
+    sync_read_state = SYNC_READ_PENDING;
+}
+
+// the reply of the servo being read is complete, or it timed out.
+// When the RX ISR already sent the instruction of the next servo, it is going out while this runs: only what has to be
+// done before its reply comes in is done with interrupts masked, so that the USART ISRs keep feeding the instruction
+// and switch to reception on time. The adaptive timeouts and the instruction of the servo after it are dealt with 
+// afterwards, with interrupts enabled.
+static void sync_read_end_servo(void){
+    prof_begin(PROF_SYNC_READ_ISR);
+    TIMSK1 &= ~(1 << OCIE1A);
+    stream_length = 0; // the RX ISR drops any late byte from now on
+    if (sync_read_state != SYNC_READ_BUSY){
+        prof_end(PROF_SYNC_READ_ISR);
+        return;
+    }
+    
+    uint8_t nb_bytes = sync_read_nb_to_read;
+    first_byte_delay = local_rx_buffer_count ? sync_read_first_byte_at - sync_read_sent_at : 0xFFFF;
+    if (local_rx_buffer_count < nb_bytes + 6){
+        stat_inc(STAT_SERVO_TIMEOUTS);
+    }
+    uint8_t success = axStreamReplyEnd(sync_read_ids[sync_read_index], nb_bytes, &sync_read_checksum);
+    axStreamSlotEnd(nb_bytes, sync_read_slot_size - nb_bytes, success, axStreamStatus(nb_bytes, success), &sync_read_checksum);
+    servo_stats_t* stats = sync_read_stats;
+    sync_read_index++;
+    
+    uint8_t chain = sync_read_chain;
+    sync_read_chain = SYNC_READ_CHAIN_NONE;
+    if (chain == SYNC_READ_CHAIN_NONE){ // nothing on the bus, no hurry
+        axAdaptiveResult(stats, success);
+        sync_read_next(true);
+        prof_end(PROF_SYNC_READ_ISR);
+        return;
+    }
+    if (chain == SYNC_READ_CHAIN_READY){ // the reply timed out, the RX ISR did not send the prepared instruction
+        setTX();
+        for (uint8_t i = 0; i < AX_READ_INSTRUCTION_SIZE; i++){
+            serial_write(sync_read_request[i]);
+        }
+    }
+    // the next servo is being asked, get ready for its reply
+    sync_read_timeout = (uint16_t)sync_read_next_timeout * TIMER_TICKS_PER_TIMEOUT_UNIT;
+    sync_read_stats = sync_read_next_stats;
+    stream_checksum = 0;
+    stream_length = nb_bytes + 6;
+    local_rx_buffer_count = 0;
+    
+    sync_read_isr_busy = true;
+    sei();
+    axAdaptiveResult(stats, success); // before sync_read_prepare() can give the slot of these stats to another servo
+    sync_read_prepare();
+    cli();
+    sync_read_isr_busy = false;
+    prof_end(PROF_SYNC_READ_ISR);
+}
+
+ISR(TIMER1_COMPA_vect, ISR_BLOCK){
+    if (sync_read_isr_busy){ // the reply of the next servo is already there, handle it once done with the previous one
+        TIMSK1 &= ~(1 << OCIE1A); // rather than have it fire again and again meanwhile
+        sync_read_isr_deferred = true;
+        return;
+    }
+    do {
+        sync_read_isr_deferred = false;
+        sync_read_end_servo();
+    } while (sync_read_isr_deferred);
+}
+
+// main loop side of the sync_read: close and start the status packets, wait for room in the USB buffer, 
+// and give the bus back once all the servos have been read
+void sync_read_task(void){
+    if (sync_read_state != SYNC_READ_PENDING){
+        return;
+    }
+    
+    if (sync_read_index == sync_read_packet_end){
+        cdc_send_byte(255 - sync_read_checksum);
+        end_USB_frame();
+        if (sync_read_index == sync_read_nb_servos){
+            axPassthrough();
+            sync_read_state = SYNC_READ_IDLE; // the USB parser can go on with the next command
+            return;
+        }
+        sync_read_start_packet();
+    }
+    
+    wait_USB_room(sync_read_slot_size + 1 + AX_REPLY_HEADER_SIZE);
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+        sync_read_next(false);
+    }
+}
+
+// sync_read performs a cycle of Dynamixel reads to collect the data from servos to return over USB.
+// If the data does not fit in one status packet, it is split in several ones, each one sent as soon as 
+// it is complete, with AX_ERROR_CONTINUED set in all but the last one.
+// The reads are chained by the ISRs, each one starting as soon as the previous reply is complete or has timed out:
+// sync_read only starts the first one, then the main loop keeps flushing the replies to the host (see sync_read_task).
+void sync_read(uint8_t* params, uint8_t nb_params){
+	prof_begin(PROF_SYNC_READ);
+	sync_read_addr = params[0];    // address to read in control table
+    sync_read_nb_to_read = params[1];    // # of bytes to read from each servo
+    sync_read_nb_servos = nb_params - 2;
+    sync_read_ids = params + 2; // pointer to the ids of the servos to read from
+    sync_read_slot_size = sync_read_nb_to_read + axStatusSize();
+    sync_read_servos_per_packet = (AX_MAX_RETURN_PACKET_SIZE - 6) / sync_read_slot_size; // a servo is never split between two packets
+    sync_read_index = 0;
+    
+    setRX(); // let whatever the host sent leave before using the bus, the instructions are queued with interrupts masked
+    sync_read_start_packet();
+    sync_read_state = SYNC_READ_PENDING;
+    sync_read_task();
+    prof_end(PROF_SYNC_READ);
+}
+
+
+// put a SYNC_WRITE on the bus, without waiting for it to be out.
+// The ID of the nth servo is at ids[n * id_stride], and the length bytes to write to it at data[n * data_stride].
+static void axSyncWrite(uint8_t addr, uint8_t length, uint8_t nb_servos, uint8_t* ids, uint8_t id_stride, uint8_t* data, uint8_t data_stride){
+    // 0xFF 0xFF 0xFE LENGTH SYNC_WRITE ADDRESS L (ID DATA...)... CHECKSUM
+    uint8_t packet_length = nb_servos * (length + 1) + 4;
+    uint8_t checksum = AX_ID_BROADCAST + packet_length + AX_CMD_SYNC_WRITE + addr + length;
+    setTX();
+    serial_write(0xFF);
+    serial_write(0xFF);
+    serial_write(AX_ID_BROADCAST);
+    serial_write(packet_length);
+    serial_write(AX_CMD_SYNC_WRITE);
+    serial_write(addr);
+    serial_write(length);
+    for (uint8_t n = 0; n < nb_servos; n++){
+        serial_write(*ids);
+        checksum += *ids;
+        for (uint8_t i = 0; i < length; i++){
+            serial_write(data[i]);
+            checksum += data[i];
+        }
+        ids += id_stride;
+        data += data_stride;
+    }
+    serial_write(~checksum);
+    serial_high_water();
+}
+
+// sync_write_read puts a SYNC_WRITE on the bus and runs a sync_read right after it, to send the goals and read the state
+// of the servos in a single round trip with the host:
+// <Nw> <write address> <write length> <ID 1> <data 1> ... <ID Nw> <data Nw> <read address> <read length> <ID 1> ... <ID Nr>
+// The reply is the one of the sync_read.
+void sync_write_read(uint8_t* params, uint8_t nb_params){
+    if (nb_params < 5){
+        axStatusPacket(AX_ERROR_RANGE, NULL, 0);
+        return;
+    }
+    uint8_t nb_write = params[0];
+    uint8_t write_length = params[2];
+    uint16_t write_size = 2 + (uint16_t)nb_write * (write_length + 1); // parameters of the SYNC_WRITE
+    if (nb_write == 0 || write_length == 0 || 1 + write_size + 3 > nb_params){ // at least one servo to read
+        axStatusPacket(AX_ERROR_RANGE, NULL, 0);
+        return;
+    }
+    uint8_t* read = params + 1 + write_size;
+    if (read[1] == 0 || read[1] > AX_BUFFER_SIZE - 6){ // the return packets from the servos must fit the return buffer
+        axStatusPacket(AX_ERROR_RANGE, NULL, 0);
+        return;
+    }
+    
+    axSyncWrite(params[1], write_length, nb_write, params + 3, write_length + 1, params + 4, write_length + 1);
+    sync_read(read, nb_params - 1 - write_size); // waits for the SYNC_WRITE to be out before reading
+}
+
+
+// group_set stores a group of servos in EEPROM, so that they can be read or written with a short group_run later:
+// <group> <type> <address> <length> <ID 1> ... <ID N>, with no IDs to delete the group
+void group_set(uint8_t* params, uint8_t nb_params){
+    if (nb_params < 4){
+        axStatusPacket(AX_ERROR_RANGE, NULL, 0);
+        return;
+    }
+    uint8_t group = params[0];
+    uint8_t type = params[1];
+    uint8_t length = params[3];
+    uint8_t nb_ids = nb_params - 4;
+    if ( group >= AX_GROUPS || nb_ids > AX_GROUP_MAX_IDS || length == 0
+        || (type == AX_GROUP_READ && length > AX_BUFFER_SIZE - 6)  // the return packets from the servos must fit the return buffer
+        || (type == AX_GROUP_WRITE && (uint16_t)length * nb_ids > AX_PARAMS_SIZE - 3)  // the data must fit in a group_run
+        || type > AX_GROUP_WRITE ){
+        axStatusPacket(AX_ERROR_RANGE, NULL, 0);
+        return;
+    }
+    
+    // the record is built in place of the group number, which is not needed anymore
+    params[0] = nb_ids;
+    eeprom_save_group(group, params);
+    axStatusPacket(AX_ERROR_NONE, NULL, 0);
+}
+
+// group_run reads a group with a sync_read: <group>, 
+// or writes it with a SYNC_WRITE, in which case there is no reply: <group> <data of ID 1> ... <data of ID N>
+void group_run(uint8_t* params, uint8_t nb_params){
+    uint8_t record[AX_GROUP_SIZE];
+    if ( nb_params == 0 || params[0] >= AX_GROUPS || ! eeprom_load_group(params[0], record) ){
+        axStatusPacket(AX_ERROR_RANGE, NULL, 0);
+        return;
+    }
+    uint8_t nb_ids = record[0];
+    uint8_t addr = record[2];
+    uint8_t length = record[3];
+    uint8_t* ids = record + 4;
+    
+    if (record[1] == AX_GROUP_READ){
+        if (nb_params != 1){
+            axStatusPacket(AX_ERROR_RANGE, NULL, 0);
+            return;
+        }
+        // the sync_read keeps using its parameters while it runs, they can't stay on the stack
+        memcpy(params, record + 2, nb_ids + 2);
+        sync_read(params, nb_ids + 2);
+    } else {
+        if (nb_params != 1 + (uint16_t)length * nb_ids){
+            axStatusPacket(AX_ERROR_RANGE, NULL, 0);
+            return;
+        }
+        axSyncWrite(addr, length, nb_ids, ids, 1, params + 1, length);
+    }
+}
+
+
+// bulk_read is a sync_read where each servo has its own address and length, given as (ID, address, length) triples
+void bulk_read(uint8_t* params, uint8_t nb_params){
+    if (nb_params == 0 || nb_params % 3 != 0){
+        axStatusPacket(AX_ERROR_RANGE, NULL, 0);
+        return;
+    }
+    
+    uint8_t packet_overhead = 6;
+    uint8_t status_size = axStatusSize();
+    uint16_t nb_bytes = 0; // total number of parameters in the return packet
+    for (uint8_t i = 0; i < nb_params; i += 3){
+        uint8_t nb_to_read = params[i + 2];
+        if (nb_to_read == 0 || nb_to_read > AX_BUFFER_SIZE - packet_overhead){ // the return packets from the servos must fit the return buffer
+            axStatusPacket(AX_ERROR_RANGE, NULL, 0);
+            return;
+        }
+        nb_bytes += nb_to_read + status_size;
+    }
+    if (nb_bytes > AX_MAX_RETURN_PACKET_SIZE - packet_overhead){ // and the return packet to the host must not be bigger either
+        axStatusPacket(AX_ERROR_RANGE, NULL, 0);
+        return;
+    }
+    
+	uint8_t checksum = axStartStreamedReply(nb_bytes, axSkippedError(params, nb_params / 3, 3));
+    for (uint8_t i = 0; i < nb_params; i += 3){
+        axStreamSlot(params[i], params[i + 1], params[i + 2], status_size, &checksum);
+    }
+    axEndStreamedReply(checksum);
+}
+
+
+// stream_start stores a sync_read (period, address, length, IDs) to be repeated by stream_task(), 
+// or stops the current one if there are no parameters or if the period is 0
+void stream_start(uint8_t* params, uint8_t nb_params){
+    if (nb_params == 0){
+        stream_stop();
+        axStatusPacket(AX_ERROR_NONE, NULL, 0);
+        return;
+    }
+    if (nb_params < 2){
+        axStatusPacket(AX_ERROR_RANGE, NULL, 0);
+        return;
+    }
+    
+    uint16_t period = params[0] | ((uint16_t)params[1] << 8);
+    if (period == 0){
+        stream_stop();
+        axStatusPacket(AX_ERROR_NONE, NULL, 0);
+        return;
+    }
+    
+    uint8_t packet_overhead = 6 + AX_STREAM_HEADER_SIZE;
+    uint8_t nb_servos = nb_params - 4;
+    if ( nb_params < 5 || nb_servos > AX_STREAM_MAX_DEVICES 
+        || params[3] == 0 || params[3] > AX_BUFFER_SIZE - 6
+        || (uint16_t)params[3] * nb_servos > AX_MAX_RETURN_PACKET_SIZE - packet_overhead ){
+        axStatusPacket(AX_ERROR_RANGE, NULL, 0);
+        return;
+    }
+    
+    stream_addr = params[2];
+    stream_nb_to_read = params[3];
+    stream_arena = true;
+    arena_set_layout(ARENA_STREAM); // before storing the IDs, they live in the arena
+    memcpy(stream_ids, params + 4, nb_servos);
+    stream_nb_servos = nb_servos;
+    stream_sequence = 0;
+    stream_period = (uint32_t)period * AX_STREAM_PERIOD_UNIT;
+    stream_next = timer_now32();
+    stream_keyframe_countdown = 0;
+    
+    axStatusPacket(AX_ERROR_NONE, NULL, 0);
+}
+
+// stop the STREAM, the arena is given back by the next stream_task()
+void stream_stop(void){
+    stream_nb_servos = 0;
+}
+
+// build a delta-encoded STREAM frame in scratch (after the header already there), and send it:
+// <header> <bitmap of the servos whose data changed> <data of these servos>
+static void stream_delta_frame(uint8_t* scratch, uint8_t nb_servos){
+    uint8_t nb_bytes = stream_nb_to_read;
+    uint8_t bitmap_size = (nb_servos + 7) / 8;
+    uint8_t* bitmap = scratch + AX_STREAM_HEADER_SIZE;
+    uint8_t size = AX_STREAM_HEADER_SIZE + bitmap_size;
+    uint8_t keyframe = (stream_keyframe_countdown == 0);
+    uint8_t err = AX_ERROR_DELTA | axSkippedError(stream_ids, nb_servos, 1);
+    
+    memset(bitmap, 0, bitmap_size);
+    axDivert(AX_DIVERT);
+    for (uint8_t i = 0; i < nb_servos; i++){
+        uint8_t* previous = stream_previous_frame + i * nb_bytes;
+        uint8_t* current = scratch + size;
+        if (axReadAdaptive(stream_ids[i], stream_addr, nb_bytes, NULL)){
+            memcpy(current, &local_rx_buffer[5], nb_bytes);
+        } else {
+            memset(current, 0xFF, nb_bytes);
+        }
+        if (keyframe || memcmp(current, previous, nb_bytes)){
+            memcpy(previous, current, nb_bytes);
+            bitmap[i / 8] |= 1 << (i % 8);
+            size += nb_bytes;
+        }
+        send_USB_data(); // let the previous frame go out in the meantime
+    }
+    axPassthrough();
+    
+    if (keyframe){
+        uint8_t interval = regs[ADDR_KEYFRAME_INTERVAL];
+        stream_keyframe_countdown = interval ? interval - 1 : 0;
+    } else {
+        stream_keyframe_countdown--;
+    }
+    axStatusPacket(err, scratch, size);
+}
+
+// run the next STREAM frame if it is time to, called from the main loop.
+// scratch must have room for AX_STREAM_HEADER_SIZE + AX_STREAM_MAX_DEVICES / 8 + AX_STREAM_DELTA_SIZE bytes
+void stream_task(uint8_t* scratch){
+    uint8_t nb_servos = stream_nb_servos; // the frame must keep the same size, even if stream_stop() is called meanwhile
+    if (nb_servos == 0){
+        if (stream_arena){
+            stream_arena = false;
+            arena_set_layout(ARENA_PASSTHROUGH);
+        }
+        return;
+    }
+    uint32_t now = timer_now32();
+    if ( (int32_t)(now - stream_next) < 0 ){
+        return;
+    }
+    setRX(); // let whatever the host sent leave before using the bus
+    
+    // keep the frames on a fixed grid, unless we fell more than one period behind
+    stream_next += stream_period;
+    if ( (int32_t)(now - stream_next) >= 0 ){
+        stream_next = now + stream_period;
+    }
+    
+    uint8_t* header = scratch;
+    header[0] = stream_sequence++;
+    header[1] = now;
+    header[2] = now >> 8;
+    header[3] = now >> 16;
+    header[4] = now >> 24;
+    
+    if ( (regs[ADDR_OPTIONS] & OPTION_DELTA_FRAMES) && stream_nb_to_read * nb_servos <= AX_STREAM_DELTA_SIZE ){
+        stream_delta_frame(scratch, nb_servos);
+        return;
+    }
+    stream_keyframe_countdown = 0; // the previous data is not kept up to date anymore
+    
+    uint8_t checksum = axStartStreamedReply(AX_STREAM_HEADER_SIZE + stream_nb_to_read * nb_servos, 
+                                            axSkippedError(stream_ids, nb_servos, 1));
+    for (uint8_t i = 0; i < AX_STREAM_HEADER_SIZE; i++){
+        cdc_send_byte(header[i]);
+        checksum += header[i];
+    }
+    for (uint8_t i = 0; i < nb_servos; i++){
+        axStreamSlot(stream_ids[i], stream_addr, stream_nb_to_read, 0, &checksum); // the frames keep a fixed size
+    }
+    axEndStreamedReply(checksum);
+}
+
+
+// baud rate corresponding to a Dynamixel baud rate code (value of register 4 of the servos)
+static long axBaudRate(uint8_t code){
+    switch (code){
+        case 250: return 2250000;
+        case 251: return 2500000;
+        case 252: return 3000000;
+        default:  return 2000000 / ((long)code + 1);
+    }
+}
+
+
+// bus_scan pings a range of IDs at the current baud rate, or at each of the given baud rate codes, 
+// and answers with one status packet per baud rate: <baud code> <presence bitmap> <error byte of each servo found>
+void bus_scan(uint8_t* params, uint8_t nb_params){
+    if (nb_params < 3 || nb_params > 3 + AX_SCAN_MAX_BAUDS || params[0] > params[1] || params[1] >= AX_ID_BROADCAST){
+        axStatusPacket(AX_ERROR_RANGE, NULL, 0);
+        return;
+    }
+    
+    uint8_t first_id = params[0];
+    uint8_t last_id = params[1];
+    uint8_t timeout = params[2] ? params[2] : regs[ADDR_USART_TIMEOUT];
+    uint8_t nb_bauds = nb_params - 3;
+    uint8_t bauds[AX_SCAN_MAX_BAUDS];
+    if (nb_bauds){
+        memcpy(bauds, params + 3, nb_bauds);
+    } else {
+        bauds[0] = AX_BAUD_CURRENT;
+        nb_bauds = 1;
+    }
+    
+    // the parameters have been parsed, their buffer is now used to build the replies
+    uint8_t* reply = params;
+    uint8_t bitmap_size = (last_id - first_id) / 8 + 1;
+    uint8_t max_size = min(AX_PARAMS_SIZE, AX_MAX_RETURN_PACKET_SIZE - 6);
+    
+    axDivert(AX_DIVERT);
+    for (uint8_t b = 0; b < nb_bauds; b++){
+        if (bauds[b] != AX_BAUD_CURRENT){
+            setRX(); // init_serial() drops what is still waiting to go out, let what the host passed before finish
+            init_serial(axBaudRate(bauds[b]));
+        }
+        
+        uint8_t err = AX_ERROR_NONE;
+        uint8_t size = 1 + bitmap_size;
+        reply[0] = bauds[b];
+        memset(reply + 1, 0, bitmap_size);
+        
+        uint8_t id = first_id;
+        do {
+            if (axPing(id, timeout)){
+                uint8_t bit = id - first_id;
+                reply[1 + bit / 8] |= 1 << (bit % 8);
+                if (size < max_size){
+                    reply[size++] = local_rx_buffer[4];
+                } else {
+                    err = AX_ERROR_RANGE; // too many servos found, some of the error bytes are missing
                 }
             }
-		}
+            send_USB_data(); // let the previous replies go out in the meantime
+        } while (id++ != last_id);
+        
+        axStatusPacket(err, reply, size);
     }
-	
-    cdc_send_byte(255-((checksum)%256));
- 	
-	// allow data from USART to be sent directly to USB
-	passthrough_mode = AX_PASSTHROUGH;
+    
+    if (nb_params > 3){
+        restore_serial_baud();
+    }
+    axPassthrough();
 }
 
 
-void local_read(uint8_t addr, uint8_t nb_bytes){
+// scratch must have room for REG_TABLE_SIZE bytes
+void local_read(uint8_t addr, uint8_t nb_bytes, uint8_t* scratch){
 	uint16_t top = (uint16_t)addr + nb_bytes;
 	if ( nb_bytes == 0 || top > sizeof(regs) ){
 		axStatusPacket( AX_ERROR_RANGE, NULL, 0 );
 	} else {
-	    axStatusPacket(AX_ERROR_NONE, regs + addr, nb_bytes);
+	    ATOMIC_BLOCK(ATOMIC_RESTORESTATE){ // the statistics are updated by the ISRs
+	        memcpy(scratch, regs + addr, nb_bytes);
+	    }
+	    axStatusPacket(AX_ERROR_NONE, scratch, nb_bytes);
     }
 }
 
@@ -189,7 +1026,11 @@ uint8_t can_write_data(uint8_t addr, uint8_t* data, uint8_t nb_bytes){
     // Check that the value written are acceptable
     for (uint8_t i = 0 ; i<nb_bytes; i++ ){
         uint8_t val = data[i];
-        if (val < min_vals[addr - START_RW_ADDR + i] ){
+        if (addr + i < ADDR_STATS){
+            if (val < pgm_read_byte(&min_vals[addr - START_RW_ADDR + i])){
+                return false;
+            }
+        } else if (val != 0){ // the statistics, histograms and probes can only be cleared
             return false;
         }
     }
@@ -200,8 +1041,12 @@ void local_write(uint8_t addr, uint8_t* data, uint8_t nb_bytes){
     if ( ! can_write_data(addr, data, nb_bytes) ){
         axStatusPacket( AX_ERROR_RANGE, NULL, 0 );
     } else {
-        memcpy(regs+addr, data, nb_bytes);
-        eeprom_save();
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE){ // the statistics are updated by the ISRs
+            memcpy(regs+addr, data, nb_bytes);
+        }
+        if (addr < ADDR_STATS){
+            eeprom_save();
+        }
         axStatusPacket( AX_ERROR_NONE, NULL, 0 ); 
     }
 }
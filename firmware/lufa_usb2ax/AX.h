@@ -35,6 +35,7 @@ Original copyright notice :
 #ifndef AX_H_
 #define AX_H_
 #include "USB2AX.h"
+#include "debug.h"
 
 
 #define AX_ID_DEVICE        0xFD
@@ -45,20 +46,83 @@ Original copyright notice :
 #define AX_CMD_WRITE_DATA   0x03
 #define AX_CMD_RESET        0x06
 #define AX_CMD_BOOTLOAD     0x08 
+#define AX_CMD_SYNC_WRITE   0x83
 #define AX_CMD_SYNC_READ    0x84
+#define AX_CMD_SCAN         0x85
+#define AX_CMD_STREAM       0x86
+#define AX_CMD_WRITE_READ   0x87
+#define AX_CMD_GROUP_SET    0x88
+#define AX_CMD_GROUP_RUN    0x89
+#define AX_CMD_BULK_READ    0x92
 
-#define AX_BUFFER_SIZE	            128
-#define AX_SYNC_READ_MAX_DEVICES    120
+#define AX_BUFFER_SIZE	            ARENA_REPLIES_SIZE
+#define AX_RX_BUFFER_SIZE           ARENA_RXBYTE_SIZE               // size of the buffer incoming packets for the USB2AX are parsed into
+#define AX_RX_HEADER_SIZE           8                               // size of the buffer the headers of the other packets are parsed into
+#define AX_SYNC_READ_MAX_DEVICES    (AX_RX_BUFFER_SIZE - 8)
+#define AX_PARAMS_SIZE              (AX_RX_BUFFER_SIZE - 5)         // room left in it for the parameters of the packet
 #define AX_MAX_RETURN_PACKET_SIZE   235
+#define AX_REPLY_HEADER_SIZE        5   // 0xFF 0xFF ID LENGTH ERROR
+#define AX_READ_INSTRUCTION_SIZE    8   // 0xFF 0xFF ID LENGTH READ_DATA ADDRESS NB_BYTES CHECKSUM
+
+#define AX_STREAM_MAX_DEVICES       ARENA_IDS_SIZE // maximum number of servos in a STREAM
+#define AX_STREAM_HEADER_SIZE       5     // sequence number and 32-bit timestamp before the data of each STREAM frame
+#define AX_STREAM_PERIOD_UNIT       200   // ticks of 0.5us in a unit of the STREAM period (100us)
+#define AX_STREAM_DELTA_SIZE        ARENA_PREVIOUS_SIZE // largest STREAM frame data (bytes x servos) that can be delta-encoded
+
+#define AX_GROUPS                   8     // number of groups stored in EEPROM (see group_set)
+#define AX_GROUP_MAX_IDS            32    // maximum number of servos in a group
+#define AX_GROUP_SIZE               (4 + AX_GROUP_MAX_IDS)  // <Nb IDs> <Type> <Address> <Length> <ID 1> ... <ID N>
+#define AX_GROUP_READ               0     // type of a group which is read with a sync_read
+#define AX_GROUP_WRITE              1     // type of a group which is written with a SYNC_WRITE
+
+#define AX_SCAN_MAX_BAUDS           8     // maximum number of baud rates in a SCAN
+#define AX_BAUD_CURRENT             0xFF  // baud rate code for "the baud rate set by the host"
+
+// protocol of the packet being answered, for axStatusPacket()
+#define AX_PROTOCOL_1               1
+#define AX_PROTOCOL_2               2
+extern uint8_t ax_protocol;
+
+// state of the servo reply being streamed to USB by the RX ISR (see AX_STREAM)
+extern volatile uint8_t stream_length;    // number of bytes expected in the reply, 0 when not streaming
+extern volatile uint8_t stream_checksum;  // running sum of the reply bytes, from the ID to the checksum
+
+// state of the sync_read engine, driven by the USART and TIMER1 interrupts (see sync_read)
+#define SYNC_READ_IDLE      0   // no sync_read running
+#define SYNC_READ_BUSY      1   // a servo is being read, its reply (or its timeout) triggers the TIMER1_COMPA ISR
+#define SYNC_READ_PENDING   2   // waiting for the main loop: new status packet, room in the USB buffer, or end of the sync_read
+#define SYNC_READ_END_DELAY 8   // ticks between the end of a reply and the TIMER1_COMPA ISR, long enough for the RX ISR to return first
+extern volatile uint8_t sync_read_state;
+extern uint16_t sync_read_timeout;        // USART timeout of the servo being read, in timer ticks
+extern uint16_t sync_read_sent_at;        // timestamp of the end of the READ_DATA instruction
+extern uint16_t sync_read_first_byte_at;  // timestamp of the first byte of the reply
+// READ_DATA instruction of the next servo, prepared while the current one is read
+#define SYNC_READ_CHAIN_NONE    0   // nothing prepared
+#define SYNC_READ_CHAIN_READY   1   // for the RX ISR to send as soon as the current reply is complete
+#define SYNC_READ_CHAIN_SENT    2   // sent by the RX ISR, the TIMER1_COMPA ISR gets ready for its reply
+extern volatile uint8_t sync_read_chain;
+extern uint8_t sync_read_request[AX_READ_INSTRUCTION_SIZE];
 
 // Error flags for status packets
 #define AX_ERROR_INSTRUCTION    0x40  
 #define AX_ERROR_CHECKSUM       0x10 
 #define AX_ERROR_RANGE          0x08 
 #define AX_ERROR_NONE           0x00
+// USB2AX-specific flags, in bits which only make sense for the hardware of a servo
+#define AX_ERROR_SKIPPED        0x01  // sync_read/bulk_read: some servos were not read because they are in back-off
+#define AX_ERROR_DELTA          0x02  // STREAM: the frame only contains the servos whose data changed
+#define AX_ERROR_CONTINUED      0x80  // sync_read: the reply goes on in the next status packet
 
-#define REG_TABLE_SIZE          18
-extern uint8_t regs[REG_TABLE_SIZE];
+// Status byte after the data of each servo in sync_read/bulk_read replies (see OPTION_SERVO_STATUS):
+// the error byte of the reply of the servo, or one of these
+#define AX_STATUS_TIMEOUT       0x80  // no complete reply
+#define AX_STATUS_CHECKSUM      0x81  // complete reply, but with a bad checksum or header
+#define AX_STATUS_SKIPPED       0x82  // not read, the servo is in back-off
+
+// Adaptive timeouts (see ADDR_OPTIONS)
+#define AX_ADAPTIVE_SLOTS       24    // number of servos whose response time and failures are tracked
+#define AX_DEAD_THRESHOLD       3     // consecutive failures before a servo is put in back-off
+#define AX_LATENCY_MAX          63    // largest response time tracked, x 20us
 
 // register table
 #define ADDR_MODEL_NUMBER_L         0 //read only
@@ -68,9 +132,9 @@ extern uint8_t regs[REG_TABLE_SIZE];
 #define ADDR_USART_TIMEOUT          4 // read/write EEPROM
 #define ADDR_SEND_TIMEOUT           5
 #define ADDR_RECEIVE_TIMEOUT        6
-//#define ADDR_...                    7
-//#define ADDR_...                    8
-//#define ADDR_...                    9
+#define ADDR_OPTIONS                7
+#define ADDR_SKIP_CYCLES            8 // number of sync_read/bulk_read a servo in back-off is skipped for
+#define ADDR_KEYFRAME_INTERVAL      9 // number of STREAM frames between two full frames, in delta mode
 //#define ADDR_...                    10
 //#define ADDR_...                    11
 //#define ADDR_...                    12
@@ -79,17 +143,144 @@ extern uint8_t regs[REG_TABLE_SIZE];
 //#define ADDR_...                    15
 //#define ADDR_...                    16
 //#define ADDR_LED                    17 // TODO  read/write RAM ??
+#define ADDR_STATS                  18 // statistics, in RAM only (see below)
+
+// statistics: 16-bit counters (L, H) which wrap around, cleared by writing 0 to them
+#define STAT_BYTES_TO_BUS           (ADDR_STATS + 0)   // bytes sent on the Dynamixel bus
+#define STAT_BYTES_FROM_BUS         (ADDR_STATS + 2)   // bytes received from the Dynamixel bus
+#define STAT_PACKETS                (ADDR_STATS + 4)   // packets found in the data from the host
+#define STAT_LOCAL_COMMANDS         (ADDR_STATS + 6)   // packets from the host answered by the USB2AX itself
+#define STAT_CHECKSUM_ERRORS        (ADDR_STATS + 8)   // packets for the USB2AX dropped because of their checksum
+#define STAT_SERVO_TIMEOUTS         (ADDR_STATS + 10)  // servo replies which did not come in full before the USART timeout
+#define STAT_USB_OVERFLOWS          (ADDR_STATS + 12)  // bytes dropped because the USB buffer was full
+#define STAT_USART_OVERRUNS         (ADDR_STATS + 14)  // bytes lost by the USART because the RX ISR was late
+#define STAT_USART_FRAME_ERRORS     (ADDR_STATS + 16)  // bytes received with a bad stop bit
+#define STAT_USB_HIGH_WATER         (ADDR_STATS + 18)  // most bytes seen waiting in the USB buffer
+#define STAT_USART_HIGH_WATER       (ADDR_STATS + 20)  // most bytes seen waiting in the USART buffer
+#define STATS_SIZE                  22
+
+// histograms: 16-bit bins (L, H) which stop at 0xFFFF, cleared by writing 0 to them.
+// The first bin counts the durations under 32us, each next one durations twice as long, the last one everything from 2048us.
+#define ADDR_HIST_TURNAROUND        (ADDR_STATS + STATS_SIZE)            // from the end of an instruction to the last byte of the reply
+#define ADDR_HIST_USB_FLUSH         (ADDR_HIST_TURNAROUND + HIST_SIZE)   // from bytes starting to wait in the USB buffer to their bank going out
+#define HIST_BINS                   8
+#define HIST_SIZE                   (2 * HIST_BINS)
+#define HIST_FIRST_BIN_SHIFT        6   // the first bin is for durations under 1 << 6 timer ticks
 
+// profiler probes (only with USE_PROFILER, see debug.h), each one made of:
+#define PROF_COUNT                  0   // number of runs, 16 bits, stops at 0xFFFF
+#define PROF_MIN                    2   // shortest run in timer ticks, 16 bits
+#define PROF_MAX                    4   // longest run in timer ticks, 16 bits
+#define PROF_TOTAL                  6   // all the runs in timer ticks, 32 bits
+#define PROF_PROBE_SIZE             10
+#if USE_PROFILER
+    #define ADDR_PROFILER           (ADDR_HIST_USB_FLUSH + HIST_SIZE)
+    #define PROF_USART_RX           (ADDR_PROFILER + 0 * PROF_PROBE_SIZE)  // USART1_RX_vect
+    #define PROF_SEND_USB           (ADDR_PROFILER + 1 * PROF_PROBE_SIZE)  // send_USB_data()
+    #define PROF_PARSER             (ADDR_PROFILER + 2 * PROF_PROBE_SIZE)  // a step of the parser in process_incoming_USB_data(), with the local command it runs
+    #define PROF_SYNC_READ          (ADDR_PROFILER + 3 * PROF_PROBE_SIZE)  // sync_read(), up to the first servo being asked
+    #define PROF_SYNC_READ_ISR      (ADDR_PROFILER + 4 * PROF_PROBE_SIZE)  // TIMER1_COMPA_vect, the end of each servo read by sync_read()
+    #define PROFILER_SIZE           (5 * PROF_PROBE_SIZE)
+#else
+    #define PROFILER_SIZE           0
+#endif
+
+#define REG_TABLE_SIZE          (ADDR_HIST_USB_FLUSH + HIST_SIZE + PROFILER_SIZE)
+extern uint8_t regs[REG_TABLE_SIZE];
 
 #define START_RW_ADDR       ADDR_USART_TIMEOUT
 
+// bits of ADDR_OPTIONS
+#define OPTION_ADAPTIVE_TIMEOUTS    0x01  // learn the response time of each servo, skip the ones that keep failing
+#define OPTION_DELTA_FRAMES         0x02  // STREAM frames only carry the data which changed since the previous one
+#define OPTION_SERVO_STATUS         0x04  // sync_read/bulk_read replies have a status byte after the data of each servo
+
+
+// the statistics are updated from the ISRs as well as from the main loop
+static inline void stat_set(uint8_t addr, uint16_t value){
+    regs[addr] = value;
+    regs[addr + 1] = value >> 8;
+}
+
+static inline uint16_t stat_get(uint8_t addr){
+    return regs[addr] | ((uint16_t)regs[addr + 1] << 8);
+}
+
+static inline void stat_inc(uint8_t addr){
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+        stat_set(addr, stat_get(addr) + 1);
+    }
+}
+
+static inline void stat_max(uint8_t addr, uint16_t value){
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+        if (value > stat_get(addr)){
+            stat_set(addr, value);
+        }
+    }
+}
+
+// count a duration (in timer ticks) in the histogram at addr
+static inline void hist_add(uint8_t addr, uint16_t ticks){
+    uint8_t last = addr + HIST_SIZE - 2;
+    ticks >>= HIST_FIRST_BIN_SHIFT;
+    while (ticks && addr < last){
+        ticks >>= 1;
+        addr += 2;
+    }
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+        uint16_t count = stat_get(addr);
+        if (count != 0xFFFF){
+            stat_set(addr, count + 1);
+        }
+    }
+}
+
+#if USE_PROFILER
+// count a run of the probe at addr, which took ticks timer ticks
+static inline void prof_add(uint8_t addr, uint16_t ticks){
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+        uint16_t count = stat_get(addr + PROF_COUNT);
+        if (count != 0xFFFF){ // stop there, so that the total keeps matching the count
+            if (count == 0 || ticks < stat_get(addr + PROF_MIN)){
+                stat_set(addr + PROF_MIN, ticks);
+            }
+            if (ticks > stat_get(addr + PROF_MAX)){
+                stat_set(addr + PROF_MAX, ticks);
+            }
+            uint32_t total = stat_get(addr + PROF_TOTAL) | ((uint32_t)stat_get(addr + PROF_TOTAL + 2) << 16);
+            total += ticks;
+            stat_set(addr + PROF_TOTAL, total);
+            stat_set(addr + PROF_TOTAL + 2, total >> 16);
+            stat_set(addr + PROF_COUNT, count + 1);
+        }
+    }
+}
+#endif
 
 void axInit();
 void axStatusPacket(uint8_t err, uint8_t* data, uint8_t nb_bytes);  
+void axWaitPacket(uint8_t length, uint8_t timeout, uint8_t first);
 uint16_t axReadPacket(uint8_t length);
+uint8_t axLocalLayout(void);
+void axDivert(uint8_t mode);
+void axPassthrough(void);
 int axGetRegister(uint8_t id, uint8_t addr, uint8_t nb_bytes);
+uint8_t axStreamRegister(uint8_t id, uint8_t addr, uint8_t nb_bytes, uint8_t timeout, uint8_t* checksum);
 void sync_read(uint8_t* params, uint8_t nb_params);
-void local_read(uint8_t addr, uint8_t nb_bytes);
+void sync_read_task(void);
+void sync_write_read(uint8_t* params, uint8_t nb_params);
+void group_set(uint8_t* params, uint8_t nb_params);
+void group_run(uint8_t* params, uint8_t nb_params);
+static inline bool sync_read_busy(void){
+    return sync_read_state != SYNC_READ_IDLE;
+}
+void bulk_read(uint8_t* params, uint8_t nb_params);
+void bus_scan(uint8_t* params, uint8_t nb_params);
+void stream_start(uint8_t* params, uint8_t nb_params);
+void stream_stop(void);
+void stream_task(uint8_t* scratch);
+void local_read(uint8_t addr, uint8_t nb_bytes, uint8_t* scratch);
 void local_write(uint8_t addr, uint8_t* data, uint8_t nb_bytes);
 
 #endif /* AX_H_ */
\ No newline at end of file
@@ -0,0 +1,273 @@
+/*
+ * AX2.c
+ *
+ * Dynamixel Protocol 2.0 support, see AX2.h.
+ */
+#include "AX2.h"
+#include <avr/pgmspace.h>
+
+// CRC-16 of Protocol 2.0 (polynomial 0x8005, initial value 0, no reflection), one entry per value of the high byte
+static const uint16_t crc_table[256] PROGMEM = {
+    0x0000, 0x8005, 0x800F, 0x000A, 0x801B, 0x001E, 0x0014, 0x8011,
+    0x8033, 0x0036, 0x003C, 0x8039, 0x0028, 0x802D, 0x8027, 0x0022,
+    0x8063, 0x0066, 0x006C, 0x8069, 0x0078, 0x807D, 0x8077, 0x0072,
+    0x0050, 0x8055, 0x805F, 0x005A, 0x804B, 0x004E, 0x0044, 0x8041,
+    0x80C3, 0x00C6, 0x00CC, 0x80C9, 0x00D8, 0x80DD, 0x80D7, 0x00D2,
+    0x00F0, 0x80F5, 0x80FF, 0x00FA, 0x80EB, 0x00EE, 0x00E4, 0x80E1,
+    0x00A0, 0x80A5, 0x80AF, 0x00AA, 0x80BB, 0x00BE, 0x00B4, 0x80B1,
+    0x8093, 0x0096, 0x009C, 0x8099, 0x0088, 0x808D, 0x8087, 0x0082,
+    0x8183, 0x0186, 0x018C, 0x8189, 0x0198, 0x819D, 0x8197, 0x0192,
+    0x01B0, 0x81B5, 0x81BF, 0x01BA, 0x81AB, 0x01AE, 0x01A4, 0x81A1,
+    0x01E0, 0x81E5, 0x81EF, 0x01EA, 0x81FB, 0x01FE, 0x01F4, 0x81F1,
+    0x81D3, 0x01D6, 0x01DC, 0x81D9, 0x01C8, 0x81CD, 0x81C7, 0x01C2,
+    0x0140, 0x8145, 0x814F, 0x014A, 0x815B, 0x015E, 0x0154, 0x8151,
+    0x8173, 0x0176, 0x017C, 0x8179, 0x0168, 0x816D, 0x8167, 0x0162,
+    0x8123, 0x0126, 0x012C, 0x8129, 0x0138, 0x813D, 0x8137, 0x0132,
+    0x0110, 0x8115, 0x811F, 0x011A, 0x810B, 0x010E, 0x0104, 0x8101,
+    0x8303, 0x0306, 0x030C, 0x8309, 0x0318, 0x831D, 0x8317, 0x0312,
+    0x0330, 0x8335, 0x833F, 0x033A, 0x832B, 0x032E, 0x0324, 0x8321,
+    0x0360, 0x8365, 0x836F, 0x036A, 0x837B, 0x037E, 0x0374, 0x8371,
+    0x8353, 0x0356, 0x035C, 0x8359, 0x0348, 0x834D, 0x8347, 0x0342,
+    0x03C0, 0x83C5, 0x83CF, 0x03CA, 0x83DB, 0x03DE, 0x03D4, 0x83D1,
+    0x83F3, 0x03F6, 0x03FC, 0x83F9, 0x03E8, 0x83ED, 0x83E7, 0x03E2,
+    0x83A3, 0x03A6, 0x03AC, 0x83A9, 0x03B8, 0x83BD, 0x83B7, 0x03B2,
+    0x0390, 0x8395, 0x839F, 0x039A, 0x838B, 0x038E, 0x0384, 0x8381,
+    0x0280, 0x8285, 0x828F, 0x028A, 0x829B, 0x029E, 0x0294, 0x8291,
+    0x82B3, 0x02B6, 0x02BC, 0x82B9, 0x02A8, 0x82AD, 0x82A7, 0x02A2,
+    0x82E3, 0x02E6, 0x02EC, 0x82E9, 0x02F8, 0x82FD, 0x82F7, 0x02F2,
+    0x02D0, 0x82D5, 0x82DF, 0x02DA, 0x82CB, 0x02CE, 0x02C4, 0x82C1,
+    0x8243, 0x0246, 0x024C, 0x8249, 0x0258, 0x825D, 0x8257, 0x0252,
+    0x0270, 0x8275, 0x827F, 0x027A, 0x826B, 0x026E, 0x0264, 0x8261,
+    0x0220, 0x8225, 0x822F, 0x022A, 0x823B, 0x023E, 0x0234, 0x8231,
+    0x8213, 0x0216, 0x021C, 0x8219, 0x0208, 0x820D, 0x8207, 0x0202
+};
+
+uint16_t ax2Crc(uint16_t crc, uint8_t* data, uint16_t nb_bytes){
+    for (uint16_t i = 0; i < nb_bytes; i++){
+        crc = (crc << 8) ^ pgm_read_word(&crc_table[(uint8_t)(crc >> 8) ^ data[i]]);
+    }
+    return crc;
+}
+
+
+// remove the byte stuffing (0xFF 0xFF 0xFD 0xFD -> 0xFF 0xFF 0xFD) in place, return the new number of bytes
+uint8_t ax2Unstuff(uint8_t* data, uint8_t nb_bytes){
+    uint8_t count = 0;
+    uint8_t removed_at = 0; // count when a 0xFD was last removed: the 0xFF 0xFF 0xFD before it does not count twice
+    for (uint8_t i = 0; i < nb_bytes; i++){
+        if ( data[i] == 0xFD && count >= 3 && count != removed_at
+            && data[count - 1] == 0xFD && data[count - 2] == 0xFF && data[count - 3] == 0xFF ){
+            removed_at = count;
+            continue; // the added 0xFD
+        }
+        data[count++] = data[i];
+    }
+    return count;
+}
+
+
+// Status packets are built right in the USB buffer: the length is only known at the end, because of the byte stuffing.
+// Nothing must be sent to the host in the meantime (no send_USB_data()), and the RX ISR must not add anything: 
+// ax2_local_command() keeps the data from the servos in AX_DIVERT mode until it is done. The room for the whole packet
+// is made beforehand (see ax2ReplyFits), so that no byte of it is dropped.
+static uint16_t reply_position;     // position of the first byte of the status packet in the USB buffer
+static uint16_t reply_length;       // number of bytes after the header so far
+static uint8_t  reply_nb_ff;        // number of consecutive 0xFF at the end of the packet, for the byte stuffing
+
+static void ax2ReplyByte(uint8_t data){
+    cdc_send_byte(data);
+    reply_length++;
+    if (reply_nb_ff >= 2 && data == 0xFD){
+        cdc_send_byte(0xFD);
+        reply_length++;
+        reply_nb_ff = 0;
+    } else if (data == 0xFF){
+        reply_nb_ff++;
+    } else {
+        reply_nb_ff = 0;
+    }
+}
+
+static void ax2StartReply(uint8_t err){
+    reply_position = tell_USB_data();
+    reply_length = 0;
+    reply_nb_ff = 0;
+    cdc_send_byte(0xFF);
+    cdc_send_byte(0xFF);
+    cdc_send_byte(0xFD);
+    cdc_send_byte(0x00);
+    cdc_send_byte(AX_ID_DEVICE);
+    cdc_send_byte(0); // length, filled in by ax2EndReply
+    cdc_send_byte(0);
+    ax2ReplyByte(AX2_CMD_STATUS);
+    ax2ReplyByte(err);
+}
+
+static void ax2EndReply(void){
+    uint16_t length = reply_length + 2;
+    *USB_data_at(reply_position, AX2_PACKET_LENGTH_L) = length;
+    *USB_data_at(reply_position, AX2_PACKET_LENGTH_H) = length >> 8;
+    
+    uint16_t crc = 0;
+    for (uint16_t i = 0; i < AX2_HEADER_SIZE + reply_length; i++){
+        crc = ax2Crc(crc, USB_data_at(reply_position, i), 1);
+    }
+    cdc_send_byte(crc);
+    cdc_send_byte(crc >> 8);
+    end_USB_frame();
+}
+
+// make room in the USB buffer for a status packet with nb_data parameters, return false if it can never fit
+static uint8_t ax2ReplyFits(uint16_t nb_data){
+    uint16_t size = AX2_REPLY_SIZE(nb_data);
+    if (size > USB_data_size()){
+        return false;
+    }
+    wait_USB_room(size);
+    return true;
+}
+
+void ax2StatusPacket(uint8_t err, uint8_t* data, uint8_t nb_bytes){
+    if ( ! ax2ReplyFits(nb_bytes) ){ // a READ of the registers while a STREAM keeps the USB buffer small
+        err = AX2_ERROR_RANGE;
+        nb_bytes = 0;
+        ax2ReplyFits(0);
+    }
+    ax2StartReply(err);
+    for (uint8_t i = 0; i < nb_bytes; i++){
+        ax2ReplyByte(data[i]);
+    }
+    ax2EndReply();
+}
+
+
+// read registers of a servo, its status packet is then in local_rx_buffer, parameters from AX2_PACKET_PARAMS + 1
+static uint8_t ax2Read(uint8_t id, uint16_t addr, uint8_t nb_bytes){
+    // the parameters can't contain 0xFF 0xFF 0xFD as nb_bytes is small: no byte stuffing needed
+    uint8_t packet[] = { 0xFF, 0xFF, 0xFD, 0x00, id, 7, 0, AX_CMD_READ_DATA, addr, addr >> 8, nb_bytes, 0 };
+    uint16_t crc = ax2Crc(0, packet, sizeof(packet));
+    
+    local_rx_buffer_count = 0;
+    setTX();
+    for (uint8_t i = 0; i < sizeof(packet); i++){
+        serial_write(packet[i]);
+    }
+    serial_write(crc);
+    serial_write(crc >> 8);
+    setRX();
+    
+    axWaitPacket(AX2_HEADER_SIZE, regs[ADDR_USART_TIMEOUT], true);
+    uint8_t* reply = local_rx_buffer;
+    uint16_t length = AX2_LENGTH(reply);
+    if ( local_rx_buffer_count < AX2_HEADER_SIZE 
+        || reply[0] != 0xFF || reply[1] != 0xFF || reply[2] != 0xFD || reply[3] != 0x00 || reply[AX2_PACKET_ID] != id
+        || length < AX2_PACKET_OVERHEAD + 1 || length > AX_BUFFER_SIZE - AX2_HEADER_SIZE ){
+        return false;
+    }
+    
+    uint8_t total = AX2_HEADER_SIZE + length;
+    axWaitPacket(total, regs[ADDR_USART_TIMEOUT], false); // the turnaround was recorded with the header
+    if ( local_rx_buffer_count != total || reply[AX2_PACKET_INSTRUCTION] != AX2_CMD_STATUS
+        || ax2Crc(0, reply, total - 2) != (reply[total - 2] | (reply[total - 1] << 8)) ){
+        return false;
+    }
+    
+    // error byte and parameters
+    return ax2Unstuff(reply + AX2_PACKET_PARAMS, length - AX2_PACKET_OVERHEAD) == nb_bytes + 1;
+}
+
+
+// add nb_bytes read from a servo to the reply, 0xFF if it did not answer properly
+static void ax2ReadSlot(uint8_t id, uint16_t addr, uint8_t nb_bytes){
+    uint8_t success = ax2Read(id, addr, nb_bytes);
+    for (uint8_t i = 0; i < nb_bytes; i++){
+        ax2ReplyByte(success ? local_rx_buffer[AX2_PACKET_PARAMS + 1 + i] : 0xFF);
+    }
+}
+
+// sync_read under Protocol 2.0: <addr L> <addr H> <length L> <length H> <ID 1> ... <ID N>
+static void sync_read2(uint8_t* params, uint8_t nb_params){
+    uint16_t addr = params[0] | (params[1] << 8);
+    uint16_t nb_to_read = params[2] | (params[3] << 8);
+    uint8_t nb_servos = nb_params - 4;
+    if ( nb_params < 5 || nb_to_read == 0 || nb_to_read > AX_BUFFER_SIZE - AX2_HEADER_SIZE - AX2_PACKET_OVERHEAD - 1
+        || ! ax2ReplyFits(nb_to_read * nb_servos) ){
+        ax2StatusPacket(AX2_ERROR_RANGE, NULL, 0);
+        return;
+    }
+    
+    ax2StartReply(AX2_ERROR_NONE);
+    for (uint8_t i = 0; i < nb_servos; i++){
+        ax2ReadSlot(params[4 + i], addr, nb_to_read);
+    }
+    ax2EndReply();
+}
+
+// bulk_read under Protocol 2.0: (<ID> <addr L> <addr H> <length L> <length H>) for each servo
+static void bulk_read2(uint8_t* params, uint8_t nb_params){
+    if (nb_params == 0 || nb_params % 5 != 0){
+        ax2StatusPacket(AX2_ERROR_RANGE, NULL, 0);
+        return;
+    }
+    uint16_t nb_bytes = 0;
+    for (uint8_t i = 0; i < nb_params; i += 5){
+        uint16_t nb_to_read = params[i + 3] | (params[i + 4] << 8);
+        if (nb_to_read == 0 || nb_to_read > AX_BUFFER_SIZE - AX2_HEADER_SIZE - AX2_PACKET_OVERHEAD - 1){
+            ax2StatusPacket(AX2_ERROR_RANGE, NULL, 0);
+            return;
+        }
+        nb_bytes += nb_to_read;
+    }
+    if ( ! ax2ReplyFits(nb_bytes) ){
+        ax2StatusPacket(AX2_ERROR_RANGE, NULL, 0);
+        return;
+    }
+    
+    ax2StartReply(AX2_ERROR_NONE);
+    for (uint8_t i = 0; i < nb_params; i += 5){
+        ax2ReadSlot(params[i], params[i + 1] | (params[i + 2] << 8), params[i + 3]);
+    }
+    ax2EndReply();
+}
+
+
+// execute a Protocol 2.0 packet sent to the USB2AX, already checked and unstuffed
+void ax2_local_command(uint8_t* packet, uint8_t nb_params){
+    uint8_t* params = packet + AX2_PACKET_PARAMS;
+    ax_protocol = AX_PROTOCOL_2; // the status packets of the local commands are sent in Protocol 2.0 as well
+    axDivert(AX_DIVERT); // the status packets are built in place in the USB buffer, nothing from the servos must get in
+    
+    switch (packet[AX2_PACKET_INSTRUCTION]){
+        case AX_CMD_PING: {
+            uint8_t model[] = { MODEL_NUMBER_L, MODEL_NUMBER_H, FIRMWARE_VERSION };
+            ax2StatusPacket(AX2_ERROR_NONE, model, sizeof(model));
+            break;
+        }
+        case AX_CMD_READ_DATA:
+            if (nb_params != 4 || params[1] != 0 || params[3] != 0){
+                ax2StatusPacket(AX2_ERROR_RANGE, NULL, 0);
+            } else {
+                local_read(params[0], params[2], packet); // the parameters leave less room than the register table needs
+            }
+            break;
+        case AX_CMD_WRITE_DATA:
+            if (nb_params < 3 || params[1] != 0){
+                ax2StatusPacket(AX2_ERROR_RANGE, NULL, 0);
+            } else {
+                local_write(params[0], params + 2, nb_params - 2);
+            }
+            break;
+        case AX2_CMD_SYNC_READ:
+            sync_read2(params, nb_params);
+            break;
+        case AX2_CMD_BULK_READ:
+            bulk_read2(params, nb_params);
+            break;
+        default:
+            ax2StatusPacket(AX2_ERROR_INSTRUCTION, NULL, 0);
+            break;
+    }
+    
+    axPassthrough();
+    ax_protocol = AX_PROTOCOL_1;
+}
@@ -0,0 +1,45 @@
+/*
+ * AX2.h
+ *
+ * Dynamixel Protocol 2.0 support: CRC, byte stuffing, and the local commands of the USB2AX.
+ *
+ * Packets: 0xFF 0xFF 0xFD 0x00 <ID> <LEN_L> <LEN_H> <Instruction> <Param 1> ... <Param N> <CRC_L> <CRC_H>
+ * LEN counts the bytes from the instruction to the CRC, byte stuffing included: whenever 0xFF 0xFF 0xFD appears
+ * after the header, an extra 0xFD is inserted after it.
+ * ID 0xFD is reserved by the protocol, so no servo can use it: the USB2AX answers to it like in Protocol 1.0.
+ */
+
+
+#ifndef AX2_H_
+#define AX2_H_
+#include "AX.h"
+
+#define AX2_HEADER_SIZE         7       // 0xFF 0xFF 0xFD 0x00 ID LEN_L LEN_H
+#define AX2_PACKET_ID           4
+#define AX2_PACKET_LENGTH_L     5
+#define AX2_PACKET_LENGTH_H     6
+#define AX2_PACKET_INSTRUCTION  7
+#define AX2_PACKET_PARAMS       8       // the error byte in status packets
+#define AX2_PACKET_OVERHEAD     3       // instruction and CRC, counted in LEN with the parameters
+#define AX2_LENGTH(packet)      ((packet)[AX2_PACKET_LENGTH_L] | ((uint16_t)(packet)[AX2_PACKET_LENGTH_H] << 8))
+
+// largest status packet with nb_data parameters: header, instruction, error, the data with a 0xFD added after every
+// 0xFF 0xFF 0xFD (at worst one every third byte), and CRC
+#define AX2_REPLY_SIZE(nb_data) (AX2_HEADER_SIZE + 2 + (nb_data) + (nb_data) / 3 + 2)
+
+#define AX2_CMD_STATUS          0x55
+#define AX2_CMD_SYNC_READ       0x82
+#define AX2_CMD_BULK_READ       0x92
+
+// Error numbers for status packets
+#define AX2_ERROR_NONE          0x00
+#define AX2_ERROR_INSTRUCTION   0x02
+#define AX2_ERROR_CRC           0x03
+#define AX2_ERROR_RANGE         0x04
+
+uint16_t ax2Crc(uint16_t crc, uint8_t* data, uint16_t nb_bytes);
+uint8_t ax2Unstuff(uint8_t* data, uint8_t nb_bytes);
+void ax2StatusPacket(uint8_t err, uint8_t* data, uint8_t nb_bytes);
+void ax2_local_command(uint8_t* packet, uint8_t nb_params);
+
+#endif /* AX2_H_ */
@@ -57,8 +57,17 @@ Original copyright notice :
 		/** Size in bytes of the CDC device-to-host notification IN endpoint. */
 		#define CDC_NOTIFICATION_EPSIZE        8
 
-		/** Size in bytes of the CDC data IN and OUT endpoints. */
-		#define CDC_TXRX_EPSIZE                16
+		/** Size in bytes of the CDC data IN endpoint. */
+		#define CDC_TX_EPSIZE                  64
+
+		/** Size in bytes of the CDC data OUT endpoint. */
+		#define CDC_RX_EPSIZE                  16
+
+		/** Number of banks of the CDC data IN and OUT endpoints. Double banking lets the AVR fill (or read)
+		 *  one bank while the host drains (or fills) the other. The ATmega32u2 only has 176 bytes of endpoint
+		 *  DPRAM: 8 (control) + 8 (notification) + 2 x 64 (IN) + 2 x 16 (OUT) uses all of it.
+		 */
+		#define CDC_TXRX_BANKS                 2
 
 	/* Type Defines: */
 		/** Type define for the device configuration descriptor structure. This must be defined in the
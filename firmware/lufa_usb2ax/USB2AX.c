@@ -44,18 +44,19 @@ Original copyright notice :
 
 #include "USB2AX.h"
 #include "AX.h"
+#include "AX2.h"
 #include "reset.h"
 #include <util/delay.h>
 #include "eeprom.h"
 #include "debug.h"
 
 /*TODO list for the firmware:
-- instead of arbitrarily limiting the number of bytes and of servos in sync_read, limit bytes*servos instead...
 - there's been reports of the LED turning off when the computer goes to sleep and not turning on again when woke up...
 - try to fill the IN bank as the bytes arrives instead of at the last moment, see if there is something to be gained...
 - proper Doxygen doc instead of a bunch of random comments here and there
-- rework the timers to have something (maybe)faster and less ugly
 Done:
+- instead of arbitrarily limiting the number of bytes and of servos in sync_read, limit bytes*servos instead (replies are now split in several packets)
+- rework the timers to have something (maybe)faster and less ugly
 - make the timeout lengths R/W parameters. Maybe set a minimum to avoid blocking the input...
 - baud rate: use frequency doubling if needed (example : 57200 should become 57142, not around 58823)
 */
@@ -72,14 +73,14 @@ USB_ClassInfo_CDC_Device_t USB2AX_CDC_Interface =
             .DataINEndpoint                 =
             {
                 .Address                = CDC_TX_EPADDR,
-                .Size                   = CDC_TXRX_EPSIZE,
-                .Banks                  = 1,
+                .Size                   = CDC_TX_EPSIZE,
+                .Banks                  = CDC_TXRX_BANKS,
             },
             .DataOUTEndpoint                =
             {
                 .Address                = CDC_RX_EPADDR,
-                .Size                   = CDC_TXRX_EPSIZE,
-                .Banks                  = 1,
+                .Size                   = CDC_RX_EPSIZE,
+                .Banks                  = CDC_TXRX_BANKS,
             },
             .NotificationEndpoint           =
             {
@@ -91,8 +92,10 @@ USB_ClassInfo_CDC_Device_t USB2AX_CDC_Interface =
     };
 
 // Sending data to USB
-RingBuffer_t	ToUSB_Buffer;  // Circular buffer to hold data before it is sent to the host.
-static uint8_t  ToUSB_Buffer_Data[254]; // Underlying data buffer for \ref ToUSB_Buffer, where the stored bytes are located.
+fifo_t			ToUSB_Buffer;  // Circular buffer to hold data before it is sent to the host. Filled by the RX ISR, emptied by send_USB_data().
+uint8_t         arena[ARENA_SIZE]; // Underlying data buffer for \ref ToUSB_Buffer, shared with the local buffers (see ARENA_LOCAL).
+static uint8_t  arena_layout = ARENA_PASSTHROUGH;  // layout in use
+static uint8_t  arena_wanted = ARENA_PASSTHROUGH;  // layout to switch to as soon as the USB buffer is empty
 										/* Seed Robotics 29-6-2017: increased size from 128 to 254;
 										 * this should accommodate larger bursts of data on devices with longer control
 										 * tables. Upon reviewing the memory usage reported by the compiler, it seems
@@ -108,15 +111,40 @@ static uint8_t  ToUSB_Buffer_Data[254]; // Underlying data buffer for \ref ToUSB
 										 * issue that delays transmission to the host.
 										 * Also if we make it > 255 bytes, we will need to change the RingBuffer_t structures to ints 
 										 * instead of uint8s for indexes as they would be > 255
+										 * Now 512 bytes when nothing runs locally, with 16-bit indexes: the buffers of the
+										 * local commands take part of it back when they need it, see arena_set_layout().
 										 */
+// Sending data to the Dynamixel bus
+fifo_t			ToUSART_Buffer;  // Circular buffer to hold data while the USART Data Register Empty ISR sends it on the bus.
+static uint8_t  ToUSART_Buffer_Data[64]; // Underlying data buffer for \ref ToUSART_Buffer. Lets the main loop keep reading 
+										 // the USB while a long instruction packet goes out on the bus.
+
+// Framing of the status packets coming back from the servos, tracked by the RX ISR in passthrough mode
+// so that each packet can be sent to the host as soon as its last byte has arrived.
+// Both Dynamixel 1.0 (0xFF 0xFF ID LEN ...) and 2.0 (0xFF 0xFF 0xFD 0x00 ID LEN_L LEN_H ...) are recognized.
+#define FRAME_FIRST_FF      0
+#define FRAME_SECOND_FF     1
+#define FRAME_ID            2
+#define FRAME_ID_OR_V2      3   // 0xFD: either the ID of a 1.0 packet, or the third byte of a 2.0 header
+#define FRAME_LENGTH        4
+#define FRAME_V2_ID         5
+#define FRAME_V2_LENGTH_L   6
+#define FRAME_V2_LENGTH_H   7
+#define FRAME_CONTENT       8
+
+static uint8_t  frame_state = FRAME_FIRST_FF;
+static uint16_t frame_remaining = 0;    // bytes left in the current packet
+volatile uint8_t frames_received = 0;   // incremented by the RX ISR each time a status packet is complete
+static uint8_t   frames_flushed = 0;    // value of frames_received when the USB buffer was last emptied
+bool local_frame_ended = false;         // set by the main loop when it has completed a status packet of its own
+
 uint8_t needEmptyPacket = false; // flag used when an additional, empty packet needs to be sent to properly conclude an USB transfer
 
-// Buffer used when diverting USART data for local processing
-uint8_t	local_rx_buffer[AX_BUFFER_SIZE];
+// Buffer used when diverting USART data for local processing: local_rx_buffer, in the arena
 volatile uint8_t local_rx_buffer_count = 0;
 
 // Pass through 
-bool passthrough_mode = AX_PASSTHROUGH; // determines if data from the USART is passed to the USB or diverted for local processing
+uint8_t passthrough_mode = AX_PASSTHROUGH; // determines if data from the USART is passed to the USB or diverted for local processing
 
 // Dynamixel packet parser stuff
 // AX receive states
@@ -131,20 +159,31 @@ bool passthrough_mode = AX_PASSTHROUGH; // determines if data from the USART is
 #define AX_SEARCH_READ       8
 #define AX_SEARCH_PING       9
 #define AX_PASS_TO_SERVOS    10
+#define AX2_SEARCH_HEADER    11  // Protocol 2.0: ID and length
+#define AX2_GET_PACKET       12  // Protocol 2.0: rest of a packet for the USB2AX
 
 uint8_t ax_state = AX_SEARCH_FIRST_FF; // current state of the Dynamixel packet parser state machine
 uint16_t ax_checksum = 0;
-uint8_t rxbyte[AX_SYNC_READ_MAX_DEVICES + 8]; // buffer where currently processed data are stored when looking for a Dynamixel packet, with enough space for longest possible sync read request
+static uint8_t rxbyte_header[AX_RX_HEADER_SIZE]; // where the header of a packet is parsed, until it is known to be for the USB2AX
+uint8_t* rxbyte = rxbyte_header; // buffer where currently processed data are stored when looking for a Dynamixel packet: rxbyte_header,
+                                 // or arena_rxbyte once the packet is known to be for the USB2AX, with enough space for longest possible sync read request
 uint8_t rxbyte_count = 0;   // number of used bytes in rxbyte buffer
+uint16_t ax_pass_remaining = 0; // bytes of the current packet still to be passed to the servos, in AX_PASS_TO_SERVOS
 
 
 uint8_t needs_bootload = false; // In EVENT_CDC_Device_LineEncodingChanged, this flag is set when the baudrate is at a pre-defined value
 
 
 // timeout
-volatile uint8_t receive_timer = 0; // timer for Dynamixel packet reception from USB
-volatile uint8_t    send_timer = 0; // timer for sending data to the PC
-volatile uint8_t   usart_timer = 0; // timer for RX read timeout
+// timestamps (see timer_now()) the timeouts are measured from
+// on 32 bits: the main loop can be held up for longer than timer_now() takes to wrap around (sync_read, SCAN...)
+uint32_t receive_timer = 0; // last byte of a Dynamixel packet received from USB
+uint32_t    send_timer = 0; // last change of the data waiting to be sent to the PC
+static uint16_t send_timer_count = 0; // amount of data waiting to be sent to the PC at that time
+static uint32_t USB_waiting_since = 0; // the bytes at the front of the USB buffer started waiting for their bank, see ADDR_HIST_USB_FLUSH
+static uint8_t  USB_waiting = false;   // USB_waiting_since is valid
+
+volatile uint16_t timer_overflows = 0; // upper 16 bits of the 32-bit time, see timer_now32()
 
 
 int main(void){
@@ -153,7 +192,8 @@ int main(void){
     axInit();
     init_debug();
 
-    RingBuffer_InitBuffer(&ToUSB_Buffer, ToUSB_Buffer_Data, sizeof(ToUSB_Buffer_Data));
+    fifo_init(&ToUSB_Buffer, arena, ARENA_SIZE);
+    fifo_init(&ToUSART_Buffer, ToUSART_Buffer_Data, sizeof(ToUSART_Buffer_Data));
 	LEDs_SetAllLEDs(LEDMASK_USB_NOTREADY);
     sei();
 
@@ -169,48 +209,179 @@ int main(void){
         // get bytes from USB
         process_incoming_USB_data();
         
+        sync_read_task();
+        
+        if (ax_state == AX_SEARCH_FIRST_FF && ! sync_read_busy()){ // don't cut in the middle of a packet from the host
+            stream_task(arena_rxbyte); // the parser is idle, the room for the parameters is free
+        }
+        
         send_USB_data();
         
         USB_USBTask();
     }
 }
 
-void cdc_send_byte(uint8_t data){ // TODO inline ?
-	// Careful when calling this outside of the RX ISR: we should NEVER call it when the RX ISR is enabled (risk of corruption of the buffer)
-	// So the best way to do it, if it was needed to call it while RX interrupt is enabled, would be to disable it, call this, then re-enable it immediately... and hope no char was lost
-	// BUT anyway it should never happen : it would just corrupt the datastream to have multiple sources writing to it at the same time... so this warning is useless. 
+void cdc_send_byte(uint8_t data){
+	// The RX ISR is the producer of ToUSB_Buffer: when the main loop needs to add data too (status packets
+	// of local commands), the ISR must not be able to run in the middle of it.
+	uint_reg_t CurrentGlobalInt = GetGlobalInterruptMask();
+	GlobalInterruptDisable();
+
+	if ( ! fifo_push(&ToUSB_Buffer, data) ){
+		stat_inc(STAT_USB_OVERFLOWS);
+	}
+
+	SetGlobalInterruptMask(CurrentGlobalInt);
+}
+
+// Ask for the data waiting in the USB buffer to be sent without waiting for the send timeout, 
+// because it ends with a complete status packet.
+void end_USB_frame(void){
+	local_frame_ended = true;
+}
+
+// In AX_STREAM mode, the RX ISR stages the parameters of the servo reply in the USB buffer: once the reply has 
+// been checked, they are either committed (and sent to the host), or discarded. Call these only when the ISR
+// is done with the reply (stream_length == 0).
+// Number of bytes which can still be put in the USB buffer.
+uint16_t USB_data_room(void){
+	return fifo_room(&ToUSB_Buffer);
+}
+
+// Size of the USB buffer in the current layout of the arena, the most that can ever be put in it at once.
+uint16_t USB_data_size(void){
+	return ToUSB_Buffer.size;
+}
+
+void commit_USB_data(void){
+	fifo_commit(&ToUSB_Buffer);
+}
+
+void discard_USB_data(void){
+	fifo_discard(&ToUSB_Buffer);
+}
+
+// Wait until nb_bytes can be put in the USB buffer, flushing it in the meantime.
+// Gives up if the host stops taking data (port closed...), in which case the extra bytes will be dropped.
+void wait_USB_room(uint16_t nb_bytes){
+	uint16_t count = fifo_count(&ToUSB_Buffer);
+	uint16_t timer = timer_now();
+	while ( fifo_room(&ToUSB_Buffer) < nb_bytes ){
+		send_USB_data();
+		if (fifo_count(&ToUSB_Buffer) != count){ // some data went out, restart the timeout
+			count = fifo_count(&ToUSB_Buffer);
+			timer = timer_now();
+		} else if (timer_elapsed(timer, USB_ROOM_TIMEOUT)){
+			break;
+		}
+	}
+}
+
+// size of the USB buffer in each arena layout
+static uint16_t arena_USB_size(uint8_t layout){
+	switch (layout){
+		case ARENA_LOCAL:  return ARENA_SIZE - ARENA_REPLIES_SIZE - ARENA_RXBYTE_SIZE;
+		case ARENA_STREAM: return ARENA_SIZE - ARENA_REPLIES_SIZE - ARENA_RXBYTE_SIZE - ARENA_PREVIOUS_SIZE - ARENA_IDS_SIZE;
+		default:           return ARENA_SIZE;
+	}
+}
+
+// switch to the wanted layout if the USB buffer is empty (the RX ISR can't add anything while we check)
+static void arena_apply_layout(void){
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+		if ( arena_layout != arena_wanted && fifo_count(&ToUSB_Buffer) == 0 ){
+			fifo_init(&ToUSB_Buffer, arena, arena_USB_size(arena_wanted));
+			arena_layout = arena_wanted;
+		}
+	}
+}
+
+// Change the layout of the arena.
+// If the USB buffer has to shrink, the new layout is needed right away: the buffer is emptied first (or dropped if the host
+// does not take it). Otherwise, the new layout is used as soon as the buffer is empty.
+void arena_set_layout(uint8_t layout){
+	if (layout == ARENA_PASSTHROUGH && rxbyte != rxbyte_header){ // the parser still needs its part
+		layout = ARENA_LOCAL;
+	}
+	arena_wanted = layout;
+	if ( arena_USB_size(layout) >= arena_USB_size(arena_layout) ){
+		arena_apply_layout();
+		return;
+	}
 	
-	// Seed Robotics 29-06-2017: RingBuffer_Insert and remove have been modified to disable interrupts when
-	// manipulating the buffer structures; it should help ensure the manipulation is atomic if multiple
-	// sources are using it (such as, for example, an Interrupt firing and removing a byte from the buffer while
-	// the main code thread is doing the insert here). By disabling the interrupts temporarily we can
-	// prevent this.
-	RingBuffer_Insert(&ToUSB_Buffer, data);
-	send_timer = 0;
+	uint16_t count = fifo_count(&ToUSB_Buffer);
+	uint16_t timer = timer_now();
+	while (arena_layout != arena_wanted){ // send_USB_data() applies the layout once the buffer is empty
+		send_USB_data();
+		if (fifo_count(&ToUSB_Buffer) != count){ // some data went out (or came in), restart the timeout
+			count = fifo_count(&ToUSB_Buffer);
+			timer = timer_now();
+		} else if (timer_elapsed(timer, USB_ROOM_TIMEOUT)){ // the host is not taking anything
+			fifo_flush(&ToUSB_Buffer);
+		}
+	}
+}
+
+// Position of the next byte put in the USB buffer, to go back to the bytes put from there with USB_data_at().
+// Only call this from the main loop, when the RX ISR is not allowed to insert data (AX_DIVERT),
+// and send_USB_data() must not be called in the meantime.
+uint16_t tell_USB_data(void){
+	return fifo_tell(&ToUSB_Buffer);
+}
+
+uint8_t* USB_data_at(uint16_t position, uint16_t offset){
+	return fifo_at(&ToUSB_Buffer, position, offset);
 }
 
 void send_USB_data(void){
 	// process outgoing USB data
+	prof_begin(PROF_SEND_USB);
+	uint8_t frames = frames_received; // read before the count, so that the count includes the end of these frames
+	arena_apply_layout();
+	uint16_t BufferCount = fifo_count(&ToUSB_Buffer);
+	stat_max(STAT_USB_HIGH_WATER, BufferCount); // the buffer only gets emptied from here, so this is where it is the fullest
+	if (BufferCount != send_timer_count){ // data came in (or went out) since last time, restart the send timeout
+		send_timer = timer_now32();
+		send_timer_count = BufferCount;
+	}
+	if (BufferCount && ! USB_waiting){ // the buffer was empty last time
+		USB_waiting_since = timer_now32();
+		USB_waiting = true;
+	}
+	
 	Endpoint_SelectEndpoint(CDC_TX_EPADDR); // select IN endpoint to restore its registers
 	if ( Endpoint_IsINReady() ){ // if we can write on the outgoing data bank
-		uint8_t BufferCount = RingBuffer_GetCount(&ToUSB_Buffer);
-		
 		if (BufferCount) {
-			// if there are more bytes in the buffer than what can be put in the data bank OR there are a few bytes and they have been waiting for too long
-			if ( BufferCount >= CDC_TXRX_EPSIZE || send_timer > regs[ADDR_SEND_TIMEOUT] ){
-				send_timer = 0;
+			// if there are more bytes in the buffer than what can be put in the data bank OR a status packet is complete
+			// OR there are a few bytes and they have been waiting for too long
+			if ( BufferCount >= CDC_TX_EPSIZE || frames != frames_flushed || local_frame_ended 
+				|| timer_elapsed32(send_timer, regs[ADDR_SEND_TIMEOUT]) ){
 				
-				// load the IN data bank until full or until we loaded all the bytes we know we have
-				uint8_t nb_to_write = min(BufferCount, CDC_TXRX_EPSIZE );					
-				while (nb_to_write--){
-                	uint8_t Data = RingBuffer_Remove(&ToUSB_Buffer);
-					Endpoint_Write_8(Data);
+				// load the IN data bank until full or until we loaded all the bytes we know we have,
+				// in one run, or two if the data wraps around the end of the buffer
+				uint8_t nb_to_write = min(BufferCount, CDC_TX_EPSIZE );					
+				if (nb_to_write == BufferCount){ // the end of the completed packets is going out now
+					frames_flushed = frames;
+					local_frame_ended = false;
+				}
+				while (nb_to_write){
+					uint8_t* Data;
+					uint8_t nb_contiguous = min(nb_to_write, fifo_contiguous(&ToUSB_Buffer, &Data));
+					Endpoint_Write_Stream_LE(Data, nb_contiguous, NULL);
+					fifo_skip(&ToUSB_Buffer, nb_contiguous);
+					nb_to_write -= nb_contiguous;
 				}
 				
 				// if the bank is full (== we can't write to it anymore), we might need an empty packet after this one
 				needEmptyPacket = ! Endpoint_IsReadWriteAllowed();
 				
 				Endpoint_ClearIN(); // allow the hardware to send the content of the bank
+				
+				uint32_t now = timer_now32();
+				uint32_t waited = now - USB_waiting_since; // can be longer than the 32ms the 16-bit timer wraps around at
+				hist_add(ADDR_HIST_USB_FLUSH, waited > 0xFFFF ? 0xFFFF : waited);
+				USB_waiting_since = now; // what is left waits for the next bank from now on
+				USB_waiting = (BufferCount > CDC_TX_EPSIZE);
 			}
 		} else if (needEmptyPacket) {
 			// send an empty packet to end the transfer
@@ -219,6 +390,25 @@ void send_USB_data(void){
 		}
 		
 	}
+	prof_end(PROF_SEND_USB);
+}
+
+// the packet is for the USB2AX: move it to the arena, where there is room for its parameters
+static void parser_claim_arena(void){
+    arena_set_layout(axLocalLayout());
+    memcpy(arena_rxbyte, rxbyte_header, rxbyte_count);
+    rxbyte = arena_rxbyte;
+    Endpoint_SelectEndpoint(CDC_RX_EPADDR); // arena_set_layout() may have sent USB data
+}
+
+// the parser is done with the packet: give the arena back, unless a sync_read still reads the IDs in it (it does at its end)
+static void parser_release_arena(void){
+    if (rxbyte != rxbyte_header){
+        rxbyte = rxbyte_header;
+        if ( ! sync_read_busy() ){
+            axPassthrough();
+        }
+    }
 }
 
 void cleanup_input_parser(void){
@@ -228,11 +418,12 @@ void cleanup_input_parser(void){
         pass_bytes(rxbyte_count-1); // pass the discarded data, except the last 0xFF
         ax_state = AX_SEARCH_SECOND_FF;
         rxbyte_count = 1; // keep the first 0xFF in the buffer
-		receive_timer = 0;
+		receive_timer = timer_now32();
     } else {
         pass_bytes(rxbyte_count);
         ax_state = AX_SEARCH_FIRST_FF;
     }
+    parser_release_arena(); // rxbyte_header starts with the same 0xFF
 }
 
 
@@ -245,94 +436,125 @@ void cleanup_input_parser(void){
 #define SYNC_READ_LENGTH  6
 
 void process_incoming_USB_data(void){
-	uint8_t USB_nb_received = CDC_Device_BytesReceived (&USB2AX_CDC_Interface);
-	
-	if (USB_nb_received>0){
-        for( uint8_t i = 0; i < USB_nb_received ; i++ ){
-
-            //up2;dw2;
-            //for(uint8_t dbg_i = 0; dbg_i<ax_state; dbg_i++){
-              //up2;dw2;
-            //}
-            
+	// work on the OUT bank in place, instead of going through the CDC driver for each byte
+	uint8_t port_open = USB_DeviceState == DEVICE_STATE_Configured && USB2AX_CDC_Interface.State.LineEncoding.BaudRateBPS;
+	Endpoint_SelectEndpoint(CDC_RX_EPADDR);
+	if (port_open && Endpoint_IsOUTReceived()){
+        // the hardware counts down the bytes left in the bank as we read them.
+        // While a sync_read runs, the next command from the host waits in the bank (rxbyte holds the IDs to read).
+        while( Endpoint_BytesInEndpoint() && ! sync_read_busy() ){
+            prof_begin(PROF_PARSER);
             switch (ax_state){
                 case AX_SEARCH_FIRST_FF:
-                    rxbyte[PACKET_FIRST_0XFF] = CDC_Device_ReceiveByte(&USB2AX_CDC_Interface);
-                    if (rxbyte[PACKET_FIRST_0XFF] == 0xFF){
-                        //up2;dw2;
-                        ax_state = AX_SEARCH_SECOND_FF;
-                        rxbyte_count = 1;
-                        receive_timer = 0;
-                    } else {
-                        setTX();
+                    // pass everything up to the next 0xFF in one run
+                    do {
+                        rxbyte[PACKET_FIRST_0XFF] = Endpoint_Read_8();
+                        if (rxbyte[PACKET_FIRST_0XFF] == 0xFF){
+                            ax_state = AX_SEARCH_SECOND_FF;
+                            rxbyte_count = 1;
+                            receive_timer = timer_now32();
+                            break;
+                        }
                         serial_write(rxbyte[0]);
-                    }
+                    } while ( Endpoint_BytesInEndpoint() );
+                    serial_high_water();
                     break;
                             
                 case AX_SEARCH_SECOND_FF:
-                    rxbyte[rxbyte_count++] = CDC_Device_ReceiveByte(&USB2AX_CDC_Interface);
+                    rxbyte[rxbyte_count++] = Endpoint_Read_8();
                     if (rxbyte[PACKET_SECOND_0XFF] == 0xFF){
                         ax_state = AX_SEARCH_ID;
-                        receive_timer = 0;
+                        receive_timer = timer_now32();
                     } else {
                         cleanup_input_parser();
                     }
                     break;
                             
                 case AX_SEARCH_ID:
-                    rxbyte[rxbyte_count++] = CDC_Device_ReceiveByte(&USB2AX_CDC_Interface);
+                    rxbyte[rxbyte_count++] = Endpoint_Read_8();
                     if (rxbyte[PACKET_ID] == 0xFF){ // we've seen 3 consecutive 0xFF
 						rxbyte_count--;
 						pass_bytes(1); // let a 0xFF pass
-					    receive_timer = 0;
+					    receive_timer = timer_now32();
 					} else {
                         ax_state = AX_SEARCH_LENGTH;
-                        receive_timer = 0;
+                        receive_timer = timer_now32();
                     }
                     break;
                             
                 case AX_SEARCH_LENGTH:
-                    rxbyte[rxbyte_count++] = CDC_Device_ReceiveByte(&USB2AX_CDC_Interface);
-                    if (rxbyte[PACKET_ID] == AX_ID_DEVICE || rxbyte[PACKET_ID] == AX_ID_BROADCAST ){
+                    rxbyte[rxbyte_count++] = Endpoint_Read_8();
+                    if (rxbyte[PACKET_ID] == 0xFD && rxbyte[PACKET_LENGTH] == 0x00){ // 0xFF 0xFF 0xFD 0x00: Protocol 2.0 header
+                        ax_state = AX2_SEARCH_HEADER;
+                        receive_timer = timer_now32();
+                    } else if (rxbyte[PACKET_ID] == AX_ID_DEVICE || rxbyte[PACKET_ID] == AX_ID_BROADCAST ){
+                        stat_inc(STAT_PACKETS);
                         if (rxbyte[PACKET_LENGTH] > 1 && rxbyte[PACKET_LENGTH] < (AX_SYNC_READ_MAX_DEVICES + 4)){  // reject message if too short or too big for rxbyte buffer
                             ax_state = AX_SEARCH_COMMAND;
-                            receive_timer = 0;
+                            receive_timer = timer_now32();
                         } else {
                             axStatusPacket(AX_ERROR_RANGE, NULL, 0);
                             cleanup_input_parser();
                         }
                     } else {
+                        stat_inc(STAT_PACKETS);
                         pass_bytes(rxbyte_count);
                         ax_state = AX_PASS_TO_SERVOS;
-                        receive_timer = 0;
+                        ax_pass_remaining = rxbyte[PACKET_LENGTH];
+                        rxbyte_count = 0; // already passed, the receive timeout must not pass it again
+                        receive_timer = timer_now32();
                     }
                     break;
                             
                 case AX_SEARCH_COMMAND:
-                    rxbyte[rxbyte_count++] = CDC_Device_ReceiveByte(&USB2AX_CDC_Interface);
+                    rxbyte[rxbyte_count++] = Endpoint_Read_8();
                     if (rxbyte[PACKET_INSTRUCTION] == AX_CMD_SYNC_READ){
                         ax_state = AX_GET_PARAMETERS;
                         ax_checksum =  rxbyte[PACKET_ID] + AX_CMD_SYNC_READ + rxbyte[PACKET_LENGTH];
-                        receive_timer = 0;
+                        receive_timer = timer_now32();
                     } else if(rxbyte[PACKET_ID] == AX_ID_DEVICE){ 
 				        if (rxbyte[PACKET_INSTRUCTION] == AX_CMD_PING){
 					        ax_state = AX_SEARCH_PING;
-					        receive_timer = 0;
+					        receive_timer = timer_now32();
 				        } else if (rxbyte[PACKET_INSTRUCTION] == AX_CMD_RESET){
                             ax_state = AX_SEARCH_RESET;
                             LEDs_TurnOnLEDs(LEDS_LED2);
-                            receive_timer = 0;
+                            receive_timer = timer_now32();
                         } else if (rxbyte[PACKET_INSTRUCTION] == AX_CMD_BOOTLOAD){
                             ax_state = AX_SEARCH_BOOTLOAD;
-                            receive_timer = 0;
+                            receive_timer = timer_now32();
                         } else if (rxbyte[PACKET_INSTRUCTION] == AX_CMD_READ_DATA) {
 				            ax_state = AX_GET_PARAMETERS;
                             ax_checksum = AX_ID_DEVICE + AX_CMD_READ_DATA + rxbyte[PACKET_LENGTH];
-						    receive_timer = 0;
+						    receive_timer = timer_now32();
                         } else if (rxbyte[PACKET_INSTRUCTION] == AX_CMD_WRITE_DATA) {
                             ax_state = AX_GET_PARAMETERS;
                             ax_checksum = AX_ID_DEVICE + AX_CMD_WRITE_DATA + rxbyte[PACKET_LENGTH];
-						    receive_timer = 0;
+						    receive_timer = timer_now32();
+                        } else if (rxbyte[PACKET_INSTRUCTION] == AX_CMD_BULK_READ) {
+                            ax_state = AX_GET_PARAMETERS;
+                            ax_checksum = AX_ID_DEVICE + AX_CMD_BULK_READ + rxbyte[PACKET_LENGTH];
+						    receive_timer = timer_now32();
+                        } else if (rxbyte[PACKET_INSTRUCTION] == AX_CMD_STREAM) {
+                            ax_state = AX_GET_PARAMETERS;
+                            ax_checksum = AX_ID_DEVICE + AX_CMD_STREAM + rxbyte[PACKET_LENGTH];
+						    receive_timer = timer_now32();
+                        } else if (rxbyte[PACKET_INSTRUCTION] == AX_CMD_WRITE_READ) {
+                            ax_state = AX_GET_PARAMETERS;
+                            ax_checksum = AX_ID_DEVICE + AX_CMD_WRITE_READ + rxbyte[PACKET_LENGTH];
+						    receive_timer = timer_now32();
+                        } else if (rxbyte[PACKET_INSTRUCTION] == AX_CMD_GROUP_SET) {
+                            ax_state = AX_GET_PARAMETERS;
+                            ax_checksum = AX_ID_DEVICE + AX_CMD_GROUP_SET + rxbyte[PACKET_LENGTH];
+						    receive_timer = timer_now32();
+                        } else if (rxbyte[PACKET_INSTRUCTION] == AX_CMD_GROUP_RUN) {
+                            ax_state = AX_GET_PARAMETERS;
+                            ax_checksum = AX_ID_DEVICE + AX_CMD_GROUP_RUN + rxbyte[PACKET_LENGTH];
+						    receive_timer = timer_now32();
+                        } else if (rxbyte[PACKET_INSTRUCTION] == AX_CMD_SCAN) {
+                            ax_state = AX_GET_PARAMETERS;
+                            ax_checksum = AX_ID_DEVICE + AX_CMD_SCAN + rxbyte[PACKET_LENGTH];
+						    receive_timer = timer_now32();
 						} else {
                             cleanup_input_parser();
                         }
@@ -342,93 +564,166 @@ void process_incoming_USB_data(void){
                     break;
                             
                 case AX_SEARCH_RESET:
-                    rxbyte[5] = CDC_Device_ReceiveByte(&USB2AX_CDC_Interface);
+                    rxbyte[5] = Endpoint_Read_8();
                     if (((AX_ID_DEVICE + 2 + AX_CMD_RESET + rxbyte[5]) % 256) == 255){
                         LEDs_SetAllLEDs(LEDMASK_USB_NOTREADY);
                         eeprom_clear();
                         Jump_To_Reset(false);
                     } else {
+                        stat_inc(STAT_CHECKSUM_ERRORS);
                         cleanup_input_parser();
                     }
                     break;
                         
                 case AX_SEARCH_BOOTLOAD:
-                    rxbyte[5] = CDC_Device_ReceiveByte(&USB2AX_CDC_Interface);
+                    rxbyte[5] = Endpoint_Read_8();
                     if (((AX_ID_DEVICE + 2 + AX_CMD_BOOTLOAD + rxbyte[5]) % 256) == 255){
                         LEDs_TurnOffLEDs(LEDS_LED2);
                         LEDs_SetAllLEDs(LEDMASK_USB_NOTREADY);
                         Jump_To_Reset(true);
                     } else {
+                        stat_inc(STAT_CHECKSUM_ERRORS);
                         cleanup_input_parser();
                     }
                     break;
 				
 				case AX_SEARCH_PING:
-					rxbyte[5] = CDC_Device_ReceiveByte(&USB2AX_CDC_Interface);
+					rxbyte[5] = Endpoint_Read_8();
 					if (((AX_ID_DEVICE + 2 + AX_CMD_PING + rxbyte[5]) % 256) == 255){
+						stat_inc(STAT_LOCAL_COMMANDS);
 						axStatusPacket(AX_ERROR_NONE, NULL, 0);
 						ax_state = AX_SEARCH_FIRST_FF;
                     } else {
+					    stat_inc(STAT_CHECKSUM_ERRORS);
 					    cleanup_input_parser();
 					}
 					break;
 				
                 case AX_GET_PARAMETERS:
-                    rxbyte[rxbyte_count] = CDC_Device_ReceiveByte(&USB2AX_CDC_Interface);
+                    if (rxbyte == rxbyte_header){
+                        parser_claim_arena();
+                    }
+                    rxbyte[rxbyte_count] = Endpoint_Read_8();
                     ax_checksum += rxbyte[rxbyte_count] ;
 					rxbyte_count++;
-                    receive_timer = 0;
+                    receive_timer = timer_now32();
                     if(rxbyte_count >= (rxbyte[PACKET_LENGTH] + 4)){ // we have read all the data for the packet
                         if((ax_checksum%256) != 255){  // ignore message if checksum is bad
+                            stat_inc(STAT_CHECKSUM_ERRORS);
                             cleanup_input_parser();
                         } else {
+                            stat_inc(STAT_LOCAL_COMMANDS);
 						    if (rxbyte[PACKET_INSTRUCTION] == AX_CMD_SYNC_READ){
-                                uint8_t nb_servos_to_read = rxbyte[PACKET_LENGTH] - 4;
                                 uint8_t packet_overhead = 6;
-                                if( (rxbyte[SYNC_READ_LENGTH] == 0)
-                                    || (rxbyte[SYNC_READ_LENGTH] > AX_BUFFER_SIZE - packet_overhead) // the return packets from the servos must fit the return buffer
-                                    || ( (int16_t)rxbyte[SYNC_READ_LENGTH] * nb_servos_to_read > AX_MAX_RETURN_PACKET_SIZE - packet_overhead )){ // and the return packet to the host must not be bigger either
+                                if( (rxbyte[PACKET_LENGTH] < 5) || (rxbyte[SYNC_READ_LENGTH] == 0)  // at least one servo
+                                    || (rxbyte[SYNC_READ_LENGTH] > AX_BUFFER_SIZE - packet_overhead) ){ // the return packets from the servos must fit the return buffer
+                                    // (the reply to the host is split in several packets if it is too big for one)
                                     axStatusPacket(AX_ERROR_RANGE, NULL, 0);
                                 } else {
                                     sync_read(&rxbyte[SYNC_READ_START_ADDR], rxbyte[PACKET_LENGTH] - 2);
 								}									
                             } else if (rxbyte[PACKET_INSTRUCTION] == AX_CMD_READ_DATA) {
-						        local_read(rxbyte[5], rxbyte[6]);
+						        local_read(rxbyte[5], rxbyte[6], &rxbyte[5]);
                             } else if(rxbyte[PACKET_INSTRUCTION] == AX_CMD_WRITE_DATA){
                                 local_write(rxbyte[5], &rxbyte[6], rxbyte[PACKET_LENGTH] - 3);
+                            } else if(rxbyte[PACKET_INSTRUCTION] == AX_CMD_BULK_READ){
+                                bulk_read(&rxbyte[5], rxbyte[PACKET_LENGTH] - 2);
+                            } else if(rxbyte[PACKET_INSTRUCTION] == AX_CMD_STREAM){
+                                stream_start(&rxbyte[5], rxbyte[PACKET_LENGTH] - 2);
+                            } else if(rxbyte[PACKET_INSTRUCTION] == AX_CMD_WRITE_READ){
+                                sync_write_read(&rxbyte[5], rxbyte[PACKET_LENGTH] - 2);
+                            } else if(rxbyte[PACKET_INSTRUCTION] == AX_CMD_GROUP_SET){
+                                group_set(&rxbyte[5], rxbyte[PACKET_LENGTH] - 2);
+                            } else if(rxbyte[PACKET_INSTRUCTION] == AX_CMD_GROUP_RUN){
+                                group_run(&rxbyte[5], rxbyte[PACKET_LENGTH] - 2);
+                            } else if(rxbyte[PACKET_INSTRUCTION] == AX_CMD_SCAN){
+                                bus_scan(&rxbyte[5], rxbyte[PACKET_LENGTH] - 2);
                             }
-						    ax_state = AX_SEARCH_FIRST_FF;													
+						    ax_state = AX_SEARCH_FIRST_FF;
+						    parser_release_arena();													
                         }
                     }
                     break;
                         
-                    case AX_PASS_TO_SERVOS:
-                        setTX();
-                        serial_write(CDC_Device_ReceiveByte(&USB2AX_CDC_Interface));
-                        rxbyte_count++;
-                        receive_timer = 0;
-                        if(rxbyte_count >= (rxbyte[PACKET_LENGTH] + 4)){ // we have read all the data for the packet // we have let the right number of bytes pass
+                case AX2_SEARCH_HEADER:
+                    rxbyte[rxbyte_count++] = Endpoint_Read_8();
+                    receive_timer = timer_now32();
+                    if (rxbyte_count == AX2_HEADER_SIZE){
+                        uint16_t length = AX2_LENGTH(rxbyte);
+                        stat_inc(STAT_PACKETS);
+                        if (rxbyte[AX2_PACKET_ID] != AX_ID_DEVICE){
+                            // the length includes the byte stuffing, so the packet can be passed as is
+                            pass_bytes(rxbyte_count);
+                            ax_state = AX_PASS_TO_SERVOS;
+                            ax_pass_remaining = length;
+                            rxbyte_count = 0;
+                        } else if (length < AX2_PACKET_OVERHEAD || length > AX_RX_BUFFER_SIZE - AX2_HEADER_SIZE){
+                            axDivert(AX_DIVERT); // the status packet is built in place in the USB buffer, see ax2_local_command()
+                            ax2StatusPacket(AX2_ERROR_RANGE, NULL, 0);
+                            axPassthrough();
+                            cleanup_input_parser();
+                        } else {
+                            ax_state = AX2_GET_PACKET;
+                        }
+                    }
+                    break;
+                
+                case AX2_GET_PACKET:
+                    if (rxbyte == rxbyte_header){
+                        parser_claim_arena();
+                    }
+                    rxbyte[rxbyte_count++] = Endpoint_Read_8();
+                    receive_timer = timer_now32();
+                    if (rxbyte_count == AX2_HEADER_SIZE + AX2_LENGTH(rxbyte)){
+                        uint16_t crc = rxbyte[rxbyte_count - 2] | (rxbyte[rxbyte_count - 1] << 8);
+                        if (ax2Crc(0, rxbyte, rxbyte_count - 2) != crc){  // ignore message if CRC is bad
+                            stat_inc(STAT_CHECKSUM_ERRORS);
+                            cleanup_input_parser();
+                        } else {
+                            stat_inc(STAT_LOCAL_COMMANDS);
+                            // instruction and parameters
+                            uint8_t nb_bytes = ax2Unstuff(&rxbyte[AX2_PACKET_INSTRUCTION], rxbyte_count - AX2_HEADER_SIZE - 2);
+                            ax2_local_command(rxbyte, nb_bytes - 1);
+                            ax_state = AX_SEARCH_FIRST_FF;
+                            parser_release_arena();
+                        }
+                    }
+                    break;
+                
+                    case AX_PASS_TO_SERVOS: {
+                        // the rest of the packet goes to the bus as is: pass as much of it as the bank holds in one run
+                        uint8_t nb_run = min(ax_pass_remaining, Endpoint_BytesInEndpoint());
+                        for (uint8_t i = 0; i < nb_run; i++){
+                            serial_write(Endpoint_Read_8());
+                        }
+                        serial_high_water();
+                        ax_pass_remaining -= nb_run;
+                        receive_timer = timer_now32();
+                        if(ax_pass_remaining == 0){ // we have let the right number of bytes pass
                             ax_state = AX_SEARCH_FIRST_FF;
                         }
                         break;
+                    }
 
                 default:
                     break;
             }
+            Endpoint_SelectEndpoint(CDC_RX_EPADDR); // the local commands select the IN endpoint to send their replies
+            prof_end(PROF_PARSER);
+        }
+        if ( ! Endpoint_BytesInEndpoint() ){
+            Endpoint_ClearOUT(); // give the bank back to the hardware for the next packet from the host
         }
 	}
 
 	// Timeout on state machine while waiting on further USB data
     if(ax_state != AX_SEARCH_FIRST_FF){
-        if (receive_timer > regs[ADDR_RECEIVE_TIMEOUT]){
+        if (timer_elapsed32(receive_timer, regs[ADDR_RECEIVE_TIMEOUT])){
             pass_bytes(rxbyte_count);
             ax_state = AX_SEARCH_FIRST_FF;
+            parser_release_arena();
 		}
     }
-
-    if( bit_is_set(UCSR1B, TXEN1) ){ // if some data has been sent, revert to RX
-        setRX();
-    }
 }
 
 void pass_bytes(uint8_t nb_bytes){
@@ -438,12 +733,12 @@ void pass_bytes(uint8_t nb_bytes){
     for (uint8_t i = 0; i < nb_bytes; i++){
         serial_write(rxbyte[i]);
     }
+    serial_high_water();
 }
 
 
-void setRX(void) {
-	loop_until_bit_is_set( UCSR1A, TXC1 ); // wait until last byte has been sent (it will set USART Transmit Complete flag)
-	
+// switch the USART to reception, only called once the last byte has left the shift register
+static inline void usart_rx_mode(void) {
 #if USE_RS485
     bitClear(PORTB, 1);
 #endif
@@ -452,14 +747,28 @@ void setRX(void) {
     UCSR1B = ((1 << RXCIE1) | (1 << RXEN1));
 }
 
+// have the TIMER1_COMPA ISR end the read of the current sync_read servo in delay ticks, unless a byte of the reply comes in first
+static inline void sync_read_start_timeout(uint16_t delay){
+	uint16_t now = TCNT1;
+	sync_read_sent_at = now;
+	OCR1A = now + delay;
+	TIFR1 = 1 << OCF1A;
+	TIMSK1 |= 1 << OCIE1A;
+}
+
+void setRX(void) {
+	// the TX ISRs revert to RX by themselves once everything has been sent, just wait for it
+	loop_until_bit_is_clear( UCSR1B, TXEN1 );
+}
+
 inline void setTX(void) {
     
 #if USE_RS485
     bitSet(PORTB, 1);
 #endif
     
-    // enable TX, disable RX and all RX interrupt
-    UCSR1B = (1 << TXEN1);
+    // enable TX and the Data Register Empty interrupt that feeds it, disable RX and all RX interrupt
+    UCSR1B = ((1 << TXEN1) | (1 << UDRIE1));
 }
 
 
@@ -489,18 +798,104 @@ void init_serial(long baud){
     // Another way to put it: if br and br2x are equal, choose the one with the highest stability (without U2X),
     // else choose the closest to the mark (and it will necessarily be the one with U2X).
 
-    // enable RX and RX interrupt, disable TX and all TX interrupt
-    UCSR1B = ((1 << RXCIE1) | (1 << RXEN1));
+    // anything still waiting to be sent was meant for the old baud rate
+    fifo_flush(&ToUSART_Buffer);
+    usart_rx_mode();
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE){ // also called from the LUFA control request, with the TIMER1 ISR enabled
+        if (sync_read_state == SYNC_READ_BUSY){ // the TX ISR won't start the timeout of the servo being read
+            sync_read_chain = SYNC_READ_CHAIN_NONE; // and the instruction prepared for the next one may be gone too
+            sync_read_start_timeout(SYNC_READ_END_DELAY);
+        }
+    }
 }
 
 
-// Sends data directly out of serial port
+// go back to the baud rate set by the host, after a local command used another one
+void restore_serial_baud(void){
+    init_serial(USB2AX_CDC_Interface.State.LineEncoding.BaudRateBPS);
+}
+
+
+// Queues data to be sent out of the serial port by the USART Data Register Empty ISR
 void serial_write(uint8_t data){
-    loop_until_bit_is_set(UCSR1A, UDRE1); //wait until the TX data registry can accept new data
-    
-    // Load the next byte from the USART transmit buffer into the USART
-    UDR1 = data;            // transmit data
-    bitSet(UCSR1A, TXC1);   // clear USART Transmit Complete flag
+    while ( ! fifo_push(&ToUSART_Buffer, data) ); // wait until the ISR makes some room
+    setTX(); // (re)start the transmission, in case the ISR had already emptied the buffer
+}
+
+// record how full the USART buffer is, after a run of serial_write(): sampling each byte would mask the interrupts each time
+void serial_high_water(void){
+    stat_max(STAT_USART_HIGH_WATER, fifo_count(&ToUSART_Buffer));
+}
+
+
+/** ISR to feed the USART with the bytes queued by serial_write(). */
+ISR(USART1_UDRE_vect, ISR_BLOCK){
+	if ( fifo_count(&ToUSART_Buffer) == 0 ){
+		// nothing left to send: wait for the last byte to leave the shift register before reverting to RX
+		UCSR1B = ((1 << TXEN1) | (1 << TXCIE1));
+	} else {
+		// Load the next byte from the USART transmit buffer into the USART
+		UDR1 = fifo_pop(&ToUSART_Buffer);  // transmit data
+		bitSet(UCSR1A, TXC1);   // clear USART Transmit Complete flag
+		stat_inc(STAT_BYTES_TO_BUS);
+	}
+}
+
+// follow the framing of the status packets passed to the host, count the ones that are complete
+static inline void track_status_frame(uint8_t data){
+	switch (frame_state){
+		case FRAME_FIRST_FF:
+			if (data == 0xFF){
+				frame_state = FRAME_SECOND_FF;
+			}
+			break;
+		case FRAME_SECOND_FF:
+			frame_state = (data == 0xFF) ? FRAME_ID : FRAME_FIRST_FF;
+			break;
+		case FRAME_ID:
+			if (data == 0xFD){
+				frame_state = FRAME_ID_OR_V2;
+			} else if (data != 0xFF){ // more than two 0xFF: still waiting for the ID
+				frame_state = FRAME_LENGTH;
+			}
+			break;
+		case FRAME_ID_OR_V2:
+			if (data == 0x00){ // reserved byte of a 2.0 header, a 1.0 LENGTH can't be 0
+				frame_state = FRAME_V2_ID;
+				break;
+			}
+			// else it was the ID of a 1.0 packet, and this is its LENGTH
+			// fall through
+		case FRAME_LENGTH:
+			frame_remaining = data;
+			frame_state = data ? FRAME_CONTENT : FRAME_FIRST_FF;
+			break;
+		case FRAME_V2_ID:
+			frame_state = FRAME_V2_LENGTH_L;
+			break;
+		case FRAME_V2_LENGTH_L:
+			frame_remaining = data;
+			frame_state = FRAME_V2_LENGTH_H;
+			break;
+		case FRAME_V2_LENGTH_H:
+			frame_remaining |= (uint16_t)data << 8;
+			frame_state = frame_remaining ? FRAME_CONTENT : FRAME_FIRST_FF;
+			break;
+		case FRAME_CONTENT:
+			if (--frame_remaining == 0){
+				frames_received++;
+				frame_state = FRAME_FIRST_FF;
+			}
+			break;
+	}
+}
+
+/** ISR called when the last queued byte has been sent on the bus, reverting to RX in time for the servo reply. */
+ISR(USART1_TX_vect, ISR_BLOCK){
+	usart_rx_mode();
+	if (sync_read_state == SYNC_READ_BUSY){ // the READ_DATA instruction is out
+		sync_read_start_timeout(sync_read_timeout);
+	}
 }
 
 
@@ -508,24 +903,84 @@ void serial_write(uint8_t data){
  *  for later transmission to the host.
  */
 ISR(USART1_RX_vect, ISR_BLOCK){
-    //up1;
+    prof_begin(PROF_USART_RX);
+    uint8_t status = UCSR1A; // the error flags are those of the byte about to be read
     uint8_t ReceivedByte = UDR1;
+	stat_inc(STAT_BYTES_FROM_BUS);
+	if (status & (1 << DOR1)){
+		stat_inc(STAT_USART_OVERRUNS);
+	}
+	if (status & (1 << FE1)){
+		stat_inc(STAT_USART_FRAME_ERRORS);
+	}
 	if ( passthrough_mode == AX_PASSTHROUGH ){
-		cdc_send_byte(ReceivedByte);
+		if ( ! fifo_push(&ToUSB_Buffer, ReceivedByte) ){
+			stat_inc(STAT_USB_OVERFLOWS);
+		}
+		track_status_frame(ReceivedByte);
+	} else if ( passthrough_mode == AX_STREAM ){
+		frame_state = FRAME_FIRST_FF; // the servo replies of local commands are not passed as is
+		// sync_read: the parameters of the reply go straight to the host, the header and checksum are kept to check the packet
+		uint8_t count = local_rx_buffer_count;
+		if (count < stream_length){
+			if (count < AX_REPLY_HEADER_SIZE){
+				local_rx_buffer[count] = ReceivedByte;
+			} else if (count == stream_length - 1){
+				local_rx_buffer[AX_REPLY_HEADER_SIZE] = ReceivedByte;
+			} else if ( ! fifo_stage(&ToUSB_Buffer, ReceivedByte) ){
+				stat_inc(STAT_USB_OVERFLOWS);
+			}
+			if (count >= 2){
+				stream_checksum += ReceivedByte;
+			}
+			local_rx_buffer_count = count + 1;
+			if (sync_read_state == SYNC_READ_BUSY){
+				// restart the timeout, or end it right away if the reply is complete
+				uint16_t now = TCNT1;
+				if (count == 0){
+					sync_read_first_byte_at = now;
+				}
+				if (count + 1 != stream_length){
+					OCR1A = now + sync_read_timeout;
+				} else {
+					OCR1A = now + SYNC_READ_END_DELAY;
+					hist_add(ADDR_HIST_TURNAROUND, now - sync_read_sent_at);
+					if (sync_read_chain == SYNC_READ_CHAIN_READY){ // ask the next servo right away, the reply is checked meanwhile
+						for (uint8_t i = 0; i < AX_READ_INSTRUCTION_SIZE; i++){
+							fifo_push(&ToUSART_Buffer, sync_read_request[i]);
+						}
+						setTX();
+						sync_read_chain = SYNC_READ_CHAIN_SENT;
+					}
+				}
+			}
+		}
 	} else {
+		frame_state = FRAME_FIRST_FF;
 		if (local_rx_buffer_count < AX_BUFFER_SIZE){
 			local_rx_buffer[local_rx_buffer_count++] = ReceivedByte;
 		}
-		usart_timer = 0;
 	}
-    //dw1;
+	prof_end(PROF_USART_RX);
+}
+
+// extend TIMER1 to 32 bits
+ISR(TIMER1_OVF_vect, ISR_BLOCK){
+	timer_overflows++;
 }
 
-// global timer
-ISR(TIMER0_COMPA_vect, ISR_BLOCK){
-	receive_timer++;
-    send_timer++;
-	usart_timer++;
+uint32_t timer_now32(void){
+	uint_reg_t CurrentGlobalInt = GetGlobalInterruptMask();
+	GlobalInterruptDisable();
+
+	uint16_t low = TCNT1;
+	uint16_t high = timer_overflows;
+	if ( bit_is_set(TIFR1, TOV1) && low < 0x8000 ){ // wrapped around, but the ISR has not run yet
+		high++;
+	}
+
+	SetGlobalInterruptMask(CurrentGlobalInt);
+	return ((uint32_t)high << 16) | low;
 }
 
 
@@ -548,11 +1003,11 @@ void setup_hardware(void){
     bitClear(PORTB, 1);
 #endif
 
-    // Start the global timer 
-    TCCR0A = (1 << WGM01); // CTC mode
-    TCCR0B = 1 << CS01; // clock/8 pre-scaler
-    OCR0A = 0x27;  // ticks every 20us
-	TIMSK0 |= (1 << OCIE0A);  // enable Timer Compare A interrupt
+    // Start the global timer: free-running, timeouts are checked against timestamps taken from it
+    // (the compare A interrupt is only enabled by sync_read, to time the replies of the servos)
+    TCCR1A = 0; // normal mode
+    TCCR1B = 1 << CS11; // clock/8 pre-scaler, ticks every 0.5us, wraps around every 32.768ms
+    TIMSK1 = 1 << TOIE1; // only to count the wrap arounds, for timer_now32()
 }
 
 
@@ -611,6 +1066,7 @@ void EVENT_CDC_Device_ControLineStateChanged(USB_ClassInfo_CDC_Device_t* const C
     if (PreviousDTRState && !(CurrentDTRState) ){
         // PreviousDTRState == True AND CurrentDTRState == False
         // Host application has Disconnected from the COM port
+        stream_stop(); // nobody is listening anymore
         
         if (needs_bootload){
             Jump_To_Reset(true);
@@ -46,10 +46,10 @@ Original copyright notice :
 #include <avr/interrupt.h>
 
 #include "Descriptors.h"
+#include "fifo.h"
 
 #include <LUFA/Drivers/Board/LEDs.h>
 #include <LUFA/Drivers/Peripheral/Serial.h>
-#include <LUFA/Drivers/Misc/RingBuffer.h>
 #include <LUFA/Drivers/USB/USB.h>
 #include <LUFA/Platform/Platform.h>
 
@@ -74,16 +74,68 @@ Original copyright notice :
 // Passthrough modes
 #define AX_PASSTHROUGH  0   // pass data directly from serial to USB
 #define AX_DIVERT       1   // keep data and don't pass it to USB
-
-extern bool passthrough_mode; // determines if data from the USART is passed to the USB or diverted for local processing
-extern uint8_t local_rx_buffer[];
+#define AX_STREAM       2   // pass the parameters of a servo reply directly to USB, keep the rest for local processing
+
+extern uint8_t passthrough_mode; // determines if data from the USART is passed to the USB or diverted for local processing
+
+// SRAM arena shared by the buffer to the host and the buffers of the local commands, with a layout depending on what is running:
+//   ARENA_PASSTHROUGH : [ USB buffer, 512                                                              ]
+//   ARENA_LOCAL       : [ USB buffer, 256                               ][ parser, 128 ][ servo replies, 128 ]
+//   ARENA_STREAM      : [ USB buffer, 128 ][ IDs, 32 ][ previous frame, 96 ][ parser, 128 ][ servo replies, 128 ]
+// The parser and the servo replies are at the same place in both layouts that have them, and the sizes of the USB buffer
+// are powers of two (see fifo.h). The layout only changes while the USB buffer is empty, see arena_set_layout().
+#define ARENA_SIZE              512
+#define ARENA_REPLIES_SIZE      128  // servo replies kept for local processing (AX_DIVERT, and headers in AX_STREAM)
+#define ARENA_RXBYTE_SIZE       128  // packet from the host being parsed, once it is known to be for the USB2AX
+#define ARENA_PREVIOUS_SIZE     96   // previous STREAM frame, for the delta frames
+#define ARENA_IDS_SIZE          32   // IDs of the servos read by the STREAM
+
+#define ARENA_PASSTHROUGH       0    // nothing running locally, all the room goes to the data from the servos
+#define ARENA_LOCAL             1    // a packet for the USB2AX is being parsed, or a local command is talking to the servos
+#define ARENA_STREAM            2    // a STREAM is running, with or without a local command
+
+extern uint8_t arena[ARENA_SIZE];
+#define local_rx_buffer         (arena + ARENA_SIZE - ARENA_REPLIES_SIZE)  // only usable in ARENA_LOCAL and ARENA_STREAM
+#define arena_rxbyte            (local_rx_buffer - ARENA_RXBYTE_SIZE)      // only usable in ARENA_LOCAL and ARENA_STREAM
+#define stream_previous_frame   (arena_rxbyte - ARENA_PREVIOUS_SIZE)       // only usable in ARENA_STREAM
+#define stream_ids              (stream_previous_frame - ARENA_IDS_SIZE)   // only usable in ARENA_STREAM
 extern volatile uint8_t local_rx_buffer_count;
 
-extern volatile uint8_t usart_timer; // timer for RX read timeout
+// Global timer: TIMER1, free-running
+#define TIMER_TICKS_PER_TIMEOUT_UNIT  40  // ticks of 0.5us in a unit of the timeouts below
+
+// current timestamp, to compare against later with timer_elapsed()
+// (the sync_read engine uses TIMER1 from its ISRs, which would corrupt the TEMP register used by a 16-bit read they interrupt)
+static inline uint16_t timer_now(void){
+    uint16_t now;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+        now = TCNT1;
+    }
+    return now;
+}
+
+// current timestamp on 32 bits, in ticks of 0.5us (wraps around every 35 minutes)
+uint32_t timer_now32(void);
+
+// true if more than timeout x 20us have passed since the timestamp.
+// timer_now() wraps around every 32.768ms: only for waits which check it more often than that.
+static inline bool timer_elapsed(uint16_t since, uint8_t timeout){
+    return (uint16_t)(timer_now() - since) > (uint16_t)timeout * TIMER_TICKS_PER_TIMEOUT_UNIT;
+}
+
+// same, for a timestamp from timer_now32()
+static inline bool timer_elapsed32(uint32_t since, uint8_t timeout){
+    return timer_now32() - since > (uint32_t)timeout * TIMER_TICKS_PER_TIMEOUT_UNIT;
+}
+
+#define USB_ROOM_TIMEOUT  250  //  x 20us, how long to wait for the host to take data before dropping some (see wait_USB_room)
+
 //default values, can be modified with write_data and are saved in EEPROM
 #define   USART_TIMEOUT  50   //  x 20us
 #define    SEND_TIMEOUT  4    //  x 20us
 #define RECEIVE_TIMEOUT  100  //  x 20us
+#define     SKIP_CYCLES  50   //  number of sync_read/bulk_read a servo in back-off is skipped for
+#define KEYFRAME_INTERVAL  50   //  number of STREAM frames between two full frames, in delta mode
 
 //Dynamixel device Control table
 #define MODEL_NUMBER_L      0x01
@@ -98,12 +150,23 @@ extern volatile uint8_t usart_timer; // timer for RX read timeout
 /* Function Prototypes: */
 void setup_hardware(void);
 void init_serial(long baud);
+void restore_serial_baud(void);
 void serial_write(uint8_t data);
+void serial_high_water(void);
 void setRX(void);
 void setTX(void);
 void pass_bytes(uint8_t nb_bytes);
 void process_incoming_USB_data(void);
 void cdc_send_byte(uint8_t data);
+uint16_t USB_data_room(void);
+uint16_t USB_data_size(void);
+void commit_USB_data(void);
+void discard_USB_data(void);
+void end_USB_frame(void);
+void wait_USB_room(uint16_t nb_bytes);
+uint16_t tell_USB_data(void);
+uint8_t* USB_data_at(uint16_t position, uint16_t offset);
+void arena_set_layout(uint8_t layout);
 void send_USB_data(void);
 
 void EVENT_USB_Device_Connect(void);
@@ -0,0 +1,671 @@
+/*
+ * usb2ax_bench.c
+ *
+ * Cycle counts of the USB2AX firmware under simavr, see "make bench" in ../Makefile.
+ *
+ * simavr has no atmega32u2: the ELF runs on its at90usb162, given the flash and RAM of the atmega32u2. Both have the
+ * same USB controller, USART1 and TIMER1, at the same addresses and with the same vectors.
+ *
+ * A scripted host enumerates the USB2AX through the endpoints of simavr and opens the port, and virtual servos answer
+ * on USART1 at the wire rate, SERVO_RETURN_DELAY after each instruction. At each baud rate given, the bench runs:
+ *   - passthrough: READ_DATA of PASSTHROUGH_LENGTH bytes from a servo, the reply going through the RX ISR to the host
+ *   - sync_read:   SYNC_READ of SYNC_READ_LENGTH bytes from NB_SERVOS servos
+ * and reports, for each of them:
+ *   - the cycles of each ISR (the ones nested in it excluded) and its worst latency, from its flag being set to its
+ *     vector being run
+ *   - the cycles of the main loop functions, interrupts excluded
+ *   - the cycles per byte passed to the host (RX ISR and send_USB_data()), and per sync_read
+ *
+ * A byte counts as lost when the RX ISR which reads it ends after the byte two places behind it is complete on the
+ * wire: the USART would have overrun. simavr delays the bytes instead, so once a byte is late the next ones can be too.
+ * Lost bytes, or replies which are not the ones expected, make the bench fail.
+ *
+ *   usb2ax_bench <elf> <baud>...
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <libelf.h>
+#include <gelf.h>
+
+#include "sim_avr.h"
+#include "sim_elf.h"
+#include "sim_irq.h"
+#include "sim_interrupts.h"
+#include "sim_cycle_timers.h"
+#include "avr_uart.h"
+#include "avr_usb.h"
+
+#define CORE                "at90usb162"
+#define FLASH_END           0x7FFF      // atmega32u2
+#define RAM_END             0x4FF
+#define F_CPU               16000000
+
+#define CYCLES_PER_US       (F_CPU / 1000000)
+#define CYCLES_PER_MS       (F_CPU / 1000)
+#define HOST_POLL_CYCLES    (10 * CYCLES_PER_US)    // how often the host asks for an IN packet and offers an OUT one
+#define TIMEOUT_CYCLES      (500 * CYCLES_PER_MS)
+#define BOOT_CYCLES         (20 * CYCLES_PER_MS)
+
+// endpoints, see Descriptors.h
+#define EP_CONTROL          0
+#define EP_TX               3           // CDC_TX_EPADDR
+#define EP_RX               4           // CDC_RX_EPADDR
+#define EP_CONTROL_SIZE     8
+#define EP_TX_SIZE          64
+#define EP_RX_SIZE          16
+
+// vectors of the atmega32u2, as numbered by avr-libc
+#define VECT_USB_GEN        11
+#define VECT_USB_COM        12
+#define VECT_TIMER1_COMPA   15
+#define VECT_TIMER1_OVF     18
+#define VECT_USART1_RX      23
+#define VECT_USART1_UDRE    24
+#define VECT_USART1_TX      25
+
+// USART1 registers, in data space
+#define REG_UCSR1A          0xC8
+#define REG_UBRR1L          0xCC
+#define REG_UBRR1H          0xCD
+#define BIT_U2X1            1
+
+// Dynamixel, see AX.h
+#define ID_DEVICE           0xFD
+#define INST_PING           0x01
+#define INST_READ_DATA      0x02
+#define INST_SYNC_READ      0x84
+#define STAT_USB_OVERFLOWS  30
+#define STAT_USART_OVERRUNS 32
+
+#define NB_SERVOS           16
+#define SERVO_RETURN_DELAY  (2 * CYCLES_PER_US)
+#define SERVO_PACKET_GAP    (2 * CYCLES_PER_MS)    // silence after which the servos drop a partial packet
+#define PASSTHROUGH_LENGTH  128
+#define PASSTHROUGH_RUNS    20
+#define SYNC_READ_ADDR      36
+#define SYNC_READ_LENGTH    2
+#define SYNC_READ_RUNS      20
+
+#define MAX_PACKET          (6 + 255)
+#define WIRE_RING           1024
+
+static avr_t* avr;
+
+
+static void fail(const char* format, ...){
+    va_list args;
+    va_start(args, format);
+    fprintf(stderr, "usb2ax_bench: ");
+    vfprintf(stderr, format, args);
+    fprintf(stderr, "\n");
+    va_end(args);
+    exit(2);
+}
+
+
+// ***************************** ISRs *****************************
+
+typedef struct {
+    const char*       name;
+    uint8_t           vector;
+    bool              pending;
+    avr_cycle_count_t pending_at;
+    uint32_t          runs;
+    uint64_t          total;            // cycles from the vector to RETI, the ISRs nested in it excluded
+    uint32_t          max;
+    uint32_t          max_latency;
+} isr_t;
+
+static isr_t isrs[] = {
+    { "USART1_RX_vect",     VECT_USART1_RX },
+    { "USART1_UDRE_vect",   VECT_USART1_UDRE },
+    { "USART1_TX_vect",     VECT_USART1_TX },
+    { "TIMER1_COMPA_vect",  VECT_TIMER1_COMPA },
+    { "TIMER1_OVF_vect",    VECT_TIMER1_OVF },
+    { "USB_GEN_vect",       VECT_USB_GEN },
+    { "USB_COM_vect",       VECT_USB_COM },
+};
+#define ISR_RX              (&isrs[0])
+#define ISR_COMPA           (&isrs[3])
+#define NB_ISRS             (sizeof(isrs) / sizeof(isrs[0]))
+
+typedef struct {
+    isr_t*            isr;
+    avr_cycle_count_t start;
+    avr_cycle_count_t nested;           // cycles of the ISRs which interrupted it
+} isr_frame_t;
+
+static isr_frame_t       isr_stack[16];
+static uint8_t           isr_depth;
+static avr_cycle_count_t isr_cycles;    // spent in ISRs since the start, see probe_t
+
+static void rx_isr_done(void);
+
+static void isr_pending(struct avr_irq_t* irq, uint32_t value, void* param){
+    isr_t* isr = param;
+    if (value && ! isr->pending){
+        isr->pending_at = avr->cycle;
+    }
+    isr->pending = value;
+}
+
+static void isr_running(struct avr_irq_t* irq, uint32_t value, void* param){
+    isr_t* isr = param;
+    if (value){
+        uint32_t latency = avr->cycle - isr->pending_at;
+        if (latency > isr->max_latency){
+            isr->max_latency = latency;
+        }
+        if (isr_depth == sizeof(isr_stack) / sizeof(isr_stack[0])){
+            fail("ISRs nested too deep");
+        }
+        isr_stack[isr_depth++] = (isr_frame_t){ isr, avr->cycle, 0 };
+        return;
+    }
+    if (isr_depth == 0){
+        return;
+    }
+    isr_frame_t frame = isr_stack[--isr_depth];
+    avr_cycle_count_t cycles = avr->cycle - frame.start;
+    uint32_t own = cycles - frame.nested;
+    frame.isr->runs++;
+    frame.isr->total += own;
+    if (own > frame.isr->max){
+        frame.isr->max = own;
+    }
+    if (isr_depth){
+        isr_stack[isr_depth - 1].nested += cycles;
+    } else {
+        isr_cycles += cycles;
+    }
+    if (frame.isr == ISR_RX){
+        rx_isr_done();
+    }
+}
+
+static void isr_hook(void){
+    for (uint8_t i = 0; i < NB_ISRS; i++){
+        avr_irq_t* irq = avr_get_interrupt_irq(avr, isrs[i].vector);
+        if ( ! irq ){
+            fail("no vector %u in the %s core", isrs[i].vector, CORE);
+        }
+        avr_irq_register_notify(irq + AVR_INT_IRQ_PENDING, isr_pending, &isrs[i]);
+        avr_irq_register_notify(irq + AVR_INT_IRQ_RUNNING, isr_running, &isrs[i]);
+    }
+}
+
+
+// ***************************** main loop functions *****************************
+
+// a function is running from its first instruction until the stack pointer goes above where it was then (its RET)
+typedef struct {
+    const char*       name;
+    uint32_t          addr;             // 0 if it is not in the ELF (inlined)
+    bool              active;
+    uint16_t          sp;
+    avr_cycle_count_t start;
+    avr_cycle_count_t isr_start;
+    uint32_t          calls;
+    uint64_t          total;            // cycles, interrupts excluded
+    uint32_t          max;
+} probe_t;
+
+static probe_t probes[] = {
+    { "process_incoming_USB_data" },
+    { "sync_read_task" },
+    { "send_USB_data" },
+};
+#define PROBE_SEND_USB      (&probes[2])
+#define NB_PROBES           (sizeof(probes) / sizeof(probes[0]))
+
+static void probe_find(const char* elf_path){
+    elf_version(EV_CURRENT);
+    int fd = open(elf_path, O_RDONLY);
+    Elf* elf = fd < 0 ? NULL : elf_begin(fd, ELF_C_READ, NULL);
+    if ( ! elf ){
+        fail("can't read %s", elf_path);
+    }
+    Elf_Scn* scn = NULL;
+    while ((scn = elf_nextscn(elf, scn))){
+        GElf_Shdr shdr;
+        gelf_getshdr(scn, &shdr);
+        if (shdr.sh_type != SHT_SYMTAB){
+            continue;
+        }
+        Elf_Data* data = elf_getdata(scn, NULL);
+        for (size_t s = 0; s < shdr.sh_size / shdr.sh_entsize; s++){
+            GElf_Sym sym;
+            gelf_getsym(data, s, &sym);
+            const char* name = elf_strptr(elf, shdr.sh_link, sym.st_name);
+            for (uint8_t i = 0; name && i < NB_PROBES; i++){
+                if (GELF_ST_TYPE(sym.st_info) == STT_FUNC && strcmp(name, probes[i].name) == 0){
+                    probes[i].addr = sym.st_value;
+                }
+            }
+        }
+    }
+    elf_end(elf);
+    close(fd);
+}
+
+static uint16_t get_sp(void){
+    return avr->data[R_SPL] | (avr->data[R_SPH] << 8);
+}
+
+static void probe_before(void){
+    for (uint8_t i = 0; i < NB_PROBES; i++){
+        probe_t* probe = &probes[i];
+        if ( ! probe->active && probe->addr && avr->pc == probe->addr ){
+            probe->active = true;
+            probe->sp = get_sp();
+            probe->start = avr->cycle;
+            probe->isr_start = isr_cycles;
+        }
+    }
+}
+
+static void probe_after(void){
+    for (uint8_t i = 0; i < NB_PROBES; i++){
+        probe_t* probe = &probes[i];
+        if (probe->active && get_sp() > probe->sp){
+            probe->active = false;
+            uint32_t cycles = (avr->cycle - probe->start) - (isr_cycles - probe->isr_start);
+            probe->calls++;
+            probe->total += cycles;
+            if (cycles > probe->max){
+                probe->max = cycles;
+            }
+        }
+    }
+}
+
+
+// ***************************** servos *****************************
+
+static avr_irq_t*        uart_input;
+static uint32_t          byte_cycles;   // of USART1, as the firmware set it
+static uint8_t           servo_packet[MAX_PACKET];
+static uint16_t          servo_packet_size;
+static avr_cycle_count_t servo_last_byte_at;
+static uint8_t           servo_reply[MAX_PACKET];
+static uint16_t          servo_reply_size;
+static uint16_t          servo_reply_sent;
+
+static avr_cycle_count_t wire_done[WIRE_RING]; // when each byte sent to the USB2AX is complete on the wire
+static uint32_t          nb_sent_to_usb2ax;
+static uint32_t          nb_read_by_usb2ax;
+static uint32_t          nb_lost;
+
+static uint8_t servo_table(uint8_t id, uint8_t addr){
+    return id + addr;
+}
+
+static uint16_t packet1(uint8_t* packet, uint8_t id, uint8_t instruction, const uint8_t* params, uint8_t nb_params){
+    uint8_t sum = id + nb_params + 2 + instruction;
+    packet[0] = 0xFF;
+    packet[1] = 0xFF;
+    packet[2] = id;
+    packet[3] = nb_params + 2;
+    packet[4] = instruction;
+    for (uint8_t i = 0; i < nb_params; i++){
+        packet[5 + i] = params[i];
+        sum += params[i];
+    }
+    packet[5 + nb_params] = ~sum;
+    return 6 + nb_params;
+}
+
+static avr_cycle_count_t servo_send_byte(struct avr_t* core, avr_cycle_count_t when, void* param){
+    wire_done[nb_sent_to_usb2ax++ % WIRE_RING] = when + byte_cycles;
+    avr_raise_irq(uart_input, servo_reply[servo_reply_sent++]);
+    return servo_reply_sent < servo_reply_size ? when + byte_cycles : 0;
+}
+
+static void servo_execute(const uint8_t* p){
+    uint8_t id = p[2];
+    uint8_t nb_params = p[3] - 2;
+    uint8_t sum = 0;
+    for (uint16_t i = 2; i < 5 + nb_params; i++){
+        sum += p[i];
+    }
+    if (id < 1 || id > NB_SERVOS || (uint8_t)(sum + p[5 + nb_params]) != 0xFF){
+        return;
+    }
+    uint8_t data[256];
+    uint8_t nb_bytes = 0;
+    if (p[4] == INST_READ_DATA && nb_params == 2){
+        nb_bytes = p[6];
+        for (uint16_t i = 0; i < nb_bytes; i++){
+            data[i] = servo_table(id, p[5] + i);
+        }
+    } else if (p[4] != INST_PING){
+        return;
+    }
+    servo_reply_size = packet1(servo_reply, id, 0, data, nb_bytes);
+    servo_reply_sent = 0;
+    // the last byte of the instruction is complete one byte time after the firmware wrote it
+    avr_cycle_timer_register(avr, byte_cycles + SERVO_RETURN_DELAY, servo_send_byte, NULL);
+}
+
+// a byte the firmware sent on the bus
+static void servo_receive(struct avr_irq_t* irq, uint32_t value, void* param){
+    if (servo_packet_size && avr->cycle - servo_last_byte_at > SERVO_PACKET_GAP){
+        servo_packet_size = 0;
+    }
+    servo_last_byte_at = avr->cycle;
+    servo_packet[servo_packet_size++] = value;
+    // look for a header further on after garbage
+    while ( servo_packet_size && ( servo_packet[0] != 0xFF || (servo_packet_size >= 2 && servo_packet[1] != 0xFF)
+            || (servo_packet_size >= 3 && servo_packet[2] == 0xFF) || (servo_packet_size >= 4 && servo_packet[3] < 2) ) ){
+        memmove(servo_packet, servo_packet + 1, --servo_packet_size);
+    }
+    if (servo_packet_size >= 4 && servo_packet_size == 4 + servo_packet[3]){
+        servo_execute(servo_packet);
+        servo_packet_size = 0;
+    }
+}
+
+static void rx_isr_done(void){
+    uint32_t byte = nb_read_by_usb2ax++;
+    if (byte + 2 < nb_sent_to_usb2ax && avr->cycle > wire_done[(byte + 2) % WIRE_RING]){
+        nb_lost++;
+    }
+}
+
+static void servo_hook(void){
+    uint32_t flags = 0;
+    avr_ioctl(avr, AVR_IOCTL_UART_GET_FLAGS('1'), &flags);
+    flags &= ~AVR_UART_FLAG_STDIO;
+    avr_ioctl(avr, AVR_IOCTL_UART_SET_FLAGS('1'), &flags);
+    uart_input = avr_io_getirq(avr, AVR_IOCTL_UART_GETIRQ('1'), UART_IRQ_INPUT);
+    avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_UART_GETIRQ('1'), UART_IRQ_OUTPUT), servo_receive, NULL);
+}
+
+
+// ***************************** host *****************************
+
+static bool              host_configured;
+static avr_cycle_count_t host_next_poll;
+static uint8_t           host_in[4096];
+static uint16_t          host_in_count;
+static uint8_t           host_out[1024];
+static uint16_t          host_out_head, host_out_tail;
+
+static void host_poll(void);
+
+static void run(avr_cycle_count_t cycles){
+    avr_cycle_count_t end = avr->cycle + cycles;
+    while (avr->cycle < end){
+        probe_before();
+        int state = avr_run(avr);
+        if (state == cpu_Done || state == cpu_Crashed){
+            fail("the firmware stopped at 0x%04x", avr->pc);
+        }
+        probe_after();
+        host_poll();
+    }
+}
+
+static void host_poll(void){
+    if ( ! host_configured || avr->cycle < host_next_poll ){
+        return;
+    }
+    host_next_poll = avr->cycle + HOST_POLL_CYCLES;
+    uint8_t data[EP_TX_SIZE];
+    struct avr_io_usb in = { EP_TX, sizeof(data), data };
+    if (avr_ioctl(avr, AVR_IOCTL_USB_READ, &in) == 0 && in.sz){
+        if (host_in_count + in.sz > sizeof(host_in)){
+            fail("the host got more than %u bytes", (unsigned)sizeof(host_in));
+        }
+        memcpy(host_in + host_in_count, data, in.sz);
+        host_in_count += in.sz;
+    }
+    if (host_out_tail != host_out_head){
+        uint16_t nb_bytes = host_out_head - host_out_tail;
+        struct avr_io_usb out = { EP_RX, nb_bytes < EP_RX_SIZE ? nb_bytes : EP_RX_SIZE, host_out + host_out_tail };
+        if (avr_ioctl(avr, AVR_IOCTL_USB_WRITE, &out) == 0){
+            host_out_tail += out.sz;
+        }
+    }
+}
+
+static void usb_retry(uint32_t ioctl, struct avr_io_usb* io, const char* what){
+    struct avr_io_usb request = *io;
+    avr_cycle_count_t start = avr->cycle;
+    for (;;){
+        int ret = avr_ioctl(avr, ioctl, io);
+        if (ret == 0){
+            return;
+        }
+        if (ret != AVR_IOCTL_USB_NAK || avr->cycle - start > TIMEOUT_CYCLES){
+            fail("USB %s failed (%d)", what, ret);
+        }
+        *io = request;
+        run(HOST_POLL_CYCLES);
+    }
+}
+
+// control transfer without data, or with data from the host
+static void control(uint8_t type, uint8_t request, uint16_t value, uint16_t index, uint8_t* data, uint16_t length){
+    uint8_t setup[8] = { type, request, value, value >> 8, index, index >> 8, length, length >> 8 };
+    struct avr_io_usb io = { EP_CONTROL, sizeof(setup), setup };
+    avr_ioctl(avr, AVR_IOCTL_USB_SETUP, &io);
+    for (uint16_t done = 0; done < length; done += io.sz){
+        io = (struct avr_io_usb){ EP_CONTROL, length - done < EP_CONTROL_SIZE ? length - done : EP_CONTROL_SIZE, data + done };
+        usb_retry(AVR_IOCTL_USB_WRITE, &io, "control OUT");
+    }
+    uint8_t status[EP_CONTROL_SIZE];
+    io = (struct avr_io_usb){ EP_CONTROL, 0, status };
+    usb_retry(AVR_IOCTL_USB_READ, &io, "control status");
+}
+
+static void host_open_port(uint32_t baud){
+    uint8_t line_coding[7] = { baud, baud >> 8, baud >> 16, baud >> 24, 0, 0, 8 }; // 8N1
+    control(0x21, 0x20, 0, 0, line_coding, sizeof(line_coding)); // SET_LINE_CODING
+    control(0x21, 0x22, 0x0001, 0, NULL, 0);                      // SET_CONTROL_LINE_STATE, DTR
+    run(CYCLES_PER_MS);
+    uint16_t ubrr = avr->data[REG_UBRR1L] | (avr->data[REG_UBRR1H] << 8);
+    byte_cycles = 10 * ((avr->data[REG_UCSR1A] & (1 << BIT_U2X1)) ? 8 : 16) * (ubrr + 1);
+}
+
+static void host_enumerate(void){
+    run(BOOT_CYCLES);
+    avr_ioctl(avr, AVR_IOCTL_USB_RESET, NULL);
+    run(CYCLES_PER_MS);
+    control(0x00, 0x05, 1, 0, NULL, 0); // SET_ADDRESS
+    control(0x00, 0x09, 1, 0, NULL, 0); // SET_CONFIGURATION
+    host_configured = true;
+    run(CYCLES_PER_MS);
+}
+
+static void host_send(const uint8_t* data, uint16_t nb_bytes){
+    if (host_out_head + nb_bytes > sizeof(host_out)){
+        memmove(host_out, host_out + host_out_tail, host_out_head - host_out_tail);
+        host_out_head -= host_out_tail;
+        host_out_tail = 0;
+    }
+    memcpy(host_out + host_out_head, data, nb_bytes);
+    host_out_head += nb_bytes;
+}
+
+// run until the host has that many bytes, false if they don't come
+static bool host_wait(uint16_t nb_bytes){
+    avr_cycle_count_t start = avr->cycle;
+    while (host_in_count < nb_bytes){
+        if (avr->cycle - start > TIMEOUT_CYCLES){
+            return false;
+        }
+        run(HOST_POLL_CYCLES);
+    }
+    return true;
+}
+
+// send a packet and check the reply, false if it is not the one expected
+static bool host_exchange(const uint8_t* packet, uint16_t size, const uint8_t* expected, uint16_t expected_size){
+    host_in_count = 0;
+    host_send(packet, size);
+    bool ok = host_wait(expected_size);
+    run(HOST_POLL_CYCLES * 4); // anything more would be wrong
+    return ok && host_in_count == expected_size && memcmp(host_in, expected, expected_size) == 0;
+}
+
+
+// ***************************** scenarios *****************************
+
+static void measures_reset(void){
+    for (uint8_t i = 0; i < NB_ISRS; i++){
+        isrs[i].runs = isrs[i].total = isrs[i].max = isrs[i].max_latency = 0;
+    }
+    for (uint8_t i = 0; i < NB_PROBES; i++){
+        probes[i].calls = probes[i].total = probes[i].max = 0;
+    }
+    nb_lost = 0;
+}
+
+static void measures_report(void){
+    printf("    %-28s %8s %8s %8s %12s\n", "ISR", "runs", "avg", "max", "max latency");
+    for (uint8_t i = 0; i < NB_ISRS; i++){
+        isr_t* isr = &isrs[i];
+        if (isr->runs){
+            printf("    %-28s %8u %8.1f %8u %12u\n", isr->name, isr->runs, (double)isr->total / isr->runs, isr->max, isr->max_latency);
+        }
+    }
+    printf("    %-28s %8s %8s %8s\n", "function", "calls", "avg", "max");
+    for (uint8_t i = 0; i < NB_PROBES; i++){
+        probe_t* probe = &probes[i];
+        if (probe->calls){
+            printf("    %-28s %8u %8.1f %8u\n", probe->name, probe->calls, (double)probe->total / probe->calls, probe->max);
+        }
+    }
+}
+
+static uint32_t bench_passthrough(void){
+    uint32_t nb_errors = 0;
+    uint8_t params[] = { 0, PASSTHROUGH_LENGTH };
+    uint8_t packet[MAX_PACKET], expected[MAX_PACKET], data[PASSTHROUGH_LENGTH];
+    uint16_t size = packet1(packet, 1, INST_READ_DATA, params, sizeof(params));
+    for (uint16_t i = 0; i < PASSTHROUGH_LENGTH; i++){
+        data[i] = servo_table(1, i);
+    }
+    uint16_t expected_size = packet1(expected, 1, 0, data, PASSTHROUGH_LENGTH);
+
+    measures_reset();
+    uint32_t first = nb_read_by_usb2ax;
+    for (uint8_t r = 0; r < PASSTHROUGH_RUNS; r++){
+        nb_errors += ! host_exchange(packet, size, expected, expected_size);
+    }
+    uint32_t nb_bytes = nb_read_by_usb2ax - first;
+    double per_byte = nb_bytes ? (double)(ISR_RX->total + PROBE_SEND_USB->total) / nb_bytes : 0;
+    printf("  passthrough, READ_DATA of %u bytes x %u: %u bytes from the bus, %u lost, %u wrong replies\n",
+           PASSTHROUGH_LENGTH, PASSTHROUGH_RUNS, nb_bytes, nb_lost, nb_errors);
+    printf("    cycles per byte %.1f (RX ISR and send_USB_data), %u between two bytes on the wire\n", per_byte, byte_cycles);
+    measures_report();
+    return nb_errors + nb_lost;
+}
+
+static uint32_t bench_sync_read(void){
+    uint32_t nb_errors = 0;
+    uint8_t params[2 + NB_SERVOS] = { SYNC_READ_ADDR, SYNC_READ_LENGTH };
+    uint8_t data[NB_SERVOS * SYNC_READ_LENGTH];
+    for (uint8_t s = 0; s < NB_SERVOS; s++){
+        params[2 + s] = 1 + s;
+        for (uint8_t i = 0; i < SYNC_READ_LENGTH; i++){
+            data[s * SYNC_READ_LENGTH + i] = servo_table(1 + s, SYNC_READ_ADDR + i);
+        }
+    }
+    uint8_t packet[MAX_PACKET], expected[MAX_PACKET];
+    uint16_t size = packet1(packet, ID_DEVICE, INST_SYNC_READ, params, sizeof(params));
+    uint16_t expected_size = packet1(expected, ID_DEVICE, 0, data, sizeof(data));
+
+    measures_reset();
+    avr_cycle_count_t total = 0, max = 0;
+    for (uint8_t r = 0; r < SYNC_READ_RUNS; r++){
+        avr_cycle_count_t start = avr->cycle;
+        host_in_count = 0;
+        host_send(packet, size);
+        if ( ! host_wait(expected_size) || memcmp(host_in, expected, expected_size) != 0 ){
+            nb_errors++;
+        }
+        avr_cycle_count_t cycles = avr->cycle - start;
+        total += cycles;
+        if (cycles > max){
+            max = cycles;
+        }
+        run(HOST_POLL_CYCLES * 4);
+        nb_errors += host_in_count != expected_size;
+    }
+    uint32_t bus = NB_SERVOS * ((8 + 6 + SYNC_READ_LENGTH) * byte_cycles + SERVO_RETURN_DELAY);
+    printf("  sync_read of %u bytes from %u servos x %u: %u lost, %u wrong replies\n",
+           SYNC_READ_LENGTH, NB_SERVOS, SYNC_READ_RUNS, nb_lost, nb_errors);
+    printf("    cycles per sync_read %.0f (max %llu), %.0f per servo, of which %u on the bus\n",
+           (double)total / SYNC_READ_RUNS, (unsigned long long)max, (double)total / SYNC_READ_RUNS / NB_SERVOS, bus / NB_SERVOS);
+    printf("    TIMER1_COMPA_vect per servo %.1f\n", ISR_COMPA->runs ? (double)ISR_COMPA->total / ISR_COMPA->runs : 0);
+    measures_report();
+    return nb_errors + nb_lost;
+}
+
+// bytes the firmware itself counted as lost since last time
+static uint32_t firmware_losses(void){
+    static uint32_t counted = 0;
+    uint8_t params[] = { STAT_USB_OVERFLOWS, 4 };
+    uint8_t packet[16];
+    host_in_count = 0;
+    host_send(packet, packet1(packet, ID_DEVICE, INST_READ_DATA, params, sizeof(params)));
+    if ( ! host_wait(10) ){
+        fail("no reply from the USB2AX");
+    }
+    uint16_t usb_overflows = host_in[5] | (host_in[6] << 8);
+    uint16_t usart_overruns = host_in[7] | (host_in[8] << 8);
+    printf("  firmware statistics since the start: %u USB overflows, %u USART overruns\n", usb_overflows, usart_overruns);
+    uint32_t lost = usb_overflows + usart_overruns - counted;
+    counted = usb_overflows + usart_overruns;
+    return lost;
+}
+
+
+int main(int argc, char** argv){
+    if (argc < 3){
+        fprintf(stderr, "usage: usb2ax_bench <elf> <baud>...\n");
+        return 2;
+    }
+    elf_firmware_t firmware;
+    memset(&firmware, 0, sizeof(firmware));
+    if (elf_read_firmware(argv[1], &firmware) != 0){
+        fail("can't load %s", argv[1]);
+    }
+    avr = avr_make_mcu_by_name(CORE);
+    if ( ! avr ){
+        fail("simavr has no %s core", CORE);
+    }
+    avr->flashend = FLASH_END;
+    avr->ramend = RAM_END;
+    avr_init(avr);
+    avr_load_firmware(avr, &firmware);
+    avr->frequency = F_CPU;
+    avr->log = LOG_WARNING;
+
+    probe_find(argv[1]);
+    isr_hook();
+    servo_hook();
+    host_enumerate();
+
+    uint32_t nb_failures = 0;
+    for (int i = 2; i < argc; i++){
+        uint32_t baud = strtoul(argv[i], NULL, 0);
+        host_open_port(baud);
+        printf("%u bps: USART1 at %u bps, %u cycles per byte\n", baud, F_CPU * 10 / byte_cycles, byte_cycles);
+        nb_failures += bench_passthrough();
+        nb_failures += bench_sync_read();
+        nb_failures += firmware_losses();
+        printf("\n");
+    }
+    printf(nb_failures ? "FAILED\n" : "OK\n");
+    return nb_failures ? 1 : 0;
+}
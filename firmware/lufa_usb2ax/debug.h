@@ -9,7 +9,7 @@
 #ifndef DEBUG_H_
 #define DEBUG_H_
 
-#define USE_DEBUG_PINS (1)
+#define USE_DEBUG_PINS (0)
 
 #if(USE_DEBUG_PINS)
 
@@ -44,5 +44,22 @@
 #endif
 
 
+// Profiler: each probe records how many timer ticks (0.5us, 8 cycles) a hot path took, see ADDR_PROFILER.
+// The durations include the interrupts which ran meanwhile. Read them with usb2ax_profile.py.
+#define USE_PROFILER (0)
+
+#if(USE_PROFILER)
+
+    #define prof_begin(probe)   uint16_t probe##_start = timer_now()
+    #define prof_end(probe)     prof_add(probe, timer_now() - probe##_start)
+
+#else
+
+    #define prof_begin(probe)
+    #define prof_end(probe)
+
+#endif
+
+
 
 #endif /* DEBUG_H_ */
\ No newline at end of file
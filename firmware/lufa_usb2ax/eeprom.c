@@ -10,10 +10,12 @@
 
  
 #define EE_ADDR_MAGIC_KEY           0x0
-#define EE_MAGIC_KEY                0x101BEEF
+#define EE_MAGIC_KEY                0x102BEEF  // to change whenever the saved registers change, so that older images are not loaded
 #define EE_ADDR(x)                  ((void*)( EE_ADDR_MAGIC_KEY + sizeof(EE_MAGIC_KEY) + x ))
 #define ADDR_START_EE_SAVE          START_RW_ADDR
-#define NB_EE_SAVED_BYTES           (REG_TABLE_SIZE - ADDR_START_EE_SAVE)
+#define NB_EE_SAVED_BYTES           (ADDR_STATS - ADDR_START_EE_SAVE)  // the statistics are not saved
+#define EE_ADDR_GROUPS              0x40  // leaves room for the registers to grow
+#define EE_ADDR_GROUP(x)            ((void*)( EE_ADDR_GROUPS + (x) * AX_GROUP_SIZE ))
 
 uint8_t eeprom_init(){
     eeprom_busy_wait();
@@ -35,4 +37,17 @@ void eeprom_save(){
 
 void eeprom_clear(){
     eeprom_update_dword(EE_ADDR_MAGIC_KEY, 0x0000000);
+    for (uint8_t group = 0; group < AX_GROUPS; group++){
+        eeprom_update_byte(EE_ADDR_GROUP(group), 0);
+    }
+}
+
+// groups (see group_set): the first byte of a record is its number of IDs, 0 (or 0xFF, erased) if the group is not defined
+uint8_t eeprom_load_group(uint8_t group, uint8_t* record){
+    eeprom_read_block(record, EE_ADDR_GROUP(group), AX_GROUP_SIZE);
+    return record[0] != 0 && record[0] <= AX_GROUP_MAX_IDS;
+}
+
+void eeprom_save_group(uint8_t group, uint8_t* record){
+    eeprom_update_block(record, EE_ADDR_GROUP(group), AX_GROUP_SIZE);
 }
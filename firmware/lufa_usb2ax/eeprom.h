@@ -14,5 +14,7 @@ uint8_t eeprom_init();
 uint8_t eeprom_load();
 void eeprom_save();
 void eeprom_clear();
+uint8_t eeprom_load_group(uint8_t group, uint8_t* record);
+void eeprom_save_group(uint8_t group, uint8_t* record);
 
 #endif /* EEPROM_H_ */
\ No newline at end of file
@@ -0,0 +1,164 @@
+/*
+ * fifo.h
+ *
+ * Lock-free single-producer/single-consumer ring buffer.
+ *
+ * The storage size must be a power of two, up to 32KB. The read and write positions are free-running counters
+ * which wrap around at twice the size: their difference is the number of bytes waiting, so the whole storage can
+ * be used, and the byte at a position is found with a mask instead of a comparison.
+ * There is only one producer (writing head) and one consumer (writing tail), typically one of them is an ISR
+ * and the other one is the main loop.
+ * The positions are 16-bit, and the AVR reads and writes them one byte at a time. With a storage of 128 bytes or
+ * less, they never go over 255: they can't be seen half-written, and neither side ever masks the interrupts.
+ * Above that, the consumer masks the interrupts around its accesses to the positions (once per call, not per byte),
+ * and the producer must not be interruptible by the consumer: it has to be an ISR, or to run with interrupts masked.
+ * The producer can also stage bytes, which the consumer only sees once they are committed.
+ */
+
+
+#ifndef FIFO_H_
+#define FIFO_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <util/atomic.h>
+#include <LUFA/Common/Common.h>
+
+#define FIFO_LOCK_FREE_SIZE     128     // largest storage whose positions fit in a byte
+
+typedef struct {
+    uint8_t* data;          // underlying storage
+    uint16_t size;          // size of the storage, a power of two
+    uint16_t wrap;          // 2 x size - 1, the positions are kept below twice the size
+    volatile uint16_t head; // write position, only modified by the producer
+    volatile uint16_t tail; // read position, only modified by the consumer
+    uint16_t staged;        // number of bytes added after head but not committed yet, only used by the producer
+} fifo_t;
+
+
+static inline void fifo_init(fifo_t* fifo, uint8_t* data, uint16_t size){
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+        fifo->data = data;
+        fifo->size = size;
+        fifo->wrap = 2 * size - 1;
+        fifo->head = 0;
+        fifo->tail = 0;
+        fifo->staged = 0;
+    }
+}
+
+// number of bytes waiting in the buffer, can be called from either side
+static inline uint16_t fifo_count(fifo_t* fifo){
+    uint16_t head, tail;
+    if (fifo->size <= FIFO_LOCK_FREE_SIZE){
+        head = fifo->head;
+        tail = fifo->tail;
+    } else {
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+            head = fifo->head;
+            tail = fifo->tail;
+        }
+    }
+    return (head - tail) & fifo->wrap;
+}
+
+// number of bytes which can still be added, can be called from either side
+static inline uint16_t fifo_room(fifo_t* fifo){
+    return fifo->size - fifo_count(fifo);
+}
+
+static inline bool fifo_is_full(fifo_t* fifo){
+    return fifo_room(fifo) == 0;
+}
+
+// consumer side: set the read position
+static inline void fifo_set_tail(fifo_t* fifo, uint16_t tail){
+    GCC_MEMORY_BARRIER(); // the bytes must be read before the producer can overwrite them
+    if (fifo->size <= FIFO_LOCK_FREE_SIZE){
+        fifo->tail = tail;
+    } else {
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+            fifo->tail = tail;
+        }
+    }
+}
+
+// producer side: add a byte, return false (and drop it) if the buffer is full
+static inline bool fifo_push(fifo_t* fifo, uint8_t data){
+    uint16_t head = fifo->head;
+    if ( ((head - fifo->tail) & fifo->wrap) == fifo->size ){
+        return false;
+    }
+    fifo->data[head & (fifo->size - 1)] = data;
+    GCC_MEMORY_BARRIER(); // the byte must be stored before the consumer can see it
+    fifo->head = (head + 1) & fifo->wrap;
+    return true;
+}
+
+// producer side: add a byte that the consumer won't see until fifo_commit(), return false (and drop it) if the buffer is full.
+// The staged bytes must be committed or discarded before anything is added with fifo_push().
+static inline bool fifo_stage(fifo_t* fifo, uint8_t data){
+    uint16_t position = fifo->head + fifo->staged;
+    if ( ((position - fifo->tail) & fifo->wrap) == fifo->size ){
+        return false;
+    }
+    fifo->data[position & (fifo->size - 1)] = data;
+    fifo->staged++;
+    return true;
+}
+
+// producer side: make the staged bytes available to the consumer
+static inline void fifo_commit(fifo_t* fifo){
+    GCC_MEMORY_BARRIER(); // the bytes must be stored before the consumer can see them
+    fifo->head = (fifo->head + fifo->staged) & fifo->wrap;
+    fifo->staged = 0;
+}
+
+// producer side: drop the staged bytes
+static inline void fifo_discard(fifo_t* fifo){
+    fifo->staged = 0;
+}
+
+// producer side: position of the next byte to be added, to get back to it later with fifo_at()
+static inline uint16_t fifo_tell(fifo_t* fifo){
+    return fifo->head;
+}
+
+// producer side: byte offset bytes after a position given by fifo_tell(), as long as the consumer has not read it yet
+static inline uint8_t* fifo_at(fifo_t* fifo, uint16_t position, uint16_t offset){
+    return fifo->data + ((position + offset) & (fifo->size - 1));
+}
+
+// consumer side: drop nb_bytes, after they have been read through fifo_contiguous()
+static inline void fifo_skip(fifo_t* fifo, uint16_t nb_bytes){
+    fifo_set_tail(fifo, (fifo->tail + nb_bytes) & fifo->wrap);
+}
+
+// consumer side: remove a byte, the buffer must not be empty
+static inline uint8_t fifo_pop(fifo_t* fifo){
+    uint8_t data = fifo->data[fifo->tail & (fifo->size - 1)];
+    fifo_skip(fifo, 1);
+    return data;
+}
+
+// consumer side: point to the oldest byte, return how many bytes can be read from there without wrapping around
+static inline uint16_t fifo_contiguous(fifo_t* fifo, uint8_t** data){
+    uint16_t index = fifo->tail & (fifo->size - 1);
+    uint16_t to_end = fifo->size - index;
+    uint16_t count = fifo_count(fifo);
+    *data = fifo->data + index;
+    return (count < to_end) ? count : to_end;
+}
+
+// consumer side: drop everything
+static inline void fifo_flush(fifo_t* fifo){
+    if (fifo->size <= FIFO_LOCK_FREE_SIZE){
+        fifo->tail = fifo->head;
+    } else {
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+            fifo->tail = fifo->head;
+        }
+    }
+}
+
+#endif /* FIFO_H_ */
@@ -0,0 +1,154 @@
+/*
+ * bench_usb2ax.c
+ *
+ * Per-transaction figures of the firmware on the host model (see sim.h): for each kind of request the host makes,
+ * the bytes it takes on USB and on the bus, and the time from the request being sent to the last byte of its reply
+ * reaching the host, against the time the bus alone needs for those bytes.
+ *
+ * The time is the virtual time of the model, where each access to a register or to an endpoint takes one tick of
+ * TIMER1 (0.5us, 8 cycles at 16MHz): the cycles given are that time at 16MHz, not the cycles the AVR would spend.
+ * They are meant to compare two versions of the firmware; for the real ones, see ../bench (simavr).
+ *
+ *   bench_usb2ax [runs]    each transaction that many times (20 by default)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sim.h"
+#include "../AX.h"
+#include "../AX2.h"
+
+#define REPLY_TICKS     (20 * SIM_TICKS_PER_MS)     // longest wait for the reply of a transaction
+#define CYCLES_PER_TICK (16 / SIM_TICKS_PER_US)
+#define BENCH_SERVOS    16
+
+static uint8_t packet[DXL_MAX_PACKET + 16];
+static dxl_status_t status;
+
+typedef struct {
+    const char* name;
+    uint8_t     protocol;       // of the reply
+    uint16_t    (*build)(uint8_t* packet);
+} transaction_t;
+
+
+// ***************************** transactions *****************************
+
+static uint16_t build_ping(uint8_t* p){
+    return dxl_packet1(p, AX_ID_DEVICE, AX_CMD_PING, NULL, 0);
+}
+
+static uint16_t build_local_read(uint8_t* p){
+    uint8_t params[] = { 0, ADDR_STATS };
+    return dxl_packet1(p, AX_ID_DEVICE, AX_CMD_READ_DATA, params, sizeof(params));
+}
+
+static uint16_t build_passthrough_read(uint8_t* p){
+    uint8_t params[] = { 0, 128 };
+    return dxl_packet1(p, 1, AX_CMD_READ_DATA, params, sizeof(params));
+}
+
+static uint16_t build_sync_read(uint8_t* p){
+    uint8_t params[2 + BENCH_SERVOS] = { 36, 2 };
+    for (uint8_t i = 0; i < BENCH_SERVOS; i++){
+        params[2 + i] = 1 + i;
+    }
+    return dxl_packet1(p, AX_ID_DEVICE, AX_CMD_SYNC_READ, params, sizeof(params));
+}
+
+static uint16_t build_bulk_read(uint8_t* p){
+    uint8_t params[3 * 4];
+    for (uint8_t i = 0; i < 4; i++){
+        params[3 * i] = 1 + i;
+        params[3 * i + 1] = 30 + i;
+        params[3 * i + 2] = 4 + i;
+    }
+    return dxl_packet1(p, AX_ID_DEVICE, AX_CMD_BULK_READ, params, sizeof(params));
+}
+
+static uint16_t build_write_read(uint8_t* p){
+    uint8_t params[] = { 2, 30, 2, 1, 0x10, 0x11, 2, 0x20, 0x21, 36, 2, 1, 2 };
+    return dxl_packet1(p, AX_ID_DEVICE, AX_CMD_WRITE_READ, params, sizeof(params));
+}
+
+static uint16_t build_sync_read2(uint8_t* p){
+    uint8_t params[4 + 8] = { 36, 0, 4, 0 };
+    for (uint8_t i = 0; i < 8; i++){
+        params[4 + i] = BENCH_SERVOS + 1 + i;
+    }
+    return dxl_packet2(p, AX_ID_DEVICE, AX2_CMD_SYNC_READ, params, sizeof(params));
+}
+
+static const transaction_t transactions[] = {
+    { "ping",                   1, build_ping },
+    { "local read 18 bytes",    1, build_local_read },
+    { "passthrough read 128",   1, build_passthrough_read },
+    { "sync_read 16 x 2",       1, build_sync_read },
+    { "bulk_read 4 servos",     1, build_bulk_read },
+    { "write_read 2 x 2",       1, build_write_read },
+    { "P2 sync_read 8 x 4",     2, build_sync_read2 },
+};
+
+
+// ***************************** bench *****************************
+
+static void add_servos(uint8_t first, uint8_t nb_servos, uint8_t protocol){
+    for (uint8_t i = 0; i < nb_servos; i++){
+        servo_t* servo = bus_add_servo(first + i, protocol);
+        for (uint16_t addr = 0; addr < 256; addr++){
+            servo->table[addr] = first + i + addr;
+        }
+    }
+}
+
+static void run(const transaction_t* transaction, unsigned nb_runs){
+    uint32_t min_ticks = UINT32_MAX, max_ticks = 0, total_ticks = 0;
+    uint16_t to_bus = 0, from_bus = 0, to_host = 0;
+    uint16_t size = transaction->build(packet);
+    for (unsigned i = 0; i < nb_runs; i++){
+        sim_run(2 * SIM_TICKS_PER_MS); // the bus and the USB buffer are quiet
+        uint16_t bytes_to_bus = stat_get(STAT_BYTES_TO_BUS);
+        uint16_t bytes_from_bus = stat_get(STAT_BYTES_FROM_BUS);
+        uint32_t start = sim_now();
+        host_send(packet, size);
+        bool replied = (transaction->protocol == 1) ? host_status1(&status, REPLY_TICKS) : host_status2(&status, REPLY_TICKS);
+        if ( ! replied || ! status.valid ){
+            fprintf(stderr, "%s: no valid reply\n", transaction->name);
+            exit(1);
+        }
+        uint32_t ticks = sim_now() - start;
+        min_ticks = (ticks < min_ticks) ? ticks : min_ticks;
+        max_ticks = (ticks > max_ticks) ? ticks : max_ticks;
+        total_ticks += ticks;
+        to_bus = stat_get(STAT_BYTES_TO_BUS) - bytes_to_bus;
+        from_bus = stat_get(STAT_BYTES_FROM_BUS) - bytes_from_bus;
+        to_host = status.nb_params + ((transaction->protocol == 1) ? 6 : 11);
+    }
+    uint32_t wire_ticks = (to_bus + from_bus) * bus_byte_ticks(SIM_BAUD);
+    uint32_t average = total_ticks / nb_runs;
+    printf("%-22s %6u %6u %6u %6u   %7u %7u %7u %9u   %7u %7u\n", transaction->name, size, to_host, to_bus, from_bus,
+           min_ticks / SIM_TICKS_PER_US, average / SIM_TICKS_PER_US, max_ticks / SIM_TICKS_PER_US,
+           average * CYCLES_PER_TICK, wire_ticks / SIM_TICKS_PER_US, (average - wire_ticks) / SIM_TICKS_PER_US);
+}
+
+int main(int argc, char** argv){
+    unsigned nb_runs = argc > 1 ? atoi(argv[1]) : 20;
+    if (nb_runs == 0){
+        nb_runs = 1;
+    }
+    add_servos(1, BENCH_SERVOS, 1);
+    add_servos(BENCH_SERVOS + 1, 8, 2);
+    sim_boot();
+
+    printf("%u runs per transaction, bus at %u bauds, virtual time (see bench_usb2ax.c)\n\n", nb_runs, SIM_BAUD);
+    printf("%-22s %6s %6s %6s %6s   %7s %7s %7s %9s   %7s %7s\n", "", "USB", "USB", "bus", "bus",
+           "min", "avg", "max", "avg", "wire", "extra");
+    printf("%-22s %6s %6s %6s %6s   %7s %7s %7s %9s   %7s %7s\n", "transaction", "out", "in", "out", "in",
+           "us", "us", "us", "cycles", "us", "us");
+    for (unsigned i = 0; i < sizeof(transactions) / sizeof(transactions[0]); i++){
+        run(&transactions[i], nb_runs);
+    }
+    return 0;
+}
@@ -0,0 +1,306 @@
+/*
+ * bus.c
+ *
+ * Virtual Dynamixel bus of the host model, see sim.h.
+ *
+ * The servos see the bytes the USB2AX sends once their stop bit is out, find the instruction packets in them
+ * (resynchronizing on garbage like the real ones do) and answer after their return delay. They know PING, READ_DATA,
+ * WRITE_DATA and SYNC_WRITE, in Protocol 1.0 or 2.0. Instructions to the broadcast ID are executed but not answered.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sim.h"
+
+#define BUS_PACKET_GAP      (2 * SIM_TICKS_PER_MS)  // silence after which the servos drop a partial packet
+#define BUS_LOG_SIZE        65536
+#define ID_BROADCAST        0xFE
+
+#define INST_PING           0x01
+#define INST_READ           0x02
+#define INST_WRITE          0x03
+#define INST_SYNC_WRITE     0x83
+#define INST_STATUS2        0x55
+
+#define ERROR1_INSTRUCTION  0x40
+#define ERROR2_INSTRUCTION  0x02
+
+uint32_t bus_bad_packets;
+uint32_t bus_collisions;
+
+static servo_t  servos[BUS_MAX_SERVOS];
+static uint8_t  nb_servos;
+static uint32_t servo_baud = SIM_BAUD;
+static uint32_t busy_until;             // end of the last byte put on the bus by the servos
+
+static uint8_t  packet[DXL_MAX_PACKET + 16];
+static uint16_t packet_size;
+static uint32_t last_byte_at;
+
+static uint8_t  log_data[BUS_LOG_SIZE];
+static uint32_t log_head, log_tail;
+
+
+servo_t* bus_add_servo(uint8_t id, uint8_t protocol){
+    if (nb_servos == BUS_MAX_SERVOS){
+        fprintf(stderr, "bus: too many servos\n");
+        abort();
+    }
+    servo_t* servo = &servos[nb_servos++];
+    memset(servo, 0, sizeof(*servo));
+    servo->id = id;
+    servo->protocol = protocol;
+    servo->return_delay = BUS_RETURN_DELAY;
+    servo->table[3] = id; // where the ID is in the control table of the Robotis servos
+    return servo;
+}
+
+void bus_set_baud(uint32_t baud){
+    servo_baud = baud;
+}
+
+uint16_t bus_sent(uint8_t* data, uint16_t max){
+    uint16_t nb_bytes = 0;
+    while (nb_bytes < max && log_tail != log_head){
+        data[nb_bytes++] = log_data[log_tail++ % BUS_LOG_SIZE];
+    }
+    return nb_bytes;
+}
+
+void bus_reply(const uint8_t* data, uint16_t nb_bytes, uint32_t delay){
+    uint32_t byte_ticks = bus_byte_ticks(servo_baud);
+    uint32_t end = sim_now() + delay;
+    if (end < busy_until){ // one talker at a time
+        end = busy_until;
+    }
+    for (uint16_t i = 0; i < nb_bytes; i++){
+        end += byte_ticks;
+        sim_to_usb2ax(data[i], servo_baud, end);
+    }
+    busy_until = end;
+}
+
+
+// ***************************** replies *****************************
+
+static void reply1(servo_t* servo, const uint8_t* params, uint8_t nb_params, uint32_t end){
+    uint8_t reply[DXL_MAX_PACKET];
+    uint16_t size = dxl_packet1(reply, servo->id, servo->error, params, nb_params);
+    if (servo->corrupt){
+        reply[size - 1] ^= 0x01;
+    }
+    if (servo->mute){
+        return;
+    }
+    uint32_t now = sim_now();
+    bus_reply(reply, size - (servo->truncate < size ? servo->truncate : size), end + servo->return_delay - now);
+}
+
+static void reply2(servo_t* servo, const uint8_t* params, uint16_t nb_params, uint32_t end){
+    uint8_t data[DXL_MAX_PACKET];
+    uint8_t reply[DXL_MAX_PACKET + 16];
+    data[0] = servo->error;
+    if (nb_params){
+        memcpy(data + 1, params, nb_params);
+    }
+    uint16_t size = dxl_packet2(reply, servo->id, INST_STATUS2, data, nb_params + 1);
+    if (servo->corrupt){
+        reply[size - 2] ^= 0x01;
+    }
+    if (servo->mute){
+        return;
+    }
+    uint32_t now = sim_now();
+    bus_reply(reply, size - (servo->truncate < size ? servo->truncate : size), end + servo->return_delay - now);
+}
+
+
+// ***************************** instructions *****************************
+
+static void execute1(const uint8_t* p, uint16_t size, uint32_t end){
+    uint8_t id = p[2];
+    uint8_t instruction = p[4];
+    const uint8_t* params = p + 5;
+    uint8_t nb_params = p[3] - 2;
+    if (dxl_checksum(p + 2, size - 3) != p[size - 1]){
+        bus_bad_packets++;
+        return;
+    }
+
+    for (uint8_t s = 0; s < nb_servos; s++){
+        servo_t* servo = &servos[s];
+        if (servo->protocol != 1 || (servo->id != id && id != ID_BROADCAST)){
+            continue;
+        }
+        servo->nb_instructions++;
+        switch (instruction){
+            case INST_PING:
+                if (id != ID_BROADCAST){
+                    reply1(servo, NULL, 0, end);
+                }
+                break;
+            case INST_READ:
+                if (nb_params == 2 && id != ID_BROADCAST){
+                    uint8_t data[256];
+                    for (uint16_t i = 0; i < params[1]; i++){
+                        data[i] = servo->table[(params[0] + i) & 0xFF];
+                    }
+                    reply1(servo, data, params[1], end);
+                }
+                break;
+            case INST_WRITE:
+                for (uint8_t i = 1; i < nb_params; i++){
+                    servo->table[(params[0] + i - 1) & 0xFF] = params[i];
+                }
+                if (id != ID_BROADCAST){
+                    reply1(servo, NULL, 0, end);
+                }
+                break;
+            case INST_SYNC_WRITE: {
+                uint8_t length = params[1];
+                for (uint16_t i = 2; length && i + length < nb_params; i += length + 1){ // ID and data of each servo
+                    if (params[i] == servo->id){
+                        for (uint8_t j = 0; j < length; j++){
+                            servo->table[(params[0] + j) & 0xFF] = params[i + 1 + j];
+                        }
+                    }
+                }
+                break;
+            }
+            default:
+                if (id != ID_BROADCAST){
+                    uint8_t error = servo->error;
+                    servo->error |= ERROR1_INSTRUCTION;
+                    reply1(servo, NULL, 0, end);
+                    servo->error = error;
+                }
+                break;
+        }
+    }
+}
+
+static void execute2(uint8_t* p, uint16_t size, uint32_t end){
+    uint8_t id = p[4];
+    uint8_t instruction = p[7];
+    uint16_t crc = p[size - 2] | (p[size - 1] << 8);
+    if (dxl_crc(0, p, size - 2) != crc){
+        bus_bad_packets++;
+        return;
+    }
+    uint8_t* params = p + 8;
+    uint16_t nb_params = dxl_unstuff(params, size - 10);
+
+    for (uint8_t s = 0; s < nb_servos; s++){
+        servo_t* servo = &servos[s];
+        if (servo->protocol != 2 || (servo->id != id && id != ID_BROADCAST)){
+            continue;
+        }
+        servo->nb_instructions++;
+        switch (instruction){
+            case INST_PING:
+                if (id != ID_BROADCAST){
+                    uint8_t model[] = { servo->table[0], servo->table[1], servo->table[2] };
+                    reply2(servo, model, sizeof(model), end);
+                }
+                break;
+            case INST_READ:
+                if (nb_params == 4 && id != ID_BROADCAST){
+                    uint16_t addr = params[0] | (params[1] << 8);
+                    uint16_t nb_bytes = params[2] | (params[3] << 8);
+                    uint8_t data[DXL_MAX_PACKET];
+                    if (nb_bytes > sizeof(data) / 2){
+                        nb_bytes = sizeof(data) / 2;
+                    }
+                    for (uint16_t i = 0; i < nb_bytes; i++){
+                        data[i] = servo->table[(addr + i) & 0xFF];
+                    }
+                    reply2(servo, data, nb_bytes, end);
+                }
+                break;
+            case INST_WRITE:
+                if (nb_params >= 2){
+                    uint16_t addr = params[0] | (params[1] << 8);
+                    for (uint16_t i = 2; i < nb_params; i++){
+                        servo->table[(addr + i - 2) & 0xFF] = params[i];
+                    }
+                    if (id != ID_BROADCAST){
+                        reply2(servo, NULL, 0, end);
+                    }
+                }
+                break;
+            default:
+                if (id != ID_BROADCAST){
+                    uint8_t error = servo->error;
+                    servo->error = ERROR2_INSTRUCTION;
+                    reply2(servo, NULL, 0, end);
+                    servo->error = error;
+                }
+                break;
+        }
+    }
+}
+
+// size of the packet at the start of the buffer: 0 if more bytes are needed, -1 if it can't be a packet
+static int packet_length(void){
+    if (packet_size >= 1 && packet[0] != 0xFF){
+        return -1;
+    }
+    if (packet_size >= 2 && packet[1] != 0xFF){
+        return -1;
+    }
+    if (packet_size >= 3 && packet[2] == 0xFF){ // more than two 0xFF
+        return -1;
+    }
+    if (packet_size < 4){
+        return 0;
+    }
+    if (packet[2] == 0xFD && packet[3] == 0x00){ // Protocol 2.0
+        if (packet_size < 7){
+            return 0;
+        }
+        uint16_t length = packet[5] | (packet[6] << 8);
+        if (length < 3 || length > DXL_MAX_PACKET){
+            return -1;
+        }
+        return 7 + length;
+    }
+    if (packet[3] < 2){
+        return -1;
+    }
+    return 4 + packet[3];
+}
+
+void bus_from_usb2ax(uint8_t data, uint32_t baud, uint32_t end){
+    log_data[log_head++ % BUS_LOG_SIZE] = data;
+    if (end - bus_byte_ticks(baud) < busy_until){
+        bus_collisions++;
+    }
+    if (baud > servo_baud + servo_baud / 32 || baud + servo_baud / 32 < servo_baud){
+        packet_size = 0; // garbage for the servos
+        return;
+    }
+    if (packet_size && end - last_byte_at > BUS_PACKET_GAP){
+        packet_size = 0;
+    }
+    last_byte_at = end;
+    packet[packet_size++] = data;
+
+    for (;;){
+        int length = packet_length();
+        if (length < 0){ // look for a header further on
+            memmove(packet, packet + 1, --packet_size);
+            continue;
+        }
+        if (length > 0 && packet_size == length){
+            if (packet[2] == 0xFD && packet[3] == 0x00){
+                execute2(packet, length, end);
+            } else {
+                execute1(packet, length, end);
+            }
+            packet_size = 0;
+        }
+        break;
+    }
+}
@@ -0,0 +1,150 @@
+/*
+ * dxl.c
+ *
+ * Dynamixel packets for the host model, see sim.h. Written from the protocol documentation rather than shared with
+ * the firmware, so that a mistake on one side does not hide the same one on the other.
+ */
+
+#include <string.h>
+
+#include "sim.h"
+
+uint8_t dxl_checksum(const uint8_t* data, uint16_t nb_bytes){
+    uint8_t sum = 0;
+    for (uint16_t i = 0; i < nb_bytes; i++){
+        sum += data[i];
+    }
+    return ~sum;
+}
+
+// CRC-16, polynomial 0x8005, no reflection, initial value 0
+uint16_t dxl_crc(uint16_t crc, const uint8_t* data, uint16_t nb_bytes){
+    for (uint16_t i = 0; i < nb_bytes; i++){
+        crc ^= (uint16_t)data[i] << 8;
+        for (uint8_t bit = 0; bit < 8; bit++){
+            crc = (crc & 0x8000) ? (crc << 1) ^ 0x8005 : crc << 1;
+        }
+    }
+    return crc;
+}
+
+// 0xFF 0xFF ID LENGTH INSTRUCTION PARAMS... CHECKSUM (INSTRUCTION is the error byte in status packets)
+uint16_t dxl_packet1(uint8_t* packet, uint8_t id, uint8_t instruction, const uint8_t* params, uint8_t nb_params){
+    packet[0] = 0xFF;
+    packet[1] = 0xFF;
+    packet[2] = id;
+    packet[3] = nb_params + 2;
+    packet[4] = instruction;
+    if (nb_params){
+        memcpy(packet + 5, params, nb_params);
+    }
+    packet[5 + nb_params] = dxl_checksum(packet + 2, 3 + nb_params);
+    return 6 + nb_params;
+}
+
+// 0xFF 0xFF 0xFD 0x00 ID LEN_L LEN_H INSTRUCTION PARAMS... CRC_L CRC_H, with a 0xFD added after each 0xFF 0xFF 0xFD
+uint16_t dxl_packet2(uint8_t* packet, uint8_t id, uint8_t instruction, const uint8_t* params, uint16_t nb_params){
+    uint16_t size = 0;
+    packet[size++] = 0xFF;
+    packet[size++] = 0xFF;
+    packet[size++] = 0xFD;
+    packet[size++] = 0x00;
+    packet[size++] = id;
+    size += 2; // length
+    packet[size++] = instruction;
+    for (uint16_t i = 0; i < nb_params; i++){
+        packet[size++] = params[i];
+        if (params[i] == 0xFD && size >= 11 && packet[size - 2] == 0xFF && packet[size - 3] == 0xFF){
+            packet[size++] = 0xFD;
+        }
+    }
+    uint16_t length = size - 7 + 2;
+    packet[5] = length;
+    packet[6] = length >> 8;
+    uint16_t crc = dxl_crc(0, packet, size);
+    packet[size++] = crc;
+    packet[size++] = crc >> 8;
+    return size;
+}
+
+// remove the byte stuffing in place, return the new number of bytes
+uint16_t dxl_unstuff(uint8_t* data, uint16_t nb_bytes){
+    uint16_t count = 0;
+    uint16_t removed_at = 0; // count when a 0xFD was last removed: the 0xFF 0xFF 0xFD before it does not count twice
+    for (uint16_t i = 0; i < nb_bytes; i++){
+        if ( data[i] == 0xFD && count >= 3 && count != removed_at
+            && data[count - 1] == 0xFD && data[count - 2] == 0xFF && data[count - 3] == 0xFF ){
+            removed_at = count;
+            continue;
+        }
+        data[count++] = data[i];
+    }
+    return count;
+}
+
+
+// ***************************** status packets received by the host *****************************
+
+// size of the Protocol 1.0 status packet at the head of what the host received, 0 if it is not all there yet
+static uint16_t status1_size(void){
+    if (host_received() < 4){
+        return 0;
+    }
+    uint16_t size = 4 + host_peek(3);
+    return host_received() >= size ? size : 0;
+}
+
+bool host_status1(dxl_status_t* status, uint32_t max_ticks){
+    uint32_t start = sim_now();
+    while (status1_size() == 0){
+        if (sim_now() - start >= max_ticks || sim_halted()){
+            return false;
+        }
+        sim_run(1);
+    }
+    uint8_t packet[4 + 255];
+    uint16_t size = host_read(packet, status1_size());
+    if (packet[0] != 0xFF || packet[1] != 0xFF || packet[3] < 2){
+        return false;
+    }
+    status->id = packet[2];
+    status->error = packet[4];
+    status->nb_params = packet[3] - 2;
+    memcpy(status->params, packet + 5, status->nb_params);
+    status->valid = dxl_checksum(packet + 2, size - 3) == packet[size - 1];
+    return true;
+}
+
+static uint32_t status2_size(void){
+    if (host_received() < 7){
+        return 0;
+    }
+    uint32_t size = 7 + (host_peek(5) | (host_peek(6) << 8));
+    return host_received() >= size ? size : 0;
+}
+
+bool host_status2(dxl_status_t* status, uint32_t max_ticks){
+    uint32_t start = sim_now();
+    while (status2_size() == 0){
+        if (sim_now() - start >= max_ticks || sim_halted()){
+            return false;
+        }
+        sim_run(1);
+    }
+    static uint8_t packet[DXL_MAX_PACKET];
+    uint32_t size = status2_size();
+    if (size > DXL_MAX_PACKET){
+        return false;
+    }
+    host_read(packet, size);
+    if (packet[0] != 0xFF || packet[1] != 0xFF || packet[2] != 0xFD || packet[3] != 0x00 || size < 11 || packet[7] != 0x55){
+        return false;
+    }
+    status->id = packet[4];
+    status->valid = dxl_crc(0, packet, size - 2) == (packet[size - 2] | (packet[size - 1] << 8));
+    uint16_t nb_bytes = dxl_unstuff(packet + 8, size - 10);
+    status->error = packet[8];
+    status->nb_params = nb_bytes - 1;
+    memcpy(status->params, packet + 9, status->nb_params);
+    return true;
+}
@@ -0,0 +1,225 @@
+/*
+ * fuzz_parser.c
+ *
+ * Fuzzer of the USB parser (process_incoming_USB_data) and of the local commands behind it, on the host model
+ * (see sim.h). Each run boots the firmware in its own process and sends it a random mix of garbage, valid and
+ * damaged Protocol 1.0 and 2.0 packets, for the USB2AX and for the servos, cut in random USB packets with random gaps.
+ * Afterwards, once the port has been closed and opened again, the parser must be back to its idle state and the
+ * USB2AX must answer a PING. The model aborts on any misuse of the hardware, and the sanitizers on any bad access.
+ *
+ *   fuzz_parser [runs] [seed]     runs with the seeds from seed on: a failing one is run again alone with "fuzz_parser 1 <its seed>"
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "sim.h"
+#include "../AX.h"
+#include "../AX2.h"
+
+#define CASES_PER_RUN   40
+#define RUN_TIME_LIMIT  60      // seconds of real time for a run
+#define QUIET_TICKS     (20 * SIM_TICKS_PER_MS) // longer than the longest receive or USART timeout (255 x 20us)
+#define SETTLE_TICKS    (2000 * SIM_TICKS_PER_MS) // longer than a sync_read of all the IDs a packet holds, with that timeout
+
+extern uint8_t ax_state;
+extern uint8_t passthrough_mode;
+
+static uint32_t rng_state;
+
+// xorshift32
+static uint32_t rng(void){
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return rng_state;
+}
+
+static uint32_t rng_below(uint32_t n){
+    return rng() % n;
+}
+
+static uint8_t rng_byte(void){
+    switch (rng_below(8)){ // the bytes the parser looks for, more often than by chance
+        case 0:  return 0xFF;
+        case 1:  return 0xFD;
+        case 2:  return rng_below(8);
+        default: return rng();
+    }
+}
+
+// an instruction the USB2AX knows, but not the ones which reset it
+static uint8_t local_instruction(void){
+    static const uint8_t instructions[] = {
+        AX_CMD_PING, AX_CMD_READ_DATA, AX_CMD_WRITE_DATA, AX_CMD_SYNC_WRITE, AX_CMD_SYNC_READ, AX_CMD_SCAN,
+        AX_CMD_STREAM, AX_CMD_WRITE_READ, AX_CMD_GROUP_SET, AX_CMD_GROUP_RUN, AX_CMD_BULK_READ,
+        AX2_CMD_SYNC_READ, 0x7E,
+    };
+    return instructions[rng_below(sizeof(instructions))];
+}
+
+static uint8_t servo_id(void){
+    static const uint8_t ids[] = { 1, 2, 3, 4, 5, 9, AX_ID_BROADCAST };
+    return ids[rng_below(sizeof(ids))];
+}
+
+static uint16_t random_params(uint8_t* params, uint16_t max){
+    uint16_t nb_params = rng_below(max + 1);
+    for (uint16_t i = 0; i < nb_params; i++){
+        params[i] = rng_below(4) ? rng_below(12) : rng_byte(); // mostly small: IDs, lengths, addresses of the registers
+    }
+    return nb_params;
+}
+
+// parameters of a SCAN which does not take minutes of virtual time
+static uint16_t scan_params(uint8_t* params){
+    params[0] = rng_below(16);
+    params[1] = params[0] + rng_below(8);
+    params[2] = rng_below(20);
+    uint16_t nb_params = 3;
+    if (rng_below(2)){
+        params[nb_params++] = 1 + rng_below(3);
+    }
+    return nb_params;
+}
+
+static uint16_t make_case(uint8_t* data){
+    uint8_t params[DXL_MAX_PACKET];
+    uint16_t size;
+    switch (rng_below(6)){
+        case 0: // garbage
+            size = 1 + rng_below(40);
+            for (uint16_t i = 0; i < size; i++){
+                data[i] = rng_byte();
+            }
+            return size;
+        case 1: { // for the USB2AX, Protocol 1.0
+            uint8_t instruction = local_instruction();
+            uint16_t nb_params = instruction == AX_CMD_SCAN ? scan_params(params) : random_params(params, 40);
+            size = dxl_packet1(data, AX_ID_DEVICE, instruction, params, nb_params);
+            break;
+        }
+        case 2: { // for the servos, Protocol 1.0
+            static const uint8_t instructions[] = { AX_CMD_PING, AX_CMD_READ_DATA, AX_CMD_WRITE_DATA, AX_CMD_SYNC_READ };
+            uint8_t instruction = instructions[rng_below(sizeof(instructions))];
+            size = dxl_packet1(data, servo_id(), instruction, params, random_params(params, 8));
+            break;
+        }
+        case 3: { // Protocol 2.0, for the USB2AX or for the servos
+            uint8_t id = rng_below(2) ? AX_ID_DEVICE : servo_id();
+            uint8_t instruction = rng_below(2) ? local_instruction() : AX_CMD_READ_DATA;
+            if (instruction == AX_CMD_SCAN){
+                instruction = AX_CMD_PING;
+            }
+            size = dxl_packet2(data, id, instruction, params, random_params(params, 24));
+            break;
+        }
+        default: { // damaged: anything above, with a wrong byte or cut short
+            size = make_case(data);
+            if (rng_below(2)){
+                data[rng_below(size)] ^= 1 << rng_below(8);
+            } else {
+                size = 1 + rng_below(size);
+            }
+            return size;
+        }
+    }
+    return size;
+}
+
+static void fail(const char* message){
+    fprintf(stderr, "%s\n", message);
+    exit(1);
+}
+
+static void run(uint32_t seed){
+    rng_state = seed * 2654435761u ^ 0x9E3779B9; // spread the bits of small seeds
+    if (rng_state == 0){
+        rng_state = 1;
+    }
+    bus_add_servo(1, 1);
+    bus_add_servo(2, 1)->mute = true;
+    bus_add_servo(3, 1)->return_delay = 400;
+    bus_add_servo(4, 2);
+    bus_add_servo(5, 1)->corrupt = true;
+    sim_boot();
+
+    uint8_t data[2 * DXL_MAX_PACKET];
+    for (uint16_t c = 0; c < CASES_PER_RUN && ! sim_halted(); c++){
+        uint16_t size = make_case(data);
+        uint8_t packet_size = 1 + rng_below(CDC_RX_EPSIZE);
+        uint32_t gap = rng_below(4) ? rng_below(100) : rng_below(3 * SIM_TICKS_PER_MS);
+        host_send_split(data, size, packet_size, gap);
+        if (rng_below(16) == 0){ // the host stops reading for a while
+            host_set_reading(false);
+            sim_run(rng_below(20 * SIM_TICKS_PER_MS));
+            host_set_reading(true);
+        }
+        sim_run(rng_below(4) ? rng_below(SIM_TICKS_PER_MS) : rng_below(10 * SIM_TICKS_PER_MS));
+        host_flush();
+    }
+    if (sim_halted()){ // a RESET made of garbage, which is fine
+        return;
+    }
+
+    // back to normal once the host has reopened the port (which stops a STREAM) and everything has timed out
+    uint32_t start = sim_now();
+    while (host_sending() && sim_now() - start < SETTLE_TICKS){
+        sim_run(SIM_TICKS_PER_MS);
+        host_flush();
+    }
+    sim_close_port();
+    sim_open_port(SIM_BAUD);
+    start = sim_now();
+    while (sync_read_state != SYNC_READ_IDLE && sim_now() - start < SETTLE_TICKS){
+        sim_run(SIM_TICKS_PER_MS);
+        host_flush();
+    }
+    sim_run(QUIET_TICKS);
+    if (sim_halted()){
+        return;
+    }
+    if (ax_state != 0 || sync_read_state != SYNC_READ_IDLE || passthrough_mode != AX_PASSTHROUGH){
+        fprintf(stderr, "parser state %u, sync_read state %u, passthrough mode %u\n", ax_state, sync_read_state, passthrough_mode);
+        fail("the parser is not back to idle");
+    }
+    host_flush();
+    uint8_t ping[8];
+    uint16_t size = dxl_packet1(ping, AX_ID_DEVICE, AX_CMD_PING, NULL, 0);
+    host_send(ping, size);
+    uint8_t reply[8];
+    if (host_wait(6, QUIET_TICKS) != 6 || host_read(reply, sizeof(reply)) != 6){
+        fail("no reply to a PING");
+    }
+    const uint8_t expected[] = { 0xFF, 0xFF, AX_ID_DEVICE, 0x02, 0x00, 0x00 };
+    if (memcmp(reply, expected, sizeof(expected)) != 0){
+        fail("wrong reply to a PING");
+    }
+}
+
+int main(int argc, char** argv){
+    uint32_t nb_runs = argc > 1 ? strtoul(argv[1], NULL, 0) : 100;
+    uint32_t seed = argc > 2 ? strtoul(argv[2], NULL, 0) : 1;
+    uint32_t nb_failed = 0;
+    for (uint32_t r = 0; r < nb_runs; r++){
+        uint32_t run_seed = seed + r;
+        fflush(stdout);
+        pid_t pid = fork();
+        if (pid == 0){
+            alarm(RUN_TIME_LIMIT);
+            run(run_seed);
+            exit(0);
+        }
+        int result;
+        waitpid(pid, &result, 0);
+        if ( ! WIFEXITED(result) || WEXITSTATUS(result) != 0 ){
+            printf("FAIL  seed %u\n", run_seed);
+            nb_failed++;
+        }
+    }
+    printf("%u runs, %u failed\n", nb_runs, nb_failed);
+    return nb_failed ? 1 : 0;
+}
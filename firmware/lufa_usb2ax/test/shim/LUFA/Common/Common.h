@@ -0,0 +1,54 @@
+/*
+ * LUFA/Common/Common.h for the host build: the types, attributes and interrupt helpers the firmware uses
+ */
+
+#ifndef SHIM_LUFA_COMMON_H_
+#define SHIM_LUFA_COMMON_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+
+#include <avr/interrupt.h>
+
+typedef uint8_t uint_reg_t;
+
+#define ATTR_WARN_UNUSED_RESULT     __attribute__((warn_unused_result))
+#define ATTR_NON_NULL_PTR_ARG(...)  __attribute__((nonnull(__VA_ARGS__)))
+#define ATTR_ALWAYS_INLINE          __attribute__((always_inline))
+#define ATTR_PACKED                 __attribute__((packed))
+#define ATTR_NO_INIT
+#define ATTR_INIT_SECTION(section)
+#define ATTR_CONST
+#define ATTR_PURE
+
+#define GCC_MEMORY_BARRIER()        __asm__ __volatile__("" ::: "memory")
+
+static inline uint_reg_t GetGlobalInterruptMask(void){
+    return sim_interrupts_enabled ? 0x80 : 0;
+}
+
+static inline void SetGlobalInterruptMask(const uint_reg_t GlobalIntState){
+    GCC_MEMORY_BARRIER();
+    if (GlobalIntState & 0x80){
+        sim_sei();
+    } else {
+        sim_interrupts_enabled = 0;
+    }
+    GCC_MEMORY_BARRIER();
+}
+
+static inline void GlobalInterruptEnable(void){
+    GCC_MEMORY_BARRIER();
+    sim_sei();
+    GCC_MEMORY_BARRIER();
+}
+
+static inline void GlobalInterruptDisable(void){
+    GCC_MEMORY_BARRIER();
+    sim_interrupts_enabled = 0;
+    GCC_MEMORY_BARRIER();
+}
+
+#endif /* SHIM_LUFA_COMMON_H_ */
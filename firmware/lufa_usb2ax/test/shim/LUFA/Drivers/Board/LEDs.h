@@ -0,0 +1,33 @@
+/*
+ * LUFA/Drivers/Board/LEDs.h for the host build: the LEDs are a variable the tests can look at
+ */
+
+#ifndef SHIM_LUFA_LEDS_H_
+#define SHIM_LUFA_LEDS_H_
+
+#include <stdint.h>
+
+#define LEDS_LED1       (1 << 0)
+#define LEDS_LED2       (1 << 1)
+#define LEDS_ALL_LEDS   (LEDS_LED1 | LEDS_LED2)
+#define LEDS_NO_LEDS    0
+
+extern uint8_t sim_leds;
+
+static inline void LEDs_Init(void){
+    sim_leds = LEDS_NO_LEDS;
+}
+
+static inline void LEDs_SetAllLEDs(const uint8_t LEDMask){
+    sim_leds = LEDMask;
+}
+
+static inline void LEDs_TurnOnLEDs(const uint8_t LEDMask){
+    sim_leds |= LEDMask;
+}
+
+static inline void LEDs_TurnOffLEDs(const uint8_t LEDMask){
+    sim_leds &= ~LEDMask;
+}
+
+#endif /* SHIM_LUFA_LEDS_H_ */
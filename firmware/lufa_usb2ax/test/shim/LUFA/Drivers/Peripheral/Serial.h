@@ -0,0 +1,11 @@
+/*
+ * LUFA/Drivers/Peripheral/Serial.h for the host build: only the baud rate macros, the firmware drives USART1 itself
+ */
+
+#ifndef SHIM_LUFA_SERIAL_H_
+#define SHIM_LUFA_SERIAL_H_
+
+#define SERIAL_UBBRVAL(Baud)    ((((F_CPU / 16) + (Baud / 2)) / (Baud)) - 1)
+#define SERIAL_2X_UBBRVAL(Baud) ((((F_CPU / 8) + (Baud / 2)) / (Baud)) - 1)
+
+#endif /* SHIM_LUFA_SERIAL_H_ */
@@ -0,0 +1,96 @@
+/*
+ * LUFA/Drivers/USB/USB.h for the host build
+ *
+ * The part of the LUFA USB stack and CDC class driver the firmware uses. The endpoints are backed by the virtual
+ * host in sim.c: the OUT endpoint holds the packets the tests send, the IN endpoint hands its banks to them.
+ */
+
+#ifndef SHIM_LUFA_USB_H_
+#define SHIM_LUFA_USB_H_
+
+#include <LUFA/Common/Common.h>
+
+#define ENDPOINT_DIR_OUT            0x00
+#define ENDPOINT_DIR_IN             0x80
+
+enum USB_Device_States_t {
+    DEVICE_STATE_Unattached     = 0,
+    DEVICE_STATE_Powered        = 1,
+    DEVICE_STATE_Default        = 2,
+    DEVICE_STATE_Addressed      = 3,
+    DEVICE_STATE_Configured     = 4,
+    DEVICE_STATE_Suspended      = 5,
+};
+
+extern volatile uint8_t USB_DeviceState;
+
+// descriptors, only there for Descriptors.h (Descriptors.c is not part of the host build)
+typedef struct { uint8_t Size; uint8_t Type; } USB_Descriptor_Header_t;
+typedef struct { USB_Descriptor_Header_t Header; uint16_t TotalConfigurationSize; uint8_t TotalInterfaces; } USB_Descriptor_Configuration_Header_t;
+typedef struct { USB_Descriptor_Header_t Header; uint8_t InterfaceNumber; uint8_t TotalEndpoints; } USB_Descriptor_Interface_t;
+typedef struct { USB_Descriptor_Header_t Header; uint8_t Address; uint16_t EndpointSize; } USB_Descriptor_Endpoint_t;
+typedef struct { USB_Descriptor_Header_t Header; uint8_t Subtype; uint16_t CDCSpecification; } USB_CDC_Descriptor_FunctionalHeader_t;
+typedef struct { USB_Descriptor_Header_t Header; uint8_t Subtype; uint8_t Capabilities; } USB_CDC_Descriptor_FunctionalACM_t;
+typedef struct { USB_Descriptor_Header_t Header; uint8_t Subtype; uint8_t MasterInterfaceNumber; uint8_t SlaveInterfaceNumber; } USB_CDC_Descriptor_FunctionalUnion_t;
+
+// CDC class driver
+#define CDC_CONTROL_LINE_OUT_DTR    (1 << 0)
+#define CDC_CONTROL_LINE_OUT_RTS    (1 << 1)
+
+typedef struct {
+    uint8_t  Address;
+    uint16_t Size;
+    uint8_t  Type;
+    uint8_t  Banks;
+} USB_Endpoint_Table_t;
+
+typedef struct {
+    uint32_t BaudRateBPS;
+    uint8_t  CharFormat;
+    uint8_t  ParityType;
+    uint8_t  DataBits;
+} CDC_LineEncoding_t;
+
+typedef struct {
+    struct {
+        uint8_t ControlInterfaceNumber;
+        USB_Endpoint_Table_t DataINEndpoint;
+        USB_Endpoint_Table_t DataOUTEndpoint;
+        USB_Endpoint_Table_t NotificationEndpoint;
+    } Config;
+    struct {
+        struct {
+            uint16_t HostToDevice;
+            uint16_t DeviceToHost;
+        } ControlLineStates;
+        CDC_LineEncoding_t LineEncoding;
+    } State;
+} USB_ClassInfo_CDC_Device_t;
+
+static inline bool CDC_Device_ConfigureEndpoints(USB_ClassInfo_CDC_Device_t* const CDCInterfaceInfo){
+    (void)CDCInterfaceInfo;
+    return true;
+}
+
+static inline void CDC_Device_ProcessControlRequest(USB_ClassInfo_CDC_Device_t* const CDCInterfaceInfo){
+    (void)CDCInterfaceInfo; // the control requests are replayed by the tests themselves, see sim_open_port()
+}
+
+// device, see sim.c
+void USB_Init(void);
+void USB_USBTask(void);
+void USB_Detach(void);
+
+// endpoints, see sim.c
+void     Endpoint_SelectEndpoint(const uint8_t Address);
+bool     Endpoint_IsINReady(void);
+bool     Endpoint_IsOUTReceived(void);
+bool     Endpoint_IsReadWriteAllowed(void);
+uint16_t Endpoint_BytesInEndpoint(void);
+uint8_t  Endpoint_Read_8(void);
+void     Endpoint_Write_8(const uint8_t Data);
+uint8_t  Endpoint_Write_Stream_LE(const void* const Buffer, uint16_t Length, uint16_t* const BytesProcessed);
+void     Endpoint_ClearIN(void);
+void     Endpoint_ClearOUT(void);
+
+#endif /* SHIM_LUFA_USB_H_ */
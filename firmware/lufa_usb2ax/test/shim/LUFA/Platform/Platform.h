@@ -0,0 +1,10 @@
+/*
+ * LUFA/Platform/Platform.h for the host build: nothing platform-specific is needed
+ */
+
+#ifndef SHIM_LUFA_PLATFORM_H_
+#define SHIM_LUFA_PLATFORM_H_
+
+#include <LUFA/Common/Common.h>
+
+#endif /* SHIM_LUFA_PLATFORM_H_ */
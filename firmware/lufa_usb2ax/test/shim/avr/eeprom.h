@@ -0,0 +1,20 @@
+/*
+ * avr/eeprom.h for the host build: the EEPROM is sim_eeprom, which the tests can fill or check (see sim.h)
+ */
+
+#ifndef SHIM_AVR_EEPROM_H_
+#define SHIM_AVR_EEPROM_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define eeprom_busy_wait()  do { } while (0)
+
+uint8_t  eeprom_read_byte(const uint8_t* addr);
+uint32_t eeprom_read_dword(const uint32_t* addr);
+void     eeprom_read_block(void* dst, const void* src, size_t n);
+void     eeprom_update_byte(uint8_t* addr, uint8_t value);
+void     eeprom_update_dword(uint32_t* addr, uint32_t value);
+void     eeprom_update_block(const void* src, void* dst, size_t n);
+
+#endif /* SHIM_AVR_EEPROM_H_ */
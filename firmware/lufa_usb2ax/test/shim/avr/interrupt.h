@@ -0,0 +1,27 @@
+/*
+ * avr/interrupt.h for the host build
+ *
+ * The ISRs are plain functions, called by the model in sim.c when their flag is set and the global interrupt flag allows it.
+ */
+
+#ifndef SHIM_AVR_INTERRUPT_H_
+#define SHIM_AVR_INTERRUPT_H_
+
+#include <avr/io.h>
+
+extern volatile uint8_t sim_interrupts_enabled; // the I flag of SREG
+void sim_sei(void);                                 // sets it, and runs the interrupts which were waiting for it
+
+#define sei()   sim_sei()
+#define cli()   do { sim_interrupts_enabled = 0; } while (0)
+
+#define ISR_BLOCK
+#define ISR(vector, ...)    void vector(void); void vector(void)
+
+void USART1_UDRE_vect(void);
+void USART1_TX_vect(void);
+void USART1_RX_vect(void);
+void TIMER1_COMPA_vect(void);
+void TIMER1_OVF_vect(void);
+
+#endif /* SHIM_AVR_INTERRUPT_H_ */
@@ -0,0 +1,76 @@
+/*
+ * avr/io.h for the host build (see ../../Makefile)
+ *
+ * The registers of the ATmega32u2 used by the firmware, backed by the model in sim.c: every access to a register
+ * which has a behaviour (USART1, TIMER1) goes through sim_reg8()/sim_reg16(), which lets the virtual time go by and
+ * runs the interrupts that are due, like the CPU would between two instructions.
+ */
+
+#ifndef SHIM_AVR_IO_H_
+#define SHIM_AVR_IO_H_
+
+#include <stdint.h>
+
+#define _BV(bit)                        (1 << (bit))
+#define bit_is_set(sfr, bit)            ((sfr) & _BV(bit))
+#define bit_is_clear(sfr, bit)          ( ! ((sfr) & _BV(bit)))
+#define loop_until_bit_is_set(sfr, bit)   do { } while (bit_is_clear(sfr, bit))
+#define loop_until_bit_is_clear(sfr, bit) do { } while (bit_is_set(sfr, bit))
+
+volatile uint8_t*  sim_reg8(volatile uint8_t* reg);
+volatile uint16_t* sim_reg16(volatile uint16_t* reg);
+volatile uint16_t* sim_tcnt1(void);
+
+extern volatile uint8_t  sim_UCSR1A, sim_UCSR1B, sim_UCSR1C, sim_TIMSK1, sim_TIFR1;
+extern volatile uint16_t sim_UDR1, sim_OCR1A, sim_UBRR1;
+
+// USART1
+#define UCSR1A      (*sim_reg8(&sim_UCSR1A))
+#define UCSR1B      (*sim_reg8(&sim_UCSR1B))
+#define UCSR1C      (*sim_reg8(&sim_UCSR1C))
+#define UDR1        (*sim_reg16(&sim_UDR1))     // 16 bits wide here, so that a write can be told from a read (see sim.c)
+#define UBRR1       (*sim_reg16(&sim_UBRR1))
+
+#define MPCM1       0
+#define U2X1        1
+#define UPE1        2
+#define DOR1        3
+#define FE1         4
+#define UDRE1       5
+#define TXC1        6
+#define RXC1        7
+
+#define TXB81       0
+#define RXB81       1
+#define UCSZ12      2
+#define TXEN1       3
+#define RXEN1       4
+#define UDRIE1      5
+#define TXCIE1      6
+#define RXCIE1      7
+
+#define UCPOL1      0
+#define UCSZ10      1
+#define UCSZ11      2
+
+// TIMER1
+#define TCNT1       (*sim_tcnt1())
+#define OCR1A       (*sim_reg16(&sim_OCR1A))
+#define TIMSK1      (*sim_reg8(&sim_TIMSK1))
+#define TIFR1       (*sim_reg8(&sim_TIFR1))
+
+#define TOIE1       0
+#define OCIE1A      1
+#define TOV1        0
+#define OCF1A       1
+#define CS10        0
+#define CS11        1
+#define CS12        2
+
+// registers with no behaviour in the model
+extern volatile uint8_t TCCR1A, TCCR1B, MCUSR, DDRB, PORTB, DDRD, PORTD;
+
+#define WDRF        3
+#define PORTD7      7
+
+#endif /* SHIM_AVR_IO_H_ */
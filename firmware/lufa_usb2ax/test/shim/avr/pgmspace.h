@@ -0,0 +1,18 @@
+/*
+ * avr/pgmspace.h for the host build: the flash is ordinary memory
+ */
+
+#ifndef SHIM_AVR_PGMSPACE_H_
+#define SHIM_AVR_PGMSPACE_H_
+
+#include <stdint.h>
+#include <string.h>
+
+#define PROGMEM
+#define PSTR(s)                 (s)
+#define pgm_read_byte(addr)     (*(const uint8_t*)(addr))
+#define pgm_read_word(addr)     (*(const uint16_t*)(addr))
+#define pgm_read_dword(addr)    (*(const uint32_t*)(addr))
+#define memcpy_P                memcpy
+
+#endif /* SHIM_AVR_PGMSPACE_H_ */
@@ -0,0 +1,11 @@
+/*
+ * avr/power.h for the host build
+ */
+
+#ifndef SHIM_AVR_POWER_H_
+#define SHIM_AVR_POWER_H_
+
+#define clock_div_1                 0
+#define clock_prescale_set(div)     do { (void)(div); } while (0)
+
+#endif /* SHIM_AVR_POWER_H_ */
@@ -0,0 +1,13 @@
+/*
+ * avr/wdt.h for the host build: the watchdog is never used for anything but a reset, see Jump_To_Reset() in sim.c
+ */
+
+#ifndef SHIM_AVR_WDT_H_
+#define SHIM_AVR_WDT_H_
+
+#define WDTO_250MS          4
+#define wdt_disable()       do { } while (0)
+#define wdt_enable(value)   do { } while (0)
+#define wdt_reset()         do { } while (0)
+
+#endif /* SHIM_AVR_WDT_H_ */
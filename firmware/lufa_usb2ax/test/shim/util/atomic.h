@@ -0,0 +1,31 @@
+/*
+ * util/atomic.h for the host build, same semantics as the avr-libc one on the I flag of the model
+ */
+
+#ifndef SHIM_UTIL_ATOMIC_H_
+#define SHIM_UTIL_ATOMIC_H_
+
+#include <avr/interrupt.h>
+
+static inline uint8_t sim_atomic_cli(void){
+    sim_interrupts_enabled = 0;
+    return 1;
+}
+
+static inline void sim_atomic_restore(const uint8_t* saved){
+    if (*saved){
+        sim_sei();
+    }
+}
+
+static inline void sim_atomic_force_on(const uint8_t* saved){
+    (void)saved;
+    sim_sei();
+}
+
+#define ATOMIC_RESTORESTATE uint8_t sim_sreg_save __attribute__((__cleanup__(sim_atomic_restore))) = sim_interrupts_enabled
+#define ATOMIC_FORCEON      uint8_t sim_sreg_save __attribute__((__cleanup__(sim_atomic_force_on))) = 0
+
+#define ATOMIC_BLOCK(type)  for (type, sim_atomic_todo = sim_atomic_cli(); sim_atomic_todo; sim_atomic_todo = 0)
+
+#endif /* SHIM_UTIL_ATOMIC_H_ */
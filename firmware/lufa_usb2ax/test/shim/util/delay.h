@@ -0,0 +1,11 @@
+/*
+ * util/delay.h for the host build: the firmware only waits this way in Jump_To_Reset(), which is replaced by sim.c
+ */
+
+#ifndef SHIM_UTIL_DELAY_H_
+#define SHIM_UTIL_DELAY_H_
+
+#define _delay_ms(ms)   do { (void)(ms); } while (0)
+#define _delay_us(us)   do { (void)(us); } while (0)
+
+#endif /* SHIM_UTIL_DELAY_H_ */
@@ -0,0 +1,623 @@
+/*
+ * sim.c
+ *
+ * Registers, interrupts, USART1, TIMER1, USB endpoints, EEPROM and firmware thread of the host model, see sim.h.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <avr/eeprom.h>
+
+#include "sim.h"
+#include "../USB2AX.h"
+#include "../AX.h"
+#include "../reset.h"
+
+#define SIM_RX_FIFO_SIZE        3       // UDR1 is two bytes deep, plus the byte waiting in the shift register
+#define SIM_BUS_QUEUE_SIZE      8192    // bytes on their way from the bus to the USART
+#define SIM_OUT_QUEUE_SIZE      4096    // OUT packets waiting for the device
+#define SIM_IN_BANKS            2       // CDC_TXRX_BANKS
+#define SIM_STUCK_TICKS         (60UL * 1000 * SIM_TICKS_PER_MS) // a minute of virtual time without getting anywhere
+#define UDR_IDLE                0xFFFF  // UDR1 value when nothing was read or written, see apply_writes()
+#define UDR_RX_FLAG             0x100   // set in the value of UDR1 the RX ISR reads
+#define TIFR_UNUSED_BIT         0x80    // kept set in TIFR1, a write clears it
+
+int usb2ax_main(void);
+extern USB_ClassInfo_CDC_Device_t USB2AX_CDC_Interface;
+extern fifo_t ToUSART_Buffer;
+
+
+// registers
+volatile uint8_t  sim_UCSR1A, sim_UCSR1B, sim_UCSR1C, sim_TIMSK1, sim_TIFR1 = TIFR_UNUSED_BIT;
+volatile uint16_t sim_UDR1 = UDR_IDLE, sim_OCR1A, sim_UBRR1;
+volatile uint8_t  TCCR1A, TCCR1B, MCUSR, DDRB, PORTB, DDRD, PORTD;
+static volatile uint16_t sim_TCNT1;
+static uint8_t   ucsr1a_shown;          // what UCSR1A last read as, to tell a write from a read
+
+volatile uint8_t sim_interrupts_enabled = 0;
+volatile uint8_t USB_DeviceState = DEVICE_STATE_Configured;
+uint8_t sim_leds;
+uint8_t sim_eeprom[SIM_EEPROM_SIZE] = { [0 ... SIM_EEPROM_SIZE - 1] = 0xFF }; // erased
+
+static uint32_t now;                    // virtual time, TCNT1 is its lower 16 bits
+
+// TIMER1 flags
+static bool tov1, ocf1a;
+
+// USART1
+static bool     u2x;
+static bool     udr_full, txc;
+static uint8_t  udr_tx;
+static bool     shifting;
+static uint8_t  shift_byte;
+static uint32_t shift_baud, shift_end;
+
+typedef struct {
+    uint8_t data;
+    uint8_t flags;                      // FE1 and DOR1 bits of UCSR1A
+} rx_byte_t;
+static rx_byte_t rx_fifo[SIM_RX_FIFO_SIZE];
+static uint8_t   rx_count;
+static bool      rx_reading;            // the RX ISR is reading rx_read, which left the FIFO
+static rx_byte_t rx_read;
+static bool      rx_overrun;            // a byte was lost, DOR1 is set with the next one
+
+typedef struct {
+    uint32_t end;                       // time its stop bit is received
+    uint32_t baud;
+    uint8_t  data;
+} bus_byte_t;
+static bus_byte_t bus_queue[SIM_BUS_QUEUE_SIZE];
+static uint32_t   bus_head, bus_tail;
+
+// USB
+typedef struct {
+    uint32_t at;                        // time it can be received from
+    uint8_t  nb_bytes;
+    uint8_t  data[CDC_RX_EPSIZE];
+} out_packet_t;
+static out_packet_t out_queue[SIM_OUT_QUEUE_SIZE];
+static uint32_t     out_head, out_tail;
+static uint8_t      out_bank[CDC_RX_EPSIZE], out_size, out_read;
+static bool         out_full;
+
+typedef struct {
+    uint32_t at;                        // time the host takes it
+    uint8_t  nb_bytes;
+    uint8_t  data[CDC_TX_EPSIZE];
+} in_bank_t;
+static in_bank_t in_banks[SIM_IN_BANKS]; // sent by the device, not taken by the host yet
+static uint8_t   in_nb_sent;
+static uint8_t   in_fill[CDC_TX_EPSIZE], in_fill_size;
+static uint8_t   selected_endpoint;
+static bool      host_reading = true;
+static uint32_t  host_latency = 20;
+
+static uint8_t   host_buffer[SIM_HOST_BUFFER_SIZE];
+static uint32_t  host_head, host_tail;
+
+// firmware thread
+#define TURN_TEST       0
+#define TURN_FIRMWARE   1
+static pthread_mutex_t turn_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  turn_cond = PTHREAD_COND_INITIALIZER;
+static int  turn = TURN_TEST;
+static bool halted, bootload;
+static pthread_t firmware;
+
+
+static void fail(const char* message){
+    fprintf(stderr, "sim: %s (at %u ticks)\n", message, now);
+    abort();
+}
+
+
+// ***************************** time and interrupts *****************************
+
+static uint32_t usart_baud(void){
+    return F_CPU / ((u2x ? 8UL : 16UL) * (sim_UBRR1 + 1));
+}
+
+static void usart_tick(void){
+    if (shifting && now >= shift_end){
+        bus_from_usb2ax(shift_byte, shift_baud, shift_end);
+        shifting = false;
+        if ( ! udr_full ){
+            txc = true;
+        }
+    }
+    if ( ! shifting && udr_full ){
+        shift_byte = udr_tx;
+        shift_baud = usart_baud();
+        shift_end = now + bus_byte_ticks(shift_baud);
+        shifting = true;
+        udr_full = false;
+    }
+
+    while (bus_tail != bus_head && bus_queue[bus_tail % SIM_BUS_QUEUE_SIZE].end <= now){
+        bus_byte_t* byte = &bus_queue[bus_tail++ % SIM_BUS_QUEUE_SIZE];
+        if ( ! (sim_UCSR1B & (1 << RXEN1)) ){
+            continue; // the receiver is off: lost
+        }
+        if (rx_count == SIM_RX_FIFO_SIZE){
+            rx_overrun = true;
+            continue;
+        }
+        rx_byte_t* rx = &rx_fifo[rx_count++];
+        rx->data = byte->data;
+        rx->flags = rx_overrun ? (1 << DOR1) : 0;
+        rx_overrun = false;
+        uint32_t baud = usart_baud();
+        if (byte->baud > baud + baud / 32 || byte->baud + baud / 32 < baud){ // more than ~3% off: garbage
+            rx->data ^= 0x5A;
+            rx->flags |= 1 << FE1;
+        }
+    }
+}
+
+static void usb_tick(void){
+    if ( ! out_full && out_tail != out_head && out_queue[out_tail % SIM_OUT_QUEUE_SIZE].at <= now ){
+        out_packet_t* packet = &out_queue[out_tail++ % SIM_OUT_QUEUE_SIZE];
+        memcpy(out_bank, packet->data, packet->nb_bytes);
+        out_size = packet->nb_bytes;
+        out_read = 0;
+        out_full = true;
+    }
+    if (in_nb_sent && host_reading && now >= in_banks[0].at){
+        if (host_head - host_tail + in_banks[0].nb_bytes > SIM_HOST_BUFFER_SIZE){
+            fail("the test does not read what the host receives");
+        }
+        for (uint8_t i = 0; i < in_banks[0].nb_bytes; i++){
+            host_buffer[host_head++ % SIM_HOST_BUFFER_SIZE] = in_banks[0].data[i];
+        }
+        memmove(&in_banks[0], &in_banks[1], sizeof(in_bank_t) * (SIM_IN_BANKS - 1));
+        in_nb_sent--;
+    }
+}
+
+static void tick(void){
+    now++;
+    sim_TCNT1 = now;
+    if ((uint16_t)now == 0){
+        tov1 = true;
+    }
+    if ((uint16_t)now == sim_OCR1A){
+        ocf1a = true;
+    }
+    usart_tick();
+    usb_tick();
+}
+
+// what the firmware wrote to the registers with side effects since last time
+static void apply_writes(void){
+    if (sim_UDR1 <= 0xFF){ // the values read have UDR_RX_FLAG set
+        if (sim_UCSR1B & (1 << TXEN1)){
+            if (udr_full){
+                fail("UDR1 written while full");
+            }
+            udr_tx = sim_UDR1;
+            udr_full = true;
+        }
+        sim_UDR1 = UDR_IDLE;
+    }
+
+    if (sim_UCSR1A != ucsr1a_shown){
+        u2x = sim_UCSR1A & (1 << U2X1);
+        if (sim_UCSR1A & (1 << TXC1)){ // write one to clear
+            txc = false;
+        }
+    }
+
+    if ( ! (sim_TIFR1 & TIFR_UNUSED_BIT) ){ // write one to clear
+        if (sim_TIFR1 & (1 << TOV1)){
+            tov1 = false;
+        }
+        if (sim_TIFR1 & (1 << OCF1A)){
+            ocf1a = false;
+        }
+    }
+}
+
+// update the flags the firmware reads
+static void show_flags(void){
+    uint8_t ucsr1a = (u2x ? 1 << U2X1 : 0) | (udr_full ? 0 : 1 << UDRE1); // TXC1 reads as 0, so that setting it is always a write
+    if (rx_reading){
+        ucsr1a |= (1 << RXC1) | rx_read.flags;
+    } else if (rx_count){
+        ucsr1a |= (1 << RXC1) | rx_fifo[0].flags;
+    }
+    sim_UCSR1A = ucsr1a_shown = ucsr1a;
+    sim_TIFR1 = TIFR_UNUSED_BIT | (tov1 ? 1 << TOV1 : 0) | (ocf1a ? 1 << OCF1A : 0);
+}
+
+static void run_isr(void (*isr)(void)){
+    sim_interrupts_enabled = 0;
+    show_flags();
+    isr();
+    apply_writes();
+    sim_interrupts_enabled = 1; // RETI
+}
+
+// run the interrupts which are due, highest priority (lowest vector) first
+static void dispatch(void){
+    while (sim_interrupts_enabled){
+        show_flags();
+        if (ocf1a && (sim_TIMSK1 & (1 << OCIE1A))){
+            ocf1a = false;
+            run_isr(TIMER1_COMPA_vect);
+        } else if (tov1 && (sim_TIMSK1 & (1 << TOIE1))){
+            tov1 = false;
+            run_isr(TIMER1_OVF_vect);
+        } else if (rx_count && (sim_UCSR1B & (1 << RXCIE1))){
+            // the RX ISR always reads UDR1, which takes the byte out of the FIFO: it can be done beforehand
+            rx_read = rx_fifo[0];
+            memmove(&rx_fifo[0], &rx_fifo[1], sizeof(rx_byte_t) * (SIM_RX_FIFO_SIZE - 1));
+            rx_count--;
+            rx_reading = true;
+            sim_UDR1 = UDR_RX_FLAG | rx_read.data;
+            run_isr(USART1_RX_vect);
+            rx_reading = false;
+            sim_UDR1 = UDR_IDLE;
+        } else if ( ! udr_full && (sim_UCSR1B & (1 << UDRIE1)) ){
+            run_isr(USART1_UDRE_vect);
+        } else if (txc && (sim_UCSR1B & (1 << TXCIE1))){
+            txc = false;
+            run_isr(USART1_TX_vect);
+        } else {
+            break;
+        }
+    }
+    show_flags();
+}
+
+void sim_sei(void){
+    sim_interrupts_enabled = 1;
+    dispatch();
+}
+
+// serial_write() spins on a full buffer without touching any register: let time go by for it, like the ISR would
+static void drain_usart_buffer(void){
+    uint32_t start = now;
+    while (sim_interrupts_enabled && ToUSART_Buffer.size && fifo_is_full(&ToUSART_Buffer)){
+        tick();
+        dispatch();
+        if (now - start > SIM_STUCK_TICKS){
+            fail("the USART buffer never empties");
+        }
+    }
+}
+
+// one access to a register or an endpoint
+static void poll(void){
+    apply_writes();
+    tick();
+    dispatch();
+    drain_usart_buffer();
+}
+
+volatile uint8_t* sim_reg8(volatile uint8_t* reg){
+    poll();
+    if (reg == &sim_UCSR1A || reg == &sim_TIFR1){
+        show_flags();
+    }
+    return reg;
+}
+
+volatile uint16_t* sim_reg16(volatile uint16_t* reg){
+    poll();
+    return reg;
+}
+
+volatile uint16_t* sim_tcnt1(void){
+    poll();
+    return &sim_TCNT1;
+}
+
+uint32_t sim_now(void){
+    return now;
+}
+
+
+// ***************************** USB *****************************
+
+void USB_Init(void){
+}
+
+void USB_Detach(void){
+    USB_DeviceState = DEVICE_STATE_Unattached;
+}
+
+void Endpoint_SelectEndpoint(const uint8_t Address){
+    poll();
+    selected_endpoint = Address;
+}
+
+static bool in_selected(void){
+    return selected_endpoint & ENDPOINT_DIR_IN;
+}
+
+bool Endpoint_IsINReady(void){
+    poll();
+    return in_selected() && in_nb_sent < SIM_IN_BANKS;
+}
+
+bool Endpoint_IsOUTReceived(void){
+    poll();
+    return ! in_selected() && out_full;
+}
+
+bool Endpoint_IsReadWriteAllowed(void){
+    poll();
+    return in_selected() ? (in_fill_size < CDC_TX_EPSIZE) : (out_full && out_read < out_size);
+}
+
+uint16_t Endpoint_BytesInEndpoint(void){
+    poll();
+    if (in_selected()){
+        return in_fill_size;
+    }
+    return out_full ? out_size - out_read : 0;
+}
+
+uint8_t Endpoint_Read_8(void){
+    poll();
+    if (in_selected() || ! out_full || out_read == out_size){
+        fail("Endpoint_Read_8() without data in the OUT bank");
+    }
+    return out_bank[out_read++];
+}
+
+void Endpoint_Write_8(const uint8_t Data){
+    poll();
+    if ( ! in_selected() || in_fill_size == CDC_TX_EPSIZE ){
+        fail("Endpoint_Write_8() without room in the IN bank");
+    }
+    in_fill[in_fill_size++] = Data;
+}
+
+uint8_t Endpoint_Write_Stream_LE(const void* const Buffer, uint16_t Length, uint16_t* const BytesProcessed){
+    (void)BytesProcessed;
+    for (uint16_t i = 0; i < Length; i++){
+        Endpoint_Write_8(((const uint8_t*)Buffer)[i]);
+    }
+    return 0;
+}
+
+void Endpoint_ClearIN(void){
+    poll();
+    if ( ! in_selected() || in_nb_sent == SIM_IN_BANKS ){
+        fail("Endpoint_ClearIN() without a free IN bank");
+    }
+    in_bank_t* bank = &in_banks[in_nb_sent++];
+    bank->at = now + host_latency;
+    bank->nb_bytes = in_fill_size;
+    memcpy(bank->data, in_fill, in_fill_size);
+    in_fill_size = 0;
+}
+
+void Endpoint_ClearOUT(void){
+    poll();
+    if (in_selected()){
+        fail("Endpoint_ClearOUT() on the IN endpoint");
+    }
+    out_full = false;
+}
+
+static void queue_out_packet(const uint8_t* data, uint8_t nb_bytes, uint32_t at){
+    if (out_head - out_tail == SIM_OUT_QUEUE_SIZE){
+        fail("too many OUT packets waiting");
+    }
+    out_packet_t* packet = &out_queue[out_head++ % SIM_OUT_QUEUE_SIZE];
+    packet->at = at;
+    packet->nb_bytes = nb_bytes;
+    memcpy(packet->data, data, nb_bytes);
+}
+
+void host_send_split(const uint8_t* data, uint16_t nb_bytes, uint8_t packet_size, uint32_t gap){
+    uint32_t at = now;
+    if (packet_size == 0 || packet_size > CDC_RX_EPSIZE){
+        packet_size = CDC_RX_EPSIZE;
+    }
+    while (nb_bytes){
+        uint8_t size = nb_bytes < packet_size ? nb_bytes : packet_size;
+        queue_out_packet(data, size, at);
+        data += size;
+        nb_bytes -= size;
+        at += gap;
+    }
+}
+
+void host_send(const uint8_t* data, uint16_t nb_bytes){
+    host_send_split(data, nb_bytes, CDC_RX_EPSIZE, 0);
+}
+
+bool host_sending(void){
+    return out_head != out_tail || out_full;
+}
+
+uint16_t host_received(void){
+    return host_head - host_tail;
+}
+
+uint16_t host_read(uint8_t* data, uint16_t max){
+    uint16_t nb_bytes = 0;
+    while (nb_bytes < max && host_tail != host_head){
+        data[nb_bytes++] = host_buffer[host_tail++ % SIM_HOST_BUFFER_SIZE];
+    }
+    return nb_bytes;
+}
+
+// byte at offset in what the host received and did not read yet, for dxl.c
+uint8_t host_peek(uint16_t offset){
+    return host_buffer[(host_tail + offset) % SIM_HOST_BUFFER_SIZE];
+}
+
+void host_skip(uint16_t nb_bytes){
+    host_tail += nb_bytes;
+}
+
+uint16_t host_wait(uint16_t nb_bytes, uint32_t max_ticks){
+    uint32_t start = now;
+    while (host_received() < nb_bytes && now - start < max_ticks && ! halted){
+        sim_run(1);
+    }
+    return host_received();
+}
+
+void host_flush(void){
+    host_tail = host_head;
+}
+
+void host_set_reading(bool reading){
+    host_reading = reading;
+}
+
+void host_set_latency(uint32_t ticks){
+    host_latency = ticks;
+}
+
+
+// ***************************** bus *****************************
+
+uint32_t bus_byte_ticks(uint32_t baud){
+    return (10UL * 1000000 * SIM_TICKS_PER_US + baud / 2) / baud; // 8N1: start bit, 8 bits, stop bit
+}
+
+void sim_to_usb2ax(uint8_t data, uint32_t baud, uint32_t end){
+    if (bus_head - bus_tail == SIM_BUS_QUEUE_SIZE){
+        fail("too many bytes on the bus");
+    }
+    bus_byte_t* byte = &bus_queue[bus_head++ % SIM_BUS_QUEUE_SIZE];
+    byte->end = end;
+    byte->baud = baud;
+    byte->data = data;
+}
+
+
+// ***************************** EEPROM *****************************
+
+uint8_t eeprom_read_byte(const uint8_t* addr){
+    return sim_eeprom[(uintptr_t)addr % SIM_EEPROM_SIZE];
+}
+
+uint32_t eeprom_read_dword(const uint32_t* addr){
+    uint32_t value;
+    eeprom_read_block(&value, addr, sizeof(value));
+    return value;
+}
+
+void eeprom_read_block(void* dst, const void* src, size_t n){
+    if ((uintptr_t)src + n > SIM_EEPROM_SIZE){
+        fail("EEPROM read out of range");
+    }
+    memcpy(dst, sim_eeprom + (uintptr_t)src, n);
+}
+
+void eeprom_update_byte(uint8_t* addr, uint8_t value){
+    eeprom_update_block(&value, addr, 1);
+}
+
+void eeprom_update_dword(uint32_t* addr, uint32_t value){
+    eeprom_update_block(&value, addr, sizeof(value));
+}
+
+void eeprom_update_block(const void* src, void* dst, size_t n){
+    if ((uintptr_t)dst + n > SIM_EEPROM_SIZE){
+        fail("EEPROM write out of range");
+    }
+    memcpy(sim_eeprom + (uintptr_t)dst, src, n);
+}
+
+
+// ***************************** firmware *****************************
+
+// wait for our turn, after giving it to the other thread
+static void hand_over(int to, int self){
+    pthread_mutex_lock(&turn_mutex);
+    turn = to;
+    pthread_cond_broadcast(&turn_cond);
+    while (turn != self){
+        pthread_cond_wait(&turn_cond, &turn_mutex);
+    }
+    pthread_mutex_unlock(&turn_mutex);
+}
+
+// end of a turn of the main loop
+void USB_USBTask(void){
+    poll();
+    hand_over(TURN_TEST, TURN_FIRMWARE);
+}
+
+// the watchdog reset never comes: the firmware stops there
+void Jump_To_Reset(bool bootload_wanted){
+    bootload = bootload_wanted;
+    halted = true;
+    if ( ! pthread_equal(pthread_self(), firmware) ){ // from a control request replayed by the test
+        return;
+    }
+    pthread_mutex_lock(&turn_mutex);
+    turn = TURN_TEST;
+    pthread_cond_broadcast(&turn_cond);
+    for (;;){
+        pthread_cond_wait(&turn_cond, &turn_mutex);
+    }
+}
+
+static void* firmware_thread(void* arg){
+    (void)arg;
+    hand_over(TURN_TEST, TURN_FIRMWARE); // wait for sim_boot()
+    usb2ax_main();
+    fail("main() returned");
+    return NULL;
+}
+
+void sim_run(uint32_t ticks){
+    uint32_t start = now;
+    do {
+        if (halted){
+            return;
+        }
+        hand_over(TURN_FIRMWARE, TURN_TEST);
+    } while (now - start < ticks);
+}
+
+bool sim_halted(void){
+    return halted;
+}
+
+bool sim_bootload_requested(void){
+    return halted && bootload;
+}
+
+// the control requests are handled by the USB interrupt, between two turns of the main loop: the I flag is cleared meanwhile
+static void control_request(void (*event)(USB_ClassInfo_CDC_Device_t* const)){
+    uint8_t interrupts_enabled = sim_interrupts_enabled;
+    sim_interrupts_enabled = 0;
+    event(&USB2AX_CDC_Interface);
+    if (interrupts_enabled){
+        sim_sei();
+    }
+}
+
+void sim_open_port(uint32_t baud){
+    USB2AX_CDC_Interface.State.LineEncoding.BaudRateBPS = baud;
+    control_request(EVENT_CDC_Device_LineEncodingChanged);
+    USB2AX_CDC_Interface.State.ControlLineStates.HostToDevice |= CDC_CONTROL_LINE_OUT_DTR;
+    control_request(EVENT_CDC_Device_ControLineStateChanged);
+}
+
+void sim_close_port(void){
+    USB2AX_CDC_Interface.State.ControlLineStates.HostToDevice &= ~CDC_CONTROL_LINE_OUT_DTR;
+    control_request(EVENT_CDC_Device_ControLineStateChanged);
+}
+
+void sim_boot(void){
+    pthread_create(&firmware, NULL, firmware_thread, NULL);
+    sim_run(1); // up to the first USB_USBTask()
+    EVENT_USB_Device_Connect();
+    EVENT_USB_Device_ConfigurationChanged();
+    sim_open_port(SIM_BAUD);
+    sim_run(1);
+}
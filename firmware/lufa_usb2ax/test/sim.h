@@ -0,0 +1,106 @@
+/*
+ * sim.h
+ *
+ * Host model of the hardware around the firmware, for the tests (see Makefile).
+ *
+ * The firmware runs unmodified in its own thread, but never at the same time as the test: it gets the hand from
+ * sim_run() and gives it back at each USB_USBTask(), between two turns of its main loop. Time is virtual, in ticks of
+ * TIMER1 (0.5us): each access to a register with a behaviour (see shim/avr/io.h) or to an endpoint takes one tick,
+ * and the interrupts whose flags are set run in between, in the order of their vectors, when the I flag allows it.
+ *
+ * Around it:
+ *   - USART1: UDR and shift register on the TX side, two bytes of FIFO and the shift register on the RX side,
+ *     with the byte time given by UBRR1/U2X1, overruns (DOR) and bytes at the wrong baud rate (FE)
+ *   - TIMER1: free-running, TOV1 when it wraps around, OCF1A on a compare match with OCR1A
+ *   - a USB host: sends OUT packets of up to CDC_RX_EPSIZE bytes, takes the IN banks (two of them) after a latency
+ *   - a half-duplex Dynamixel bus with virtual servos (bus.c), speaking Protocol 1.0 or 2.0
+ *   - the EEPROM, as an array the tests can preload and check
+ */
+
+#ifndef SIM_H_
+#define SIM_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define SIM_TICKS_PER_US        2
+#define SIM_TICKS_PER_MS        2000
+#define SIM_BAUD                1000000     // baud rate the port is opened at, and of the bus, unless a test changes it
+#define SIM_EEPROM_SIZE         1024
+#define SIM_HOST_BUFFER_SIZE    32768       // most bytes the host holds before the test reads them
+
+
+// firmware
+void     sim_boot(void);                    // start the firmware and open the port at SIM_BAUD, once per process
+void     sim_run(uint32_t ticks);           // let the firmware run for (at least) that long
+uint32_t sim_now(void);                     // virtual time, in ticks
+bool     sim_halted(void);                  // the firmware called Jump_To_Reset(), and won't run anymore
+bool     sim_bootload_requested(void);      // ... with bootload set
+void     sim_open_port(uint32_t baud);      // the host sets the line coding and raises DTR
+void     sim_close_port(void);              // the host drops DTR
+extern uint8_t sim_leds;
+extern uint8_t sim_eeprom[SIM_EEPROM_SIZE];
+
+// USB host
+void     host_send(const uint8_t* data, uint16_t nb_bytes);   // in packets of CDC_RX_EPSIZE bytes, right away
+void     host_send_split(const uint8_t* data, uint16_t nb_bytes, uint8_t packet_size, uint32_t gap); // gap ticks apart
+bool     host_sending(void);                // some OUT packets are still waiting for the device
+uint16_t host_received(void);               // number of bytes the host has received and not read yet
+uint16_t host_read(uint8_t* data, uint16_t max);
+uint16_t host_wait(uint16_t nb_bytes, uint32_t max_ticks); // run until that many bytes are there, return how many are
+void     host_flush(void);                  // drop everything received so far
+void     host_set_reading(bool reading);    // when false, the host stops taking the IN banks
+void     host_set_latency(uint32_t ticks);  // time between an IN bank being ready and the host taking it
+uint8_t  host_peek(uint16_t offset);        // byte at offset in what the host received and did not read yet
+void     host_skip(uint16_t nb_bytes);
+
+// Dynamixel bus, see bus.c
+typedef struct {
+    uint8_t  id;
+    uint8_t  protocol;          // 1 or 2
+    uint8_t  table[256];        // control table
+    uint32_t return_delay;      // ticks between the end of an instruction and the start of the reply
+    bool     mute;              // never answers
+    bool     corrupt;           // answers with a bad checksum (Protocol 1.0) or CRC (2.0)
+    uint8_t  truncate;          // number of bytes missing at the end of its replies
+    uint8_t  error;             // error byte of its replies
+    uint32_t nb_instructions;   // valid instructions addressed to it, broadcast included
+} servo_t;
+
+#define BUS_MAX_SERVOS          128
+#define BUS_RETURN_DELAY        20          // default return delay, in ticks
+
+servo_t* bus_add_servo(uint8_t id, uint8_t protocol);
+void     bus_set_baud(uint32_t baud);       // baud rate of the servos
+uint16_t bus_sent(uint8_t* data, uint16_t max); // bytes the USB2AX sent on the bus since last time
+void     bus_reply(const uint8_t* data, uint16_t nb_bytes, uint32_t delay); // put bytes on the bus, delay ticks from now
+extern uint32_t bus_bad_packets;            // instructions the servos dropped because of their checksum or CRC
+extern uint32_t bus_collisions;             // bytes the USB2AX sent while a servo was replying
+
+// used by sim.c and bus.c
+void     bus_from_usb2ax(uint8_t data, uint32_t baud, uint32_t end);
+void     sim_to_usb2ax(uint8_t data, uint32_t baud, uint32_t end);
+uint32_t bus_byte_ticks(uint32_t baud);
+
+// Dynamixel packets, see dxl.c
+#define DXL_MAX_PACKET          1024
+
+uint8_t  dxl_checksum(const uint8_t* data, uint16_t nb_bytes);     // of a Protocol 1.0 packet, from the ID to the parameters
+uint16_t dxl_crc(uint16_t crc, const uint8_t* data, uint16_t nb_bytes); // Protocol 2.0 CRC, computed bit by bit
+uint16_t dxl_packet1(uint8_t* packet, uint8_t id, uint8_t instruction, const uint8_t* params, uint8_t nb_params);
+uint16_t dxl_packet2(uint8_t* packet, uint8_t id, uint8_t instruction, const uint8_t* params, uint16_t nb_params);
+uint16_t dxl_unstuff(uint8_t* data, uint16_t nb_bytes);
+
+typedef struct {
+    uint8_t  id;
+    uint8_t  error;
+    uint8_t  params[DXL_MAX_PACKET];
+    uint16_t nb_params;
+    bool     valid;             // checksum or CRC right
+} dxl_status_t;
+
+// wait for the next bytes the host receives to make a status packet and take them: false if they don't
+bool     host_status1(dxl_status_t* status, uint32_t max_ticks);
+bool     host_status2(dxl_status_t* status, uint32_t max_ticks);
+
+#endif /* SIM_H_ */
@@ -0,0 +1,891 @@
+/*
+ * test_usb2ax.c
+ *
+ * Tests of the firmware on the host model (see sim.h): what the host gets back for what it sends, and what goes
+ * on the bus. Each test runs in its own process, on a freshly booted firmware.
+ *
+ *   test_usb2ax [name]     run all the tests, or only those whose name contains name
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "sim.h"
+#include "../AX.h"
+#include "../AX2.h"
+
+#define REPLY_TICKS     (20 * SIM_TICKS_PER_MS)     // longest wait for a status packet
+#define SCAN_TICKS      (100 * SIM_TICKS_PER_MS)    // longest wait for the reply to a SCAN of every ID
+#define TEST_TIME_LIMIT 60                          // seconds of real time for a test
+
+extern uint8_t ax_state;
+extern uint8_t passthrough_mode;
+
+#define CHECK(condition) do { \
+    if ( ! (condition) ){ \
+        fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+        exit(1); \
+    } \
+} while (0)
+
+#define CHECK_EQ(a, b) do { \
+    long check_a = (a), check_b = (b); \
+    if (check_a != check_b){ \
+        fprintf(stderr, "%s:%d: check failed: %s == %s (%ld != %ld)\n", __FILE__, __LINE__, #a, #b, check_a, check_b); \
+        exit(1); \
+    } \
+} while (0)
+
+#define CHECK_BYTES(data, nb_bytes, ...) do { \
+    const uint8_t check_expected[] = { __VA_ARGS__ }; \
+    CHECK_EQ(nb_bytes, sizeof(check_expected)); \
+    CHECK(memcmp(data, check_expected, sizeof(check_expected)) == 0); \
+} while (0)
+
+
+// ***************************** helpers *****************************
+
+static uint8_t packet[DXL_MAX_PACKET + 16];
+static uint8_t bytes[DXL_MAX_PACKET];
+static dxl_status_t status;
+
+static void send1(uint8_t id, uint8_t instruction, const uint8_t* params, uint8_t nb_params){
+    host_send(packet, dxl_packet1(packet, id, instruction, params, nb_params));
+}
+
+static void send2(uint8_t id, uint8_t instruction, const uint8_t* params, uint16_t nb_params){
+    host_send(packet, dxl_packet2(packet, id, instruction, params, nb_params));
+}
+
+static void print_bytes(const char* name, const uint8_t* data, uint16_t nb_bytes){
+    fprintf(stderr, "%s:", name);
+    for (uint16_t i = 0; i < nb_bytes; i++){
+        fprintf(stderr, " %02X", data[i]);
+    }
+    fprintf(stderr, "\n");
+}
+
+static void check_status(uint8_t error, const uint8_t* params, uint16_t nb_params){
+    CHECK(status.valid);
+    CHECK_EQ(status.id, AX_ID_DEVICE);
+    if (status.error != error || status.nb_params != nb_params || (nb_params && memcmp(status.params, params, nb_params))){
+        fprintf(stderr, "status packet: error %02X, expected %02X\n", status.error, error);
+        print_bytes("  parameters", status.params, status.nb_params);
+        print_bytes("  expected  ", params, nb_params);
+        exit(1);
+    }
+}
+
+// the next status packet of the USB2AX, in Protocol 1.0
+static void expect_status1(uint8_t error, const uint8_t* params, uint16_t nb_params){
+    CHECK(host_status1(&status, REPLY_TICKS));
+    check_status(error, params, nb_params);
+}
+
+static void expect_status2(uint8_t error, const uint8_t* params, uint16_t nb_params){
+    CHECK(host_status2(&status, REPLY_TICKS));
+    check_status(error, params, nb_params);
+}
+
+// nothing comes back for that long
+static void expect_silence(uint32_t ticks){
+    sim_run(ticks);
+    CHECK_EQ(host_received(), 0);
+}
+
+static void expect_ping(void){
+    send1(AX_ID_DEVICE, AX_CMD_PING, NULL, 0);
+    expect_status1(AX_ERROR_NONE, NULL, 0);
+}
+
+static uint8_t reg_read(uint8_t addr){
+    uint8_t params[] = { addr, 1 };
+    send1(AX_ID_DEVICE, AX_CMD_READ_DATA, params, sizeof(params));
+    CHECK(host_status1(&status, REPLY_TICKS));
+    CHECK(status.valid);
+    CHECK_EQ(status.error, AX_ERROR_NONE);
+    CHECK_EQ(status.nb_params, 1);
+    return status.params[0];
+}
+
+static void reg_write(uint8_t addr, uint8_t value, uint8_t error){
+    uint8_t params[] = { addr, value };
+    send1(AX_ID_DEVICE, AX_CMD_WRITE_DATA, params, sizeof(params));
+    expect_status1(error, NULL, 0);
+}
+
+// what went on the bus since last time, once it is quiet
+static uint16_t bus_take(uint8_t* data){
+    sim_run(2 * SIM_TICKS_PER_MS);
+    return bus_sent(data, DXL_MAX_PACKET);
+}
+
+static void boot(void){
+    sim_boot();
+    CHECK_EQ(host_received(), 0);
+}
+
+
+// ***************************** Protocol 1.0, local commands *****************************
+
+static void test_ping(void){
+    boot();
+    const uint8_t ping[] = { 0xFF, 0xFF, 0xFD, 0x02, 0x01, 0xFF };
+    host_send(ping, sizeof(ping));
+    CHECK_EQ(host_wait(6, REPLY_TICKS), 6);
+    CHECK_EQ(host_read(bytes, sizeof(bytes)), 6);
+    CHECK_BYTES(bytes, 6, 0xFF, 0xFF, 0xFD, 0x02, 0x00, 0x00);
+    expect_silence(SIM_TICKS_PER_MS);
+    CHECK_EQ(bus_take(bytes), 0);
+    CHECK_EQ(stat_get(STAT_PACKETS), 1);
+    CHECK_EQ(stat_get(STAT_LOCAL_COMMANDS), 1);
+}
+
+static void test_registers(void){
+    boot();
+    uint8_t params[] = { ADDR_MODEL_NUMBER_L, 4 };
+    send1(AX_ID_DEVICE, AX_CMD_READ_DATA, params, sizeof(params));
+    const uint8_t model[] = { MODEL_NUMBER_L, MODEL_NUMBER_H, FIRMWARE_VERSION, AX_ID_DEVICE };
+    expect_status1(AX_ERROR_NONE, model, sizeof(model));
+    CHECK_EQ(reg_read(ADDR_USART_TIMEOUT), USART_TIMEOUT);
+    CHECK_EQ(reg_read(ADDR_RECEIVE_TIMEOUT), RECEIVE_TIMEOUT);
+
+    // saved in EEPROM
+    reg_write(ADDR_USART_TIMEOUT, 30, AX_ERROR_NONE);
+    CHECK_EQ(reg_read(ADDR_USART_TIMEOUT), 30);
+    CHECK_EQ(sim_eeprom[ADDR_USART_TIMEOUT], 30);
+    CHECK_BYTES(sim_eeprom, 4, 0xEF, 0xBE, 0x02, 0x01);
+
+    // out of range
+    reg_write(ADDR_USART_TIMEOUT, 7, AX_ERROR_RANGE);
+    reg_write(ADDR_RECEIVE_TIMEOUT, 9, AX_ERROR_RANGE);
+    reg_write(ADDR_FIRMWARE_VERSION, 9, AX_ERROR_RANGE);
+    CHECK_EQ(reg_read(ADDR_USART_TIMEOUT), 30);
+    uint8_t too_far[] = { REG_TABLE_SIZE - 1, 2 };
+    send1(AX_ID_DEVICE, AX_CMD_READ_DATA, too_far, sizeof(too_far));
+    expect_status1(AX_ERROR_RANGE, NULL, 0);
+    uint8_t nothing[] = { ADDR_USART_TIMEOUT, 0 };
+    send1(AX_ID_DEVICE, AX_CMD_READ_DATA, nothing, sizeof(nothing));
+    expect_status1(AX_ERROR_RANGE, NULL, 0);
+
+    // the statistics can only be cleared
+    CHECK(stat_get(STAT_PACKETS) > 0);
+    reg_write(STAT_PACKETS, 1, AX_ERROR_RANGE);
+    reg_write(STAT_PACKETS, 0, AX_ERROR_NONE); // counted before it runs
+    CHECK_EQ(stat_get(STAT_PACKETS), 0);
+    CHECK_EQ(reg_read(STAT_PACKETS), 1);
+}
+
+static void test_eeprom_current(void){
+    const uint8_t magic[] = { 0xEF, 0xBE, 0x02, 0x01 };
+    memcpy(sim_eeprom, magic, sizeof(magic));
+    memset(sim_eeprom + ADDR_USART_TIMEOUT, 0, ADDR_STATS - ADDR_USART_TIMEOUT);
+    sim_eeprom[ADDR_USART_TIMEOUT] = 30;
+    sim_eeprom[ADDR_RECEIVE_TIMEOUT] = 40;
+    boot();
+    CHECK_EQ(regs[ADDR_USART_TIMEOUT], 30);
+    CHECK_EQ(regs[ADDR_RECEIVE_TIMEOUT], 40);
+    expect_ping();
+}
+
+static void test_eeprom_older_layout(void){
+    const uint8_t magic[] = { 0xEF, 0xBE, 0x01, 0x01 }; // before the statistics moved to 18
+    memcpy(sim_eeprom, magic, sizeof(magic));
+    memset(sim_eeprom + ADDR_USART_TIMEOUT, 0, ADDR_STATS - ADDR_USART_TIMEOUT);
+    boot();
+    CHECK_EQ(regs[ADDR_USART_TIMEOUT], USART_TIMEOUT);
+    CHECK_EQ(regs[ADDR_RECEIVE_TIMEOUT], RECEIVE_TIMEOUT);
+    expect_ping();
+}
+
+static void test_bad_checksum(void){
+    boot();
+    uint8_t params[] = { ADDR_USART_TIMEOUT, 1 };
+    uint16_t size = dxl_packet1(packet, AX_ID_DEVICE, AX_CMD_READ_DATA, params, sizeof(params));
+    packet[size - 1] ^= 0x10;
+    host_send(packet, size);
+    expect_silence(5 * SIM_TICKS_PER_MS);
+    CHECK_EQ(stat_get(STAT_CHECKSUM_ERRORS), 1);
+    CHECK_EQ(stat_get(STAT_LOCAL_COMMANDS), 0);
+    // not for the USB2AX after all: it goes to the bus
+    uint8_t sent[DXL_MAX_PACKET];
+    CHECK_EQ(bus_take(sent), size);
+    CHECK(memcmp(sent, packet, size) == 0);
+
+    const uint8_t bad_ping[] = { 0xFF, 0xFF, 0xFD, 0x02, 0x01, 0xFE };
+    host_send(bad_ping, sizeof(bad_ping));
+    expect_silence(5 * SIM_TICKS_PER_MS);
+    CHECK_EQ(stat_get(STAT_CHECKSUM_ERRORS), 2);
+    expect_ping();
+}
+
+static void test_too_long(void){
+    boot();
+    const uint8_t too_long[] = { 0xFF, 0xFF, 0xFD, 0xF0, 0x02 };
+    host_send(too_long, sizeof(too_long));
+    expect_status1(AX_ERROR_RANGE, NULL, 0);
+    expect_ping();
+}
+
+
+// ***************************** Protocol 1.0, passthrough *****************************
+
+static void test_passthrough(void){
+    servo_t* servo = bus_add_servo(1, 1);
+    servo->table[36] = 0x34;
+    servo->table[37] = 0x12;
+    boot();
+    uint8_t params[] = { 36, 2 };
+    uint16_t size = dxl_packet1(packet, 1, AX_CMD_READ_DATA, params, sizeof(params));
+    host_send(packet, size);
+    CHECK(host_status1(&status, REPLY_TICKS));
+    CHECK(status.valid);
+    CHECK_EQ(status.id, 1);
+    CHECK_EQ(status.nb_params, 2);
+    CHECK_BYTES(status.params, status.nb_params, 0x34, 0x12);
+    uint8_t sent[DXL_MAX_PACKET];
+    CHECK_EQ(bus_take(sent), size);
+    CHECK(memcmp(sent, packet, size) == 0);
+    CHECK_EQ(stat_get(STAT_BYTES_TO_BUS), size);
+    CHECK_EQ(stat_get(STAT_BYTES_FROM_BUS), 8);
+    CHECK_EQ(stat_get(STAT_PACKETS), 1);
+    CHECK_EQ(stat_get(STAT_LOCAL_COMMANDS), 0);
+    CHECK(stat_get(STAT_USART_HIGH_WATER) > 0 && stat_get(STAT_USART_HIGH_WATER) <= size);
+    CHECK_EQ(bus_collisions, 0);
+
+    // broadcast WRITE: on the bus as is, no reply
+    uint8_t write[] = { 30, 0x00, 0x02 };
+    size = dxl_packet1(packet, AX_ID_BROADCAST, AX_CMD_WRITE_DATA, write, sizeof(write));
+    host_send(packet, size);
+    expect_silence(5 * SIM_TICKS_PER_MS);
+    CHECK_EQ(bus_take(sent), size);
+    CHECK_EQ(servo->table[31], 0x02);
+}
+
+static void test_noise(void){
+    boot();
+    const uint8_t noise[] = { 'a', 'b', 0x00, 0xFF, 0x01, 0xFE, 0xFF, 0xFF, 0xFF, 0xFF, 0x07, 0x12, 0xFF };
+    host_send(noise, sizeof(noise));
+    sim_run(5 * SIM_TICKS_PER_MS); // the last 0xFF waits for the receive timeout
+    uint8_t sent[DXL_MAX_PACKET];
+    uint16_t size = bus_take(sent);
+    CHECK_EQ(size, sizeof(noise));
+    CHECK(memcmp(sent, noise, size) == 0);
+    CHECK_EQ(host_received(), 0);
+    CHECK_EQ(ax_state, 0);
+    expect_ping();
+}
+
+static void test_split_packets(void){
+    servo_t* servo = bus_add_servo(1, 1);
+    servo->table[3] = 1;
+    boot();
+    // a byte per USB packet, with gaps shorter than the receive timeout
+    uint16_t size = dxl_packet1(packet, AX_ID_DEVICE, AX_CMD_PING, NULL, 0);
+    host_send_split(packet, size, 1, SIM_TICKS_PER_MS);
+    expect_status1(AX_ERROR_NONE, NULL, 0);
+
+    uint8_t params[] = { ADDR_USART_TIMEOUT, 3 };
+    size = dxl_packet1(packet, AX_ID_DEVICE, AX_CMD_READ_DATA, params, sizeof(params));
+    host_send_split(packet, size, 3, SIM_TICKS_PER_MS);
+    const uint8_t timeouts[] = { USART_TIMEOUT, SEND_TIMEOUT, RECEIVE_TIMEOUT };
+    expect_status1(AX_ERROR_NONE, timeouts, sizeof(timeouts));
+
+    // to a servo
+    uint8_t read[] = { 3, 1 };
+    size = dxl_packet1(packet, 1, AX_CMD_READ_DATA, read, sizeof(read));
+    host_send_split(packet, size, 1, SIM_TICKS_PER_MS);
+    CHECK(host_status1(&status, REPLY_TICKS));
+    CHECK(status.valid);
+    CHECK_EQ(status.id, 1);
+    CHECK_BYTES(status.params, status.nb_params, 1);
+
+    // two packets in the same USB packet
+    size = dxl_packet1(packet, AX_ID_DEVICE, AX_CMD_PING, NULL, 0);
+    size += dxl_packet1(packet + size, AX_ID_DEVICE, AX_CMD_PING, NULL, 0);
+    host_send(packet, size);
+    expect_status1(AX_ERROR_NONE, NULL, 0);
+    expect_status1(AX_ERROR_NONE, NULL, 0);
+}
+
+static void test_receive_timeout(void){
+    bus_add_servo(1, 1);
+    boot();
+    uint32_t timeout = RECEIVE_TIMEOUT * TIMER_TICKS_PER_TIMEOUT_UNIT;
+
+    // for the USB2AX: the start is passed on when the rest does not come
+    const uint8_t partial[] = { 0xFF, 0xFF, 0xFD, 0x04, 0x02, ADDR_USART_TIMEOUT };
+    host_send(partial, sizeof(partial));
+    sim_run(timeout / 2);
+    CHECK_EQ(bus_sent(bytes, sizeof(bytes)), 0);
+    uint8_t sent[DXL_MAX_PACKET];
+    uint16_t size = bus_take(sent);
+    CHECK_BYTES(sent, size, 0xFF, 0xFF, 0xFD, 0x04, 0x02, ADDR_USART_TIMEOUT);
+    CHECK_EQ(ax_state, 0);
+    CHECK_EQ(host_received(), 0);
+    expect_ping();
+
+    // for a servo: passed on as it comes, once
+    const uint8_t to_servo[] = { 0xFF, 0xFF, 0x01, 0x04, 0x02 };
+    host_send(to_servo, sizeof(to_servo));
+    sim_run(timeout + 2 * SIM_TICKS_PER_MS);
+    size = bus_take(sent);
+    CHECK_BYTES(sent, size, 0xFF, 0xFF, 0x01, 0x04, 0x02);
+    CHECK_EQ(ax_state, 0);
+    expect_ping();
+
+    // Protocol 2.0, for a servo
+    const uint8_t to_servo2[] = { 0xFF, 0xFF, 0xFD, 0x00, 0x01, 0x07, 0x00, 0x02, 0x24 };
+    host_send(to_servo2, sizeof(to_servo2));
+    sim_run(timeout + 2 * SIM_TICKS_PER_MS);
+    size = bus_take(sent);
+    CHECK_BYTES(sent, size, 0xFF, 0xFF, 0xFD, 0x00, 0x01, 0x07, 0x00, 0x02, 0x24);
+    CHECK_EQ(ax_state, 0);
+    expect_ping();
+}
+
+static void test_host_not_reading(void){
+    servo_t* servo = bus_add_servo(1, 1);
+    boot();
+    host_set_reading(false);
+    uint8_t params[] = { 0, 200 };
+    for (uint8_t i = 0; i < 5; i++){
+        send1(1, AX_CMD_READ_DATA, params, sizeof(params));
+        sim_run(5 * SIM_TICKS_PER_MS);
+    }
+    CHECK_EQ(servo->nb_instructions, 5);
+    CHECK(stat_get(STAT_USB_OVERFLOWS) > 0);
+    CHECK_EQ(stat_get(STAT_USB_HIGH_WATER), ARENA_SIZE);
+
+    host_set_reading(true);
+    sim_run(10 * SIM_TICKS_PER_MS);
+    CHECK(host_received() > 0);
+    host_flush();
+    expect_ping();
+}
+
+
+// ***************************** sync_read, bulk_read, STREAM *****************************
+
+static void add_servos(uint8_t first, uint8_t nb_servos){
+    for (uint8_t i = 0; i < nb_servos; i++){
+        servo_t* servo = bus_add_servo(first + i, 1);
+        for (uint16_t addr = 0; addr < 256; addr++){
+            servo->table[addr] = first + i + addr;
+        }
+    }
+}
+
+static void test_sync_read(void){
+    add_servos(1, 3);
+    bus_add_servo(4, 1)->mute = true;
+    bus_add_servo(5, 1)->corrupt = true;
+    boot();
+    uint8_t params[] = { 36, 2, 1, 2, 3 };
+    send1(AX_ID_DEVICE, AX_CMD_SYNC_READ, params, sizeof(params));
+    const uint8_t data[] = { 37, 38, 38, 39, 39, 40 };
+    expect_status1(AX_ERROR_NONE, data, sizeof(data));
+    CHECK_EQ(stat_get(STAT_LOCAL_COMMANDS), 1);
+    CHECK_EQ(bus_collisions, 0);
+
+    // the READ_DATA instructions on the bus
+    uint8_t sent[DXL_MAX_PACKET];
+    uint16_t size = bus_take(sent);
+    CHECK_EQ(size, 3 * 8);
+    for (uint8_t i = 0; i < 3; i++){
+        uint8_t read[] = { 36, 2 };
+        dxl_packet1(packet, 1 + i, AX_CMD_READ_DATA, read, sizeof(read));
+        CHECK(memcmp(sent + 8 * i, packet, 8) == 0);
+    }
+
+    // a servo which does not answer, or answers wrong, gets 0xFF
+    uint8_t failing[] = { 36, 2, 4, 1, 5 };
+    send1(AX_ID_DEVICE, AX_CMD_SYNC_READ, failing, sizeof(failing));
+    const uint8_t padded[] = { 0xFF, 0xFF, 37, 38, 0xFF, 0xFF };
+    expect_status1(AX_ERROR_NONE, padded, sizeof(padded));
+    CHECK_EQ(stat_get(STAT_SERVO_TIMEOUTS), 1);
+
+    // with the status of each servo
+    reg_write(ADDR_OPTIONS, OPTION_SERVO_STATUS, AX_ERROR_NONE);
+    send1(AX_ID_DEVICE, AX_CMD_SYNC_READ, failing, sizeof(failing));
+    const uint8_t with_status[] = { 0xFF, 0xFF, AX_STATUS_TIMEOUT, 37, 38, 0, 0xFF, 0xFF, AX_STATUS_CHECKSUM };
+    expect_status1(AX_ERROR_NONE, with_status, sizeof(with_status));
+
+    // the next command waits for the end of the sync_read
+    size = dxl_packet1(packet, AX_ID_DEVICE, AX_CMD_SYNC_READ, params, sizeof(params));
+    size += dxl_packet1(packet + size, AX_ID_DEVICE, AX_CMD_PING, NULL, 0);
+    host_send(packet, size);
+    const uint8_t data_status[] = { 37, 38, 0, 38, 39, 0, 39, 40, 0 };
+    expect_status1(AX_ERROR_NONE, data_status, sizeof(data_status));
+    expect_status1(AX_ERROR_NONE, NULL, 0);
+
+    // too much to read
+    uint8_t too_much[] = { 0, AX_BUFFER_SIZE, 1 };
+    send1(AX_ID_DEVICE, AX_CMD_SYNC_READ, too_much, sizeof(too_much));
+    expect_status1(AX_ERROR_RANGE, NULL, 0);
+    CHECK_EQ(sync_read_state, SYNC_READ_IDLE);
+
+    // no servo to read
+    uint8_t no_servo[] = { 36, 2 };
+    send1(AX_ID_DEVICE, AX_CMD_SYNC_READ, no_servo, sizeof(no_servo));
+    expect_status1(AX_ERROR_RANGE, NULL, 0);
+}
+
+// a servo which keeps failing is skipped, even when more servos than there are slots to track them are read
+static void test_adaptive_timeouts(void){
+    add_servos(1, AX_ADAPTIVE_SLOTS + 6);
+    servo_t* mute = bus_add_servo(100, 1);
+    mute->mute = true;
+    boot();
+    reg_write(ADDR_OPTIONS, OPTION_ADAPTIVE_TIMEOUTS, AX_ERROR_NONE);
+    uint8_t params[2 + AX_ADAPTIVE_SLOTS + 7] = { 36, 1, 100 };
+    for (uint8_t i = 0; i < AX_ADAPTIVE_SLOTS + 6; i++){
+        params[3 + i] = 1 + i;
+    }
+    for (uint8_t read = 0; read < AX_DEAD_THRESHOLD; read++){
+        send1(AX_ID_DEVICE, AX_CMD_SYNC_READ, params, sizeof(params));
+        CHECK(host_status1(&status, REPLY_TICKS));
+        CHECK_EQ(status.error, AX_ERROR_NONE);
+        CHECK_EQ(status.params[0], 0xFF);
+    }
+    CHECK_EQ(mute->nb_instructions, AX_DEAD_THRESHOLD);
+
+    // in back-off: not asked anymore, and the reply says so
+    send1(AX_ID_DEVICE, AX_CMD_SYNC_READ, params, sizeof(params));
+    CHECK(host_status1(&status, REPLY_TICKS));
+    CHECK_EQ(status.error, AX_ERROR_SKIPPED);
+    CHECK_EQ(status.nb_params, AX_ADAPTIVE_SLOTS + 7);
+    CHECK_EQ(status.params[0], 0xFF);
+    CHECK_EQ(status.params[1], 1 + 36);
+    CHECK_EQ(mute->nb_instructions, AX_DEAD_THRESHOLD);
+}
+
+static void test_sync_read_continued(void){
+    add_servos(1, 30);
+    boot();
+    uint8_t params[2 + 30] = { 10, 10 };
+    for (uint8_t i = 0; i < 30; i++){
+        params[2 + i] = 1 + i;
+    }
+    send1(AX_ID_DEVICE, AX_CMD_SYNC_READ, params, sizeof(params));
+
+    // (235 - 6) / 10 servos per packet
+    uint8_t expected[30 * 10];
+    for (uint8_t i = 0; i < 30; i++){
+        for (uint8_t j = 0; j < 10; j++){
+            expected[10 * i + j] = 1 + i + 10 + j;
+        }
+    }
+    expect_status1(AX_ERROR_CONTINUED, expected, 22 * 10);
+    expect_status1(AX_ERROR_NONE, expected + 22 * 10, 8 * 10);
+    expect_silence(SIM_TICKS_PER_MS);
+    CHECK_EQ(stat_get(STAT_SERVO_TIMEOUTS), 0);
+    CHECK_EQ(bus_collisions, 0);
+    expect_ping();
+}
+
+static void test_sync_write_read(void){
+    add_servos(1, 2);
+    boot();
+    // SYNC_WRITE of 30 to servos 1 and 2, then sync_read of 30 from them
+    uint8_t params[] = { 2, 30, 2, 1, 0x10, 0x11, 2, 0x20, 0x21, 30, 2, 1, 2 };
+    send1(AX_ID_DEVICE, AX_CMD_WRITE_READ, params, sizeof(params));
+    const uint8_t data[] = { 0x10, 0x11, 0x20, 0x21 };
+    expect_status1(AX_ERROR_NONE, data, sizeof(data));
+
+    uint8_t bad[] = { 3, 30, 2, 1, 0x10, 0x11, 30, 2, 1 };
+    send1(AX_ID_DEVICE, AX_CMD_WRITE_READ, bad, sizeof(bad));
+    expect_status1(AX_ERROR_RANGE, NULL, 0);
+
+    uint8_t nothing_to_read[] = { 2, 30, 2, 1, 0x10, 0x11, 2, 0x20, 0x21, 30, 2 };
+    send1(AX_ID_DEVICE, AX_CMD_WRITE_READ, nothing_to_read, sizeof(nothing_to_read));
+    expect_status1(AX_ERROR_RANGE, NULL, 0);
+}
+
+static void test_bulk_read(void){
+    add_servos(1, 3);
+    boot();
+    uint8_t params[] = { 1, 36, 2, 2, 40, 1, 9, 0, 1, 3, 10, 3 };
+    send1(AX_ID_DEVICE, AX_CMD_BULK_READ, params, sizeof(params));
+    const uint8_t data[] = { 37, 38, 42, 0xFF, 13, 14, 15 };
+    expect_status1(AX_ERROR_NONE, data, sizeof(data));
+    CHECK_EQ(stat_get(STAT_SERVO_TIMEOUTS), 1);
+
+    uint8_t not_triples[] = { 1, 36 };
+    send1(AX_ID_DEVICE, AX_CMD_BULK_READ, not_triples, sizeof(not_triples));
+    expect_status1(AX_ERROR_RANGE, NULL, 0);
+    uint8_t too_much[] = { 1, 0, 120, 2, 0, 120 };
+    send1(AX_ID_DEVICE, AX_CMD_BULK_READ, too_much, sizeof(too_much));
+    expect_status1(AX_ERROR_RANGE, NULL, 0);
+}
+
+static void test_group(void){
+    add_servos(1, 3);
+    boot();
+    uint8_t set_read[] = { 2, AX_GROUP_READ, 36, 2, 3, 1 };
+    send1(AX_ID_DEVICE, AX_CMD_GROUP_SET, set_read, sizeof(set_read));
+    expect_status1(AX_ERROR_NONE, NULL, 0);
+    uint8_t* record = sim_eeprom + 0x40 + 2 * AX_GROUP_SIZE;
+    CHECK_BYTES(record, 6, 2, AX_GROUP_READ, 36, 2, 3, 1);
+
+    uint8_t run_read[] = { 2 };
+    send1(AX_ID_DEVICE, AX_CMD_GROUP_RUN, run_read, sizeof(run_read));
+    const uint8_t data[] = { 39, 40, 37, 38 };
+    expect_status1(AX_ERROR_NONE, data, sizeof(data));
+
+    uint8_t set_write[] = { 0, AX_GROUP_WRITE, 30, 1, 1, 2 };
+    send1(AX_ID_DEVICE, AX_CMD_GROUP_SET, set_write, sizeof(set_write));
+    expect_status1(AX_ERROR_NONE, NULL, 0);
+    bus_take(bytes);
+    uint8_t run_write[] = { 0, 0xA1, 0xA2 };
+    send1(AX_ID_DEVICE, AX_CMD_GROUP_RUN, run_write, sizeof(run_write));
+    expect_silence(5 * SIM_TICKS_PER_MS);
+    uint8_t sent[DXL_MAX_PACKET];
+    uint16_t size = bus_take(sent);
+    uint8_t sync_write[] = { 30, 1, 1, 0xA1, 2, 0xA2 };
+    CHECK_EQ(size, dxl_packet1(packet, AX_ID_BROADCAST, AX_CMD_SYNC_WRITE, sync_write, sizeof(sync_write)));
+    CHECK(memcmp(sent, packet, size) == 0);
+
+    uint8_t unknown[] = { 5 };
+    send1(AX_ID_DEVICE, AX_CMD_GROUP_RUN, unknown, sizeof(unknown));
+    expect_status1(AX_ERROR_RANGE, NULL, 0);
+    uint8_t wrong_size[] = { 0, 0xA1 };
+    send1(AX_ID_DEVICE, AX_CMD_GROUP_RUN, wrong_size, sizeof(wrong_size));
+    expect_status1(AX_ERROR_RANGE, NULL, 0);
+}
+
+static void test_scan(void){
+    bus_add_servo(1, 1);
+    bus_add_servo(3, 1)->error = 0x20;
+    servo_t* servo = bus_add_servo(9, 1);
+    boot();
+    uint8_t params[] = { 0, 7, 0 };
+    send1(AX_ID_DEVICE, AX_CMD_SCAN, params, sizeof(params));
+    const uint8_t found[] = { AX_BAUD_CURRENT, 0x0A, 0x00, 0x20 };
+    expect_status1(AX_ERROR_NONE, found, sizeof(found));
+
+    // at 500000 bauds (code 3), then at 1000000 (code 1)
+    bus_set_baud(500000);
+    uint8_t bauds[] = { 0, 3, 10, 3, 1 };
+    send1(AX_ID_DEVICE, AX_CMD_SCAN, bauds, sizeof(bauds));
+    const uint8_t at_500000[] = { 3, 0x0A, 0x00, 0x20 };
+    expect_status1(AX_ERROR_NONE, at_500000, sizeof(at_500000));
+    const uint8_t at_1000000[] = { 1, 0x00 };
+    expect_status1(AX_ERROR_NONE, at_1000000, sizeof(at_1000000));
+
+    uint8_t backwards[] = { 7, 0, 0 };
+    send1(AX_ID_DEVICE, AX_CMD_SCAN, backwards, sizeof(backwards));
+    expect_status1(AX_ERROR_RANGE, NULL, 0);
+
+    // what the host sent before the SCAN goes out at the baud rate it was meant for, before it changes
+    bus_set_baud(SIM_BAUD);
+    uint8_t write[] = { 30, 0x55 };
+    uint16_t size = dxl_packet1(packet, AX_ID_BROADCAST, AX_CMD_WRITE_DATA, write, sizeof(write));
+    uint8_t at_500000_only[] = { 0, 0, 0, 3 };
+    size += dxl_packet1(packet + size, AX_ID_DEVICE, AX_CMD_SCAN, at_500000_only, sizeof(at_500000_only));
+    host_send(packet, size);
+    const uint8_t none[] = { 3, 0x00 };
+    expect_status1(AX_ERROR_NONE, none, sizeof(none));
+    CHECK_EQ(servo->table[30], 0x55);
+}
+
+static void test_stream(void){
+    add_servos(1, 2);
+    bus_add_servo(3, 1)->mute = true;
+    boot();
+    uint8_t params[] = { 50, 0, 36, 2, 1, 2, 3 }; // every 5ms, longer than the timeout of the mute servo
+    send1(AX_ID_DEVICE, AX_CMD_STREAM, params, sizeof(params));
+    expect_status1(AX_ERROR_NONE, NULL, 0);
+
+    uint32_t previous_time = 0;
+    for (uint8_t frame = 0; frame < 5; frame++){
+        CHECK(host_status1(&status, REPLY_TICKS));
+        CHECK(status.valid);
+        CHECK_EQ(status.error, AX_ERROR_NONE);
+        CHECK_EQ(status.nb_params, AX_STREAM_HEADER_SIZE + 3 * 2);
+        CHECK_EQ(status.params[0], frame);
+        uint32_t time = status.params[1] | (status.params[2] << 8) | (status.params[3] << 16) | ((uint32_t)status.params[4] << 24);
+        if (frame){ // on the grid, give or take a turn of the main loop
+            CHECK(time - previous_time > 50 * AX_STREAM_PERIOD_UNIT - 100);
+            CHECK(time - previous_time < 50 * AX_STREAM_PERIOD_UNIT + 100);
+        }
+        previous_time = time;
+        CHECK_BYTES(status.params + AX_STREAM_HEADER_SIZE, status.nb_params - AX_STREAM_HEADER_SIZE, 37, 38, 38, 39, 0xFF, 0xFF);
+    }
+
+    // the commands keep working in between the frames
+    send1(AX_ID_DEVICE, AX_CMD_PING, NULL, 0);
+    while (host_status1(&status, REPLY_TICKS) && status.nb_params){
+    }
+    CHECK(status.valid);
+    CHECK_EQ(status.nb_params, 0);
+
+    // stopped by the host
+    send1(AX_ID_DEVICE, AX_CMD_STREAM, NULL, 0);
+    while (host_status1(&status, REPLY_TICKS) && status.nb_params){
+    }
+    CHECK_EQ(status.nb_params, 0);
+    expect_silence(5 * SIM_TICKS_PER_MS);
+
+    // stopped by closing the port
+    send1(AX_ID_DEVICE, AX_CMD_STREAM, params, sizeof(params));
+    expect_status1(AX_ERROR_NONE, NULL, 0);
+    CHECK(host_status1(&status, REPLY_TICKS));
+    sim_close_port();
+    sim_run(5 * SIM_TICKS_PER_MS);
+    host_flush();
+    sim_open_port(SIM_BAUD);
+    expect_silence(5 * SIM_TICKS_PER_MS);
+    expect_ping();
+
+    uint8_t too_many[] = { 50, 0, 36, 100, 1, 2, 3 };
+    send1(AX_ID_DEVICE, AX_CMD_STREAM, too_many, sizeof(too_many));
+    expect_status1(AX_ERROR_RANGE, NULL, 0);
+}
+
+static void test_stream_reply_size(void){
+    add_servos(1, 90);
+    boot();
+    // a SCAN of every ID, with 90 servos: 123 parameters, the most it can send back
+    uint8_t scan[] = { 0, AX_ID_BROADCAST - 1, 1 };
+    send1(AX_ID_DEVICE, AX_CMD_SCAN, scan, sizeof(scan));
+    CHECK(host_status1(&status, SCAN_TICKS));
+    CHECK(status.valid);
+    CHECK_EQ(status.error, AX_ERROR_NONE);
+    CHECK_EQ(status.nb_params, 1 + 32 + 90);
+
+    // that reply is longer than the USB buffer left by a STREAM: refused rather than sent in part
+    uint8_t params[] = { 250, 0, 36, 2, 1 };
+    send1(AX_ID_DEVICE, AX_CMD_STREAM, params, sizeof(params));
+    expect_status1(AX_ERROR_NONE, NULL, 0);
+    send1(AX_ID_DEVICE, AX_CMD_SCAN, scan, sizeof(scan));
+    while (host_status1(&status, SCAN_TICKS) && status.valid && status.error == AX_ERROR_NONE){ // frames of the stream
+    }
+    CHECK(status.valid);
+    CHECK_EQ(status.error, AX_ERROR_RANGE);
+    CHECK_EQ(status.nb_params, 0);
+    CHECK_EQ(stat_get(STAT_USB_OVERFLOWS), 0);
+}
+
+
+// ***************************** Protocol 2.0 *****************************
+
+static void test_protocol2(void){
+    boot();
+    send2(AX_ID_DEVICE, AX_CMD_PING, NULL, 0);
+    const uint8_t model[] = { MODEL_NUMBER_L, MODEL_NUMBER_H, FIRMWARE_VERSION };
+    expect_status2(AX2_ERROR_NONE, model, sizeof(model));
+
+    uint8_t read[] = { ADDR_USART_TIMEOUT, 0, 3, 0 };
+    send2(AX_ID_DEVICE, AX_CMD_READ_DATA, read, sizeof(read));
+    const uint8_t timeouts[] = { USART_TIMEOUT, SEND_TIMEOUT, RECEIVE_TIMEOUT };
+    expect_status2(AX2_ERROR_NONE, timeouts, sizeof(timeouts));
+
+    uint8_t write[] = { ADDR_USART_TIMEOUT, 0, 25 };
+    send2(AX_ID_DEVICE, AX_CMD_WRITE_DATA, write, sizeof(write));
+    expect_status2(AX2_ERROR_NONE, NULL, 0);
+    CHECK_EQ(regs[ADDR_USART_TIMEOUT], 25);
+    uint8_t bad_write[] = { ADDR_USART_TIMEOUT, 0, 1 };
+    send2(AX_ID_DEVICE, AX_CMD_WRITE_DATA, bad_write, sizeof(bad_write));
+    expect_status2(AX2_ERROR_RANGE, NULL, 0);
+
+    send2(AX_ID_DEVICE, 0x7E, NULL, 0);
+    expect_status2(AX2_ERROR_INSTRUCTION, NULL, 0);
+
+    // bad CRC: dropped, passed to the bus
+    uint16_t size = dxl_packet2(packet, AX_ID_DEVICE, AX_CMD_PING, NULL, 0);
+    packet[size - 1] ^= 0x01;
+    host_send(packet, size);
+    expect_silence(5 * SIM_TICKS_PER_MS);
+    CHECK_EQ(stat_get(STAT_CHECKSUM_ERRORS), 1);
+    uint8_t sent[DXL_MAX_PACKET];
+    CHECK_EQ(bus_take(sent), size);
+    CHECK(memcmp(sent, packet, size) == 0);
+
+    // a length the USB2AX has no room for: refused from the header
+    const uint8_t too_long[] = { 0xFF, 0xFF, 0xFD, 0x00, AX_ID_DEVICE, 0x00, 0x02 };
+    host_send(too_long, sizeof(too_long));
+    expect_status2(AX2_ERROR_RANGE, NULL, 0);
+
+    // the replies go back to Protocol 1.0 afterwards
+    expect_ping();
+}
+
+static void test_protocol2_stuffing(void){
+    boot();
+    // a WRITE whose data needs byte stuffing: 0xFF 0xFF 0xFD is not a valid value, but it must be parsed as data
+    uint8_t write[] = { ADDR_USART_TIMEOUT, 0, 0xFF, 0xFF, 0xFD, 0 };
+    uint16_t size = dxl_packet2(packet, AX_ID_DEVICE, AX_CMD_WRITE_DATA, write, sizeof(write));
+    CHECK_EQ(size, 7 + 1 + sizeof(write) + 1 + 2);
+    host_send(packet, size);
+    expect_status2(AX2_ERROR_NONE, NULL, 0);
+    const uint8_t written[] = { 0xFF, 0xFF, 0xFD, 0 };
+    CHECK(memcmp(regs + ADDR_USART_TIMEOUT, written, sizeof(written)) == 0);
+
+    // and the reply to a READ of them is stuffed
+    uint8_t read[] = { ADDR_USART_TIMEOUT, 0, 4, 0 };
+    send2(AX_ID_DEVICE, AX_CMD_READ_DATA, read, sizeof(read));
+    expect_status2(AX2_ERROR_NONE, written, sizeof(written));
+
+    // 0xFF 0xFF 0xFD 0xFD is sent as 0xFF 0xFF 0xFD 0xFD 0xFD: only the first 0xFD after the 0xFF 0xFF 0xFD is added
+    const uint8_t twice[] = { 0xFF, 0xFF, 0xFD, 0xFD };
+    write[4] = 0xFD;
+    write[5] = 0xFD;
+    size = dxl_packet2(packet, AX_ID_DEVICE, AX_CMD_WRITE_DATA, write, sizeof(write));
+    CHECK_EQ(size, 7 + 1 + sizeof(write) + 1 + 2);
+    host_send(packet, size);
+    expect_status2(AX2_ERROR_NONE, NULL, 0);
+    CHECK(memcmp(regs + ADDR_USART_TIMEOUT, twice, sizeof(twice)) == 0);
+    send2(AX_ID_DEVICE, AX_CMD_READ_DATA, read, sizeof(read));
+    expect_status2(AX2_ERROR_NONE, twice, sizeof(twice));
+}
+
+static void test_protocol2_passthrough(void){
+    servo_t* servo = bus_add_servo(4, 2);
+    servo->table[36] = 0xAB;
+    servo->table[37] = 0xCD;
+    boot();
+    uint8_t read[] = { 36, 0, 2, 0 };
+    uint16_t size = dxl_packet2(packet, 4, AX_CMD_READ_DATA, read, sizeof(read));
+    host_send(packet, size);
+    CHECK(host_status2(&status, REPLY_TICKS));
+    CHECK(status.valid);
+    CHECK_EQ(status.id, 4);
+    CHECK_EQ(status.error, 0);
+    CHECK_BYTES(status.params, status.nb_params, 0xAB, 0xCD);
+    uint8_t sent[DXL_MAX_PACKET];
+    CHECK_EQ(bus_take(sent), size);
+    CHECK(memcmp(sent, packet, size) == 0);
+    CHECK_EQ(stat_get(STAT_LOCAL_COMMANDS), 0);
+}
+
+static void test_sync_read2(void){
+    for (uint8_t id = 4; id <= 6; id++){
+        servo_t* servo = bus_add_servo(id, 2);
+        servo->table[36] = id;
+        servo->table[37] = 0x10 + id;
+    }
+    bus_add_servo(7, 2)->mute = true;
+    boot();
+    uint8_t params[] = { 36, 0, 2, 0, 4, 7, 5 };
+    send2(AX_ID_DEVICE, AX2_CMD_SYNC_READ, params, sizeof(params));
+    const uint8_t data[] = { 4, 0x14, 0xFF, 0xFF, 5, 0x15 };
+    expect_status2(AX2_ERROR_NONE, data, sizeof(data));
+
+    uint8_t bulk[] = { 6, 37, 0, 1, 0, 4, 36, 0, 2, 0 };
+    send2(AX_ID_DEVICE, AX2_CMD_BULK_READ, bulk, sizeof(bulk));
+    const uint8_t bulk_data[] = { 0x16, 4, 0x14 };
+    expect_status2(AX2_ERROR_NONE, bulk_data, sizeof(bulk_data));
+
+    // more than the USB buffer can take
+    uint8_t too_much[] = { 0, 0, 100, 0, 4, 5, 6 };
+    send2(AX_ID_DEVICE, AX2_CMD_SYNC_READ, too_much, sizeof(too_much));
+    expect_status2(AX2_ERROR_RANGE, NULL, 0);
+    uint8_t not_fives[] = { 4, 36, 0, 2 };
+    send2(AX_ID_DEVICE, AX2_CMD_BULK_READ, not_fives, sizeof(not_fives));
+    expect_status2(AX2_ERROR_RANGE, NULL, 0);
+}
+
+
+// ***************************** reset *****************************
+
+static void test_reset(void){
+    boot();
+    reg_write(ADDR_USART_TIMEOUT, 30, AX_ERROR_NONE);
+    send1(AX_ID_DEVICE, AX_CMD_RESET, NULL, 0);
+    sim_run(SIM_TICKS_PER_MS);
+    CHECK(sim_halted());
+    CHECK( ! sim_bootload_requested() );
+    CHECK_BYTES(sim_eeprom, 4, 0, 0, 0, 0);
+}
+
+static void test_bootload(void){
+    boot();
+    send1(AX_ID_DEVICE, AX_CMD_BOOTLOAD, NULL, 0);
+    sim_run(SIM_TICKS_PER_MS);
+    CHECK(sim_bootload_requested());
+}
+
+static void test_bootload_1200(void){
+    boot();
+    sim_close_port();
+    sim_open_port(1200);
+    sim_run(SIM_TICKS_PER_MS);
+    CHECK( ! sim_halted() );
+    sim_close_port();
+    CHECK(sim_bootload_requested());
+}
+
+
+// ***************************** runner *****************************
+
+typedef struct {
+    const char* name;
+    void (*run)(void);
+} test_t;
+
+static const test_t tests[] = {
+    { "ping",                   test_ping },
+    { "registers",              test_registers },
+    { "eeprom_current",         test_eeprom_current },
+    { "eeprom_older_layout",    test_eeprom_older_layout },
+    { "bad_checksum",           test_bad_checksum },
+    { "too_long",               test_too_long },
+    { "passthrough",            test_passthrough },
+    { "noise",                  test_noise },
+    { "split_packets",          test_split_packets },
+    { "receive_timeout",        test_receive_timeout },
+    { "host_not_reading",       test_host_not_reading },
+    { "sync_read",              test_sync_read },
+    { "adaptive_timeouts",      test_adaptive_timeouts },
+    { "sync_read_continued",    test_sync_read_continued },
+    { "sync_write_read",        test_sync_write_read },
+    { "bulk_read",              test_bulk_read },
+    { "group",                  test_group },
+    { "scan",                   test_scan },
+    { "stream",                 test_stream },
+    { "stream_reply_size",      test_stream_reply_size },
+    { "protocol2",              test_protocol2 },
+    { "protocol2_stuffing",     test_protocol2_stuffing },
+    { "protocol2_passthrough",  test_protocol2_passthrough },
+    { "sync_read2",             test_sync_read2 },
+    { "reset",                  test_reset },
+    { "bootload",               test_bootload },
+    { "bootload_1200",          test_bootload_1200 },
+};
+
+int main(int argc, char** argv){
+    const char* filter = argc > 1 ? argv[1] : NULL;
+    unsigned nb_run = 0, nb_failed = 0;
+    for (unsigned i = 0; i < sizeof(tests) / sizeof(tests[0]); i++){
+        if (filter && ! strstr(tests[i].name, filter)){
+            continue;
+        }
+        fflush(stdout);
+        pid_t pid = fork();
+        if (pid == 0){
+            alarm(TEST_TIME_LIMIT);
+            tests[i].run();
+            exit(0);
+        }
+        int result;
+        waitpid(pid, &result, 0);
+        nb_run++;
+        if (WIFEXITED(result) && WEXITSTATUS(result) == 0){
+            printf("PASS  %s\n", tests[i].name);
+        } else {
+            nb_failed++;
+            if (WIFSIGNALED(result)){
+                printf("FAIL  %s (%s)\n", tests[i].name, strsignal(WTERMSIG(result)));
+            } else {
+                printf("FAIL  %s\n", tests[i].name);
+            }
+        }
+    }
+    printf("%u tests, %u failed\n", nb_run, nb_failed);
+    return nb_failed ? 1 : 0;
+}
@@ -0,0 +1,65 @@
+#! /usr/bin/env python
+# This script dumps the profiler table of a USB2AX built with USE_PROFILER (see debug.h).
+# Usage: usb2ax_profile.py [port] [--clear]
+# With --clear, the table is emptied after being read.
+# Requires PySerial
+
+import sys
+import serial
+
+COM_PORT = "/dev/ttyACM0"
+
+USB2AX_ID = 0xFD
+ADDR_PROFILER = 72
+PROBES = ["USART1_RX_vect", "send_USB_data", "parser step", "sync_read", "TIMER1_COMPA_vect"]
+PROBE_SIZE = 10
+TICK_US = 0.5
+
+
+def packet(instruction, params):
+    body = [USB2AX_ID, len(params) + 2, instruction] + params
+    return bytearray([0xFF, 0xFF] + body + [~sum(body) & 0xFF])
+
+def reply(ser, nb_params):
+    # an error reply has no parameters: read the shortest packet first, then the rest if it is not one
+    data = bytearray(ser.read(6))
+    if len(data) != 6 or data[:3] != bytearray([0xFF, 0xFF, USB2AX_ID]):
+        sys.exit("no valid reply from the USB2AX")
+    if data[4]:
+        sys.exit("the USB2AX answered with error 0x%02X, is it built with USE_PROFILER?" % data[4])
+    if data[3] != 2 + nb_params:
+        sys.exit("unexpected reply length from the USB2AX")
+    data += bytearray(ser.read(nb_params))
+    if len(data) != 6 + nb_params or (sum(data[2:]) & 0xFF) != 0xFF:
+        sys.exit("no valid reply from the USB2AX")
+    return data[5:-1]
+
+def word(data, i):
+    return data[i] | (data[i + 1] << 8)
+
+
+port = COM_PORT
+args = [a for a in sys.argv[1:] if a != "--clear"]
+if args:
+    port = args[0]
+ser = serial.Serial(port, 1000000, timeout=0.1)
+
+size = PROBE_SIZE * len(PROBES)
+ser.write(packet(0x02, [ADDR_PROFILER, size])) # READ_DATA
+table = reply(ser, size)
+
+print("%-16s %8s %10s %10s %10s" % ("probe", "runs", "min (us)", "mean (us)", "max (us)"))
+for n, name in enumerate(PROBES):
+    p = table[n * PROBE_SIZE:]
+    count = word(p, 0)
+    total = word(p, 6) | (word(p, 8) << 16)
+    if count == 0:
+        print("%-16s %8d" % (name, 0))
+    else:
+        print("%-16s %8d %10.1f %10.1f %10.1f" % (name, count, word(p, 2) * TICK_US, total * TICK_US / count, word(p, 4) * TICK_US))
+
+if "--clear" in sys.argv:
+    ser.write(packet(0x03, [ADDR_PROFILER] + [0] * size)) # WRITE_DATA
+    reply(ser, 0)
+
+ser.close()